@@ -0,0 +1,439 @@
+#include "batch.h"
+#include "cpu.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Batch runner. Jobs of the manifest are split into contiguous ranges, one per
+ * worker. Worker takes jobs from the front of its range and when it is empty,
+ * steals back half of the range of another worker. Every worker reuses one cpu
+ * with its memory, decoded instructions and output buffer for all its jobs.
+ * Output of a job goes to its file or to a memory stream printed by the main
+ * thread in manifest order.
+ */
+
+#define DEFAULT_STACK_CAPACITY 256
+#define MAX_FIELDS 4
+
+struct job
+{
+    char *program;
+    size_t stackCapacity;
+    char *input;        // NULL = no input
+    char *output;       // NULL = stdout in manifest order
+    char *text;         // buffered output
+    size_t length;
+    int failed;
+    int done;
+};
+
+struct queue
+{
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+};
+
+struct batch
+{
+    struct job *jobs;
+    size_t count;
+    struct queue *queues;
+    unsigned threads;
+    int inputFlags;
+    enum cpuProfile profile;
+    batchEngine run;
+    const char *engine;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+struct worker
+{
+    pthread_t thread;
+    struct batch *batch;
+    unsigned id;
+    struct cpu cpu;
+    int created;
+    int32_t *memory;
+    size_t memorySize;
+    size_t memoryUsed;          // bytes of memory which may be nonzero besides the stack
+};
+
+
+/*
+ * Take next job of worker id, steal half of other worker's range if its own is empty.
+ *
+ * Returns:
+ *      1 and index of the job in *job, 0 if there are no jobs left
+ */
+static int next_job(struct batch *batch, unsigned id, size_t *job)
+{
+    struct queue *own = &batch->queues[id];
+    pthread_mutex_lock(&own->lock);
+    if (own->begin < own->end) {
+        *job = own->begin++;
+        pthread_mutex_unlock(&own->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (unsigned i = 1; i < batch->threads; i++) {
+        struct queue *victim = &batch->queues[(id + i) % batch->threads];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end) {
+            size_t end = victim->end;
+            size_t begin = end - (end - victim->begin + 1) / 2;
+            victim->end = begin;
+            pthread_mutex_unlock(&victim->lock);
+
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            *job = begin;
+            return 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return 0;
+}
+
+
+/*
+ * Load program of the job into worker's memory and cpu.
+ *
+ * Returns:
+ *      0 if ok, 1 on error (reported to out)
+ */
+static int load_job(struct worker *worker, struct job *job, FILE *out)
+{
+    FILE *program = fopen(job->program, "rb");
+    if (program == NULL) {
+        fprintf(out, "Cannot open program %s\n", job->program);
+        return 1;
+    }
+    int32_t *stackBottom;
+    if (worker->created && worker->cpu.memory != NULL) {
+        // stack of the previous job is cleared up to its high water mark only
+        cpuReset(&worker->cpu);
+    }
+    worker->memory = cpuLoadMemory(program, job->stackCapacity, worker->memory, &worker->memorySize,
+                                   &worker->memoryUsed, &stackBottom);
+    fclose(program);
+    if (worker->memory == NULL) {
+        // old memory is freed, cpu must not free it again
+        worker->cpu.memory = NULL;
+        fprintf(out, "Cannot load program %s\n", job->program);
+        return 1;
+    }
+
+    if (!worker->created) {
+        cpuCreate(&worker->cpu, worker->memory, stackBottom, job->stackCapacity);
+        cpuSetProfile(&worker->cpu, worker->batch->profile);
+        worker->created = 1;
+    } else {
+        cpuSetMemory(&worker->cpu, worker->memory, stackBottom, job->stackCapacity);
+    }
+    return 0;
+}
+
+
+/*
+ * Run one job on worker's cpu, output is written to job's file or buffer.
+ */
+static void run_job(struct worker *worker, struct job *job)
+{
+    struct batch *batch = worker->batch;
+    FILE *out;
+    if (job->output != NULL) {
+        out = fopen(job->output, "w");
+    } else {
+        out = open_memstream(&job->text, &job->length);
+    }
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open output %s\n", job->output != NULL ? job->output : job->program);
+        job->failed = 1;
+        return;
+    }
+
+    FILE *input = NULL;
+    if (job->input != NULL && (input = fopen(job->input, "rb")) == NULL) {
+        fprintf(out, "Cannot open input %s\n", job->input);
+        job->failed = 1;
+    } else if (load_job(worker, job, out) != 0) {
+        job->failed = 1;
+    } else {
+        cpuSetOutput(&worker->cpu, out);
+        cpuSetInput(&worker->cpu, input, batch->inputFlags);
+        int result = batch->run(&worker->cpu, batch->engine);
+        cpuPrintState(&worker->cpu, out);
+        fprintf(out, "'cpuRun' result: %d\n", result);
+        cpuSetInput(&worker->cpu, NULL, cpuInputText);
+        cpuSetOutput(&worker->cpu, stdout);
+    }
+
+    if (input != NULL) {
+        fclose(input);
+    }
+    fclose(out);
+}
+
+
+/*
+ * Worker thread, runs jobs until all are taken.
+ */
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct batch *batch = worker->batch;
+    size_t index;
+
+    while (next_job(batch, worker->id, &index)) {
+        struct job *job = &batch->jobs[index];
+        run_job(worker, job);
+
+        pthread_mutex_lock(&batch->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+
+/*
+ * Split line to whitespace separated fields.
+ *
+ * Returns:
+ *      number of fields, MAX_FIELDS + 1 if there are too many
+ */
+static int split_fields(char *line, char *fields[MAX_FIELDS])
+{
+    int count = 0;
+    for (char *p = line; *p != '\0';) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            *p++ = '\0';
+        }
+        if (*p == '\0' || *p == '#') {
+            break;
+        }
+        if (count == MAX_FIELDS) {
+            return MAX_FIELDS + 1;
+        }
+        fields[count++] = p;
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Copy manifest field, '-' (default) is translated to NULL.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+static int copy_field(char **dest, int count, char *fields[MAX_FIELDS], int index)
+{
+    *dest = NULL;
+    if (index >= count || strcmp(fields[index], "-") == 0) {
+        return 0;
+    }
+    if ((*dest = malloc(strlen(fields[index]) + 1)) == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+    strcpy(*dest, fields[index]);
+    return 0;
+}
+
+
+/*
+ * Parse manifest to array of jobs.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+static int read_manifest(FILE *manifest, struct batch *batch)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t capacity = 0;
+    int line_number = 0;
+    int ret = 0;
+
+    while (getline(&line, &line_size, manifest) != -1) {
+        char *fields[MAX_FIELDS];
+        line_number++;
+        int count = split_fields(line, fields);
+        if (count == 0) {
+            continue;
+        }
+        if (count > MAX_FIELDS || strcmp(fields[0], "-") == 0) {
+            fprintf(stderr, "Invalid manifest line %d\n", line_number);
+            ret = 1;
+            break;
+        }
+
+        if (batch->count == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            struct job *jobs = realloc(batch->jobs, capacity * sizeof(struct job));
+            if (jobs == NULL) {
+                fprintf(stderr, "Allocation error!");
+                ret = 1;
+                break;
+            }
+            batch->jobs = jobs;
+        }
+        struct job *job = &batch->jobs[batch->count];
+        memset(job, 0, sizeof(struct job));
+        batch->count++;
+
+        job->stackCapacity = DEFAULT_STACK_CAPACITY;
+        if (count > 1 && strcmp(fields[1], "-") != 0) {
+            char *end;
+            errno = 0;
+            long value = strtol(fields[1], &end, 10);
+            if (*end != '\0' || value < 0 || errno == ERANGE) {
+                fprintf(stderr, "Invalid stack capacity on manifest line %d\n", line_number);
+                ret = 1;
+                break;
+            }
+            job->stackCapacity = value;
+        }
+        if (copy_field(&job->program, count, fields, 0) || copy_field(&job->input, count, fields, 2)
+                || copy_field(&job->output, count, fields, 3)) {
+            ret = 1;
+            break;
+        }
+    }
+
+    free(line);
+    return ret;
+}
+
+
+/*
+ * Run jobs of manifest on pool of threads. Results do not depend on number
+ * of threads, output of jobs without output file is printed to stdout
+ * in manifest order.
+ *
+ * Args:
+ *      manifest - file with one job per line: PROGRAM [STACK_CAPACITY [INPUT [OUTPUT]]],
+ *                 '-' is default value (256, no input, stdout), '#' starts comment
+ *      threads - number of worker threads, 0 = number of processors
+ *      inputFlags - cpuInputFlags of job inputs
+ *      profile - instruction set of all jobs
+ *      run - runs loaded cpu
+ *      engine - passed to run
+ *
+ * Returns:
+ *      0 if all jobs were run, 1 otherwise
+ */
+int batchRun(FILE *manifest, unsigned threads, int inputFlags, enum cpuProfile profile, batchEngine run, const char *engine)
+{
+    assert(manifest != NULL);
+    assert(run != NULL);
+
+    struct batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.inputFlags = inputFlags;
+    batch.profile = profile;
+    batch.run = run;
+    batch.engine = engine;
+    int ret = read_manifest(manifest, &batch);
+
+    if (threads == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = processors > 0 ? (unsigned) processors : 1;
+    }
+    if (threads > batch.count) {
+        threads = batch.count > 0 ? batch.count : 1;
+    }
+    batch.threads = threads;
+    batch.queues = malloc(threads * sizeof(struct queue));
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if (batch.queues == NULL || workers == NULL) {
+        fprintf(stderr, "Allocation error!");
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.done, NULL);
+        for (unsigned i = 0; i < threads; i++) {
+            pthread_mutex_init(&batch.queues[i].lock, NULL);
+            batch.queues[i].begin = batch.count * i / threads;
+            batch.queues[i].end = batch.count * (i + 1) / threads;
+        }
+        unsigned started = 0;
+        for (; started < threads; started++) {
+            workers[started].batch = &batch;
+            workers[started].id = started;
+            if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            // jobs are run by this thread
+            workers[0].batch = &batch;
+            worker_main(&workers[0]);
+        }
+
+        for (size_t i = 0; i < batch.count; i++) {
+            struct job *job = &batch.jobs[i];
+            pthread_mutex_lock(&batch.lock);
+            while (!job->done) {
+                pthread_cond_wait(&batch.done, &batch.lock);
+            }
+            pthread_mutex_unlock(&batch.lock);
+
+            if (job->output == NULL) {
+                printf("==> %s <==\n", job->program);
+                if (job->text != NULL) {
+                    fwrite(job->text, 1, job->length, stdout);
+                }
+            }
+            if (job->failed) {
+                ret = 1;
+            }
+            free(job->text);
+            job->text = NULL;
+        }
+
+        for (unsigned i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            pthread_mutex_destroy(&batch.queues[i].lock);
+            if (workers[i].created) {
+                // memory may be larger than the last job, it is freed by its size
+                workers[i].cpu.memory = NULL;
+                cpuDestroy(&workers[i].cpu);
+            }
+            if (workers[i].memory != NULL) {
+                cpuFreeMemory(workers[i].memory, workers[i].memorySize);
+            }
+        }
+        pthread_cond_destroy(&batch.done);
+        pthread_mutex_destroy(&batch.lock);
+    }
+
+    for (size_t i = 0; i < batch.count; i++) {
+        free(batch.jobs[i].program);
+        free(batch.jobs[i].input);
+        free(batch.jobs[i].output);
+    }
+    free(batch.jobs);
+    free(batch.queues);
+    free(workers);
+    return ret;
+}
@@ -0,0 +1,20 @@
+#include "cpu.h"
+#include <stdio.h>
+
+
+/* Runs many programs on a pool of threads */
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Runs program on the cpu using engine, returns result of cpuRun.
+ */
+typedef int (*batchEngine)(struct cpu *cpu, const char *engine);
+
+/*
+ * Run jobs of manifest on threads (0 = number of processors) with instruction set profile.
+ * Manifest line: PROGRAM [STACK_CAPACITY [INPUT [OUTPUT]]], '-' is default value.
+ */
+int batchRun(FILE *manifest, unsigned threads, int inputFlags, enum cpuProfile profile, batchEngine run, const char *engine);
+
+#endif
@@ -0,0 +1,438 @@
+#include "cpu.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define invalidArgs "Invalid arguments, run ./cpu_bench [-j] [-n steps] [-r repeats] [-w workload] [-e engine]\n"
+
+/*
+ * Benchmark of engines. Workloads are generated programs which do not finish
+ * before the step limit, so every engine executes exactly the same number
+ * of instructions. Every workload/engine pair runs in its own process to
+ * measure its peak RSS, the best time of all repeats is reported.
+ */
+
+#define DEFAULT_STEPS 50000000
+#define DEFAULT_REPEATS 3
+#define STACK_CAPACITY 256
+#define LOCKSTEP_LANES 16
+#define MAX_WORDS 64
+#define COUNTER 2000000000
+
+enum op
+{
+    NOP, HALT, ADD, SUB, MUL, DIV, INC, DEC, LOOP, MOVR, LOAD, STORE, IN, GET, OUT, PUT, SWAP, PUSH, POP,
+    CMP, JMP, JZ, JNZ, JGT, CALL, RET
+};
+
+enum reg { A, B, C, D };
+
+struct workload
+{
+    const char *name;
+    enum cpuProfile profile;
+    int32_t code[MAX_WORDS];
+};
+
+static const struct workload workloads[] = {
+    /* dec C, loop, run in closed form by engines of decoded program (see cpuRunLoop) */
+    { "loop", cpuProfileBase, {
+        MOVR, C, COUNTER,
+        DEC, C,                 // 3
+        LOOP, 3,
+        HALT,
+    } },
+    /* the same loop with stack instructions, which are never run in closed form */
+    { "loop-push", cpuProfileBase, {
+        MOVR, C, COUNTER,
+        PUSH, A,                // 3
+        POP, A,
+        DEC, C,
+        LOOP, 3,
+        HALT,
+    } },
+    /* push/pop/load/store around the top of the stack */
+    { "stack", cpuProfileBase, {
+        MOVR, C, COUNTER,
+        MOVR, D, 0,
+        PUSH, A,                // 6
+        PUSH, B,
+        LOAD, A, 0,
+        STORE, B, 1,
+        POP, B,
+        POP, A,
+        INC, A,
+        DEC, C,
+        LOOP, 6,
+        HALT,
+    } },
+    /* chain of arithmetic instructions */
+    { "arith", cpuProfileBase, {
+        MOVR, A, 1,
+        MOVR, B, 3,
+        MOVR, C, COUNTER,
+        MOVR, D, 7,
+        ADD, B,                 // 12
+        MUL, D,
+        SUB, B,
+        DIV, D,
+        INC, A,
+        SWAP, A, B,
+        INC, B,
+        SWAP, B, A,
+        DEC, C,
+        LOOP, 12,
+        HALT,
+    } },
+    /* out/put stream */
+    { "io", cpuProfileBase, {
+        MOVR, C, COUNTER,
+        MOVR, B, 'x',
+        MOVR, D, '\n',
+        OUT, A,                 // 9
+        PUT, B,
+        PUT, D,
+        INC, A,
+        DEC, C,
+        LOOP, 9,
+        HALT,
+    } },
+    /* compare and conditional jumps */
+    { "branch", cpuProfileJmp, {
+        MOVR, C, COUNTER,
+        MOVR, B, 3,
+        INC, A,                 // 6
+        CMP, A, B,
+        JGT, 15,
+        JMP, 18,
+        MOVR, A, 0,             // 15
+        DEC, C,                 // 18
+        JNZ, 6,
+        HALT,
+    } },
+    /* nested calls */
+    { "call", cpuProfileCall, {
+        MOVR, C, COUNTER,
+        CALL, 11,               // 3
+        DEC, C,
+        LOOP, 3,
+        HALT,
+        NOP,
+        INC, A,                 // 11
+        CALL, 16,
+        RET,
+        INC, B,                 // 16
+        RET,
+    } },
+};
+
+struct engine
+{
+    const char *name;
+    bool standard;              // measured unless engine is selected by -e
+};
+
+static const struct engine engines[] = {
+    { "step", true },
+    { "decoded", true },
+    { "threaded", true },
+    { "verified", true },
+    { "jit", true },
+    { "compact", true },
+    { "counted", true },
+    { "lockstep", true },
+    /* compiles every workload by the system compiler */
+    { "native", false },
+};
+
+struct result
+{
+    int ok;
+    size_t instructions;
+    double seconds;
+    long peakRss;
+    uint32_t checksum;
+};
+
+
+/*
+ * Load workload into new memory and create cpu, output goes to /dev/null.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+static int load(struct cpu *cpu, const struct workload *workload, FILE *output)
+{
+    FILE *program = fmemopen((void *) workload->code, sizeof(workload->code), "rb");
+    if (program == NULL) {
+        return 1;
+    }
+    int32_t *stackBottom;
+    int32_t *memory = cpuCreateMemory(program, STACK_CAPACITY, &stackBottom);
+    fclose(program);
+    if (memory == NULL) {
+        return 1;
+    }
+    cpuCreate(cpu, memory, stackBottom, STACK_CAPACITY);
+    cpuSetProfile(cpu, workload->profile);
+    cpuSetOutput(cpu, output);
+    cpuSetInput(cpu, NULL, cpuInputText);
+    return 0;
+}
+
+
+/*
+ * Checksum of cpu state to compare engines.
+ */
+static uint32_t checksum(const struct cpu *cpu)
+{
+    uint32_t sum = 2166136261u;
+    const int32_t values[] = { cpu->A, cpu->B, cpu->C, cpu->D, cpu->stackSize, cpu->instructionPointer, cpu->status };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        sum = (sum ^ (uint32_t) values[i]) * 16777619u;
+    }
+    return sum;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Run workload once by engine.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+static int run_once(const struct workload *workload, const char *engine, size_t steps, FILE *output,
+                    struct result *result)
+{
+    struct cpu cpus[LOCKSTEP_LANES];
+    struct cpu *lanes[LOCKSTEP_LANES];
+    int results[LOCKSTEP_LANES];
+    int count = strcmp(engine, "lockstep") == 0 ? LOCKSTEP_LANES : 1;
+    int created = 0;
+    int ret = 0;
+
+    for (; created < count; created++) {
+        if (load(&cpus[created], workload, output) != 0) {
+            ret = 1;
+            break;
+        }
+        lanes[created] = &cpus[created];
+    }
+    bool decoded = strcmp(engine, "step") != 0 && strcmp(engine, "compact") != 0 && strcmp(engine, "counted") != 0;
+    if (ret == 0 && decoded && cpuDecode(&cpus[0]) != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && strcmp(engine, "verified") == 0 && cpuVerify(&cpus[0]) != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && strcmp(engine, "jit") == 0 && cpuJitCreate(&cpus[0]) != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && strcmp(engine, "compact") == 0 && cpuCompactCreate(&cpus[0]) != 0) {
+        ret = 1;
+    }
+    if (ret == 0 && strcmp(engine, "native") == 0 && cpuNativeCreate(&cpus[0], NULL) != 0) {
+        ret = 1;
+    }
+
+    if (ret == 0) {
+        double start = now();
+        int executed;
+        if (strcmp(engine, "step") == 0) {
+            executed = cpuRun(&cpus[0], steps);
+        } else if (strcmp(engine, "decoded") == 0) {
+            executed = cpuRunDecoded(&cpus[0], steps);
+        } else if (strcmp(engine, "threaded") == 0) {
+            executed = cpuRunThreaded(&cpus[0], steps);
+        } else if (strcmp(engine, "verified") == 0) {
+            executed = cpuRunVerified(&cpus[0], steps);
+        } else if (strcmp(engine, "jit") == 0) {
+            executed = cpuRunJit(&cpus[0], steps);
+            cpuJitDestroy(&cpus[0]);
+        } else if (strcmp(engine, "compact") == 0) {
+            executed = cpuRunCompact(&cpus[0], steps);
+            cpuCompactDestroy(&cpus[0]);
+        } else if (strcmp(engine, "counted") == 0) {
+            executed = cpuRunCounted(&cpus[0], steps);
+        } else if (strcmp(engine, "native") == 0) {
+            executed = cpuRunNative(&cpus[0], steps);
+            cpuNativeDestroy(&cpus[0]);
+        } else {
+            /* Every lane runs its part of steps */
+            executed = 0;
+            if (cpuRunLockstep(lanes, count, steps / count, results) != 0) {
+                ret = 1;
+            }
+            for (int i = 0; i < count; i++) {
+                executed += results[i];
+            }
+        }
+        result->seconds = now() - start;
+        result->instructions = executed < 0 ? -executed : executed;
+        result->checksum = checksum(&cpus[0]);
+    }
+
+    for (int i = 0; i < created; i++) {
+        cpuSetOutput(&cpus[i], stdout);
+        cpuDestroy(&cpus[i]);
+    }
+    return ret;
+}
+
+
+/*
+ * Run workload by engine in child process, best of repeats.
+ */
+static void measure(const struct workload *workload, const char *engine, size_t steps, int repeats,
+                    struct result *result)
+{
+    int fds[2];
+    memset(result, 0, sizeof(*result));
+    fflush(stdout);
+    if (pipe(fds) != 0) {
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        struct result best;
+        memset(&best, 0, sizeof(best));
+        FILE *output = fopen("/dev/null", "w");
+        for (int i = 0; output != NULL && i < repeats; i++) {
+            struct result current;
+            if (run_once(workload, engine, steps, output, &current) != 0) {
+                break;
+            }
+            if (!best.ok || current.seconds < best.seconds) {
+                best = current;
+                best.ok = 1;
+            }
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        best.peakRss = usage.ru_maxrss;
+        if (write(fds[1], &best, sizeof(best)) != sizeof(best)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (pid > 0) {
+        if (read(fds[0], result, sizeof(*result)) != sizeof(*result)) {
+            result->ok = 0;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    close(fds[0]);
+}
+
+
+/*
+ * Options:
+ * -j - JSON output
+ * -n - instructions per run (default 50M)
+ * -r - number of repeats, the best time is reported (default 3)
+ * -w - run only this workload
+ * -e - run only this engine (native is run only if selected)
+ */
+int main(int argc, char *argv[])
+{
+    size_t steps = DEFAULT_STEPS;
+    int repeats = DEFAULT_REPEATS;
+    const char *onlyWorkload = NULL;
+    const char *onlyEngine = NULL;
+    bool json = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "jn:r:w:e:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = true;
+            break;
+        case 'n':
+            steps = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'w':
+            onlyWorkload = optarg;
+            break;
+        case 'e':
+            onlyEngine = optarg;
+            break;
+        default:
+            printf(invalidArgs);
+            return 1;
+        }
+    }
+    if (optind != argc || steps == 0 || steps > INT32_MAX || repeats <= 0) {
+        printf(invalidArgs);
+        return 1;
+    }
+
+    if (json) {
+        printf("{\n  \"steps\": %zu,\n  \"repeats\": %d,\n  \"results\": [", steps, repeats);
+    } else {
+        printf("%-10s %-10s %14s %10s %14s %10s\n", "workload", "engine", "inst/s", "ns/inst", "peak RSS (KB)", "state");
+    }
+
+    int ret = 0;
+    bool first = true;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if (onlyWorkload != NULL && strcmp(onlyWorkload, workloads[w].name) != 0) {
+            continue;
+        }
+        uint32_t reference = 0;
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+            if (onlyEngine != NULL ? strcmp(onlyEngine, engines[e].name) != 0 : !engines[e].standard) {
+                continue;
+            }
+            struct result result;
+            measure(&workloads[w], engines[e].name, steps, repeats, &result);
+            if (e == 0) {
+                reference = result.checksum;
+            }
+
+            /* Lanes of lockstep run different number of steps than other engines */
+            const char *state = !result.ok ? "error" :
+                                e == 0 || onlyEngine != NULL || strcmp(engines[e].name, "lockstep") == 0 ? "-" :
+                                result.checksum == reference ? "same" : "differs";
+            double ips = result.seconds > 0 ? result.instructions / result.seconds : 0;
+            double ns = result.instructions > 0 ? result.seconds * 1e9 / result.instructions : 0;
+            if (!result.ok || strcmp(state, "differs") == 0) {
+                ret = 1;
+            }
+
+            if (json) {
+                printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"ok\": %s, \"instructions\": %zu, "
+                       "\"seconds\": %.6f, \"ips\": %.0f, \"ns_per_inst\": %.3f, \"peak_rss_kb\": %ld, \"state\": \"%s\"}",
+                       first ? "" : ",", workloads[w].name, engines[e].name, result.ok ? "true" : "false",
+                       result.instructions, result.seconds, ips, ns, result.peakRss, state);
+            } else {
+                printf("%-10s %-10s %14.0f %10.3f %14ld %10s\n", workloads[w].name, engines[e].name, ips, ns,
+                       result.peakRss, state);
+            }
+            fflush(stdout);
+            first = false;
+        }
+    }
+
+    if (json) {
+        printf("\n  ]\n}\n");
+    }
+    return ret;
+}
@@ -0,0 +1,329 @@
+#include "cpu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * On-disk cache of decoded programs. A cache file is named by hash of the memory
+ * and the profile and holds the memory words (to rule out hash collisions),
+ * decoded records, counted loops and the verdict of cpuVerify. Loading maps the
+ * file read-only and points the cpu to it, nothing is decoded again.
+ *
+ * Files are written to a temporary name and renamed, so concurrent processes
+ * see either no file or a complete one, and a file is never changed once it
+ * has its name. File of another layout, version or build (fingerprint of the
+ * handlers) is just a miss, and so is a file whose records or loops do not pass
+ * cpuCheckDecoded, as the directory may be shared with other processes.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Increment whenever decoding or layout of records and loops changes */
+#define CACHE_VERSION 3
+#define CACHE_MAGIC "CPUDEC\n"
+
+struct cpuCache
+{
+    void *map;
+    size_t size;
+};
+
+struct cacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t profile;
+    uint64_t hash;
+    int32_t size;               // memory words = decoded records
+    int32_t loopCount;
+    uint32_t recordSize;
+    uint32_t loopSize;
+    uint32_t verified;          // 1 if map of verified instructions is stored
+    uint32_t reserved;
+    uint64_t handlers;          // cpuDecodedFingerprint
+};
+
+/*
+ * Sections of a cache file, every one starts 8 byte aligned.
+ */
+struct cacheLayout
+{
+    size_t words;
+    size_t records;
+    size_t loops;
+    size_t verified;
+    size_t size;
+};
+
+
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~(size_t) 7;
+}
+
+
+static void cache_layout(const struct cacheHeader *header, struct cacheLayout *layout)
+{
+    layout->words = align8(sizeof(struct cacheHeader));
+    layout->records = align8(layout->words + header->size * sizeof(int32_t));
+    layout->loops = align8(layout->records + header->size * sizeof(struct cpuInstruction));
+    layout->verified = align8(layout->loops + header->loopCount * sizeof(struct cpuLoop));
+    layout->size = layout->verified + (header->verified ? header->size : 0);
+}
+
+
+/*
+ * FNV-1a of the memory words.
+ */
+static uint64_t cache_hash(const int32_t *memory, int32_t size)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (int32_t i = 0; i < size; i++) {
+        uint32_t word = (uint32_t) memory[i];
+        for (int byte = 0; byte < 4; byte++) {
+            hash = (hash ^ ((word >> (8 * byte)) & 0xff)) * 1099511628211u;
+        }
+    }
+    return hash;
+}
+
+
+/*
+ * Header of cache file for the program in memory of the cpu.
+ */
+static void cache_header(const struct cpu *cpu, struct cacheHeader *header)
+{
+    memset(header, 0, sizeof(struct cacheHeader));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = CACHE_VERSION;
+    header->profile = cpu->profile;
+    header->size = cpu->stackLimit - cpu->memory + 1;
+    header->hash = cache_hash(cpu->memory, header->size);
+    header->recordSize = sizeof(struct cpuInstruction);
+    header->loopSize = sizeof(struct cpuLoop);
+    header->handlers = cpuDecodedFingerprint();
+}
+
+
+/*
+ * Path of the cache file "DIRECTORY/HASH-PROFILE.dec", NULL on allocation error.
+ */
+static char *cache_path(const char *directory, const struct cacheHeader *header)
+{
+    size_t length = strlen(directory) + 64;
+    char *path = malloc(length);
+    if (path == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return NULL;
+    }
+    snprintf(path, length, "%s/%016" PRIx64 "-%s.dec", directory, header->hash,
+             cpuProfileName((enum cpuProfile) header->profile));
+    return path;
+}
+
+
+/*
+ * Map decoded program of the cpu from cache in directory. The cpu has to be freshly
+ * created (or reset with clean stack) and not decoded, cached records replace decoding
+ * by cpuDecode and verification by cpuVerify (which returns the cached verdict).
+ * Mapped program has to be released by cpuCacheClose.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      directory - cache directory
+ *
+ * Returns:
+ *      0 if the program was loaded, 1 otherwise (not cached, invalid or unsupported platform)
+ */
+int cpuCacheLoad(struct cpu *cpu, const char *directory)
+{
+    assert(cpu != NULL);
+    assert(directory != NULL);
+    assert(cpu->cache == NULL);
+
+    struct cacheHeader expected;
+    cache_header(cpu, &expected);
+    char *path = cache_path(directory, &expected);
+    if (path == NULL) {
+        return 1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct cacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+
+    const struct cacheHeader *header = map;
+    struct cacheLayout layout;
+    expected.loopCount = header->loopCount;
+    expected.verified = header->verified;
+    cache_layout(&expected, &layout);
+    struct cpuCache *cache = NULL;
+    if (header->loopCount < 0 || memcmp(header, &expected, sizeof(struct cacheHeader)) != 0 ||
+            layout.size != (size_t) st.st_size ||
+            memcmp((const char *) map + layout.words, cpu->memory, expected.size * sizeof(int32_t)) != 0 ||
+            cpuCheckDecoded(cpu, (const struct cpuInstruction *) ((const char *) map + layout.records),
+                            (const struct cpuLoop *) ((const char *) map + layout.loops), header->loopCount) != 0 ||
+            (cache = malloc(sizeof(struct cpuCache))) == NULL) {
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    free(cpu->decoded);
+    free(cpu->verified);
+    free(cpu->loops);
+    cache->map = map;
+    cache->size = st.st_size;
+    cpu->cache = cache;
+    cpu->decoded = (struct cpuInstruction *) ((char *) map + layout.records);
+    cpu->decodedSize = header->size;
+    cpu->loops = header->loopCount > 0 ? (struct cpuLoop *) ((char *) map + layout.loops) : NULL;
+    cpu->loopCount = header->loopCount;
+    cpu->verified = header->verified ? (uint8_t *) map + layout.verified : NULL;
+    return 0;
+}
+
+
+/*
+ * Store decoded program of the cpu to cache in directory. The program is verified
+ * by cpuVerify first, so the verdict is cached too. Memory has to be as loaded
+ * (stack is part of the cached memory, so it has to be clean).
+ *
+ * Args:
+ *      cpu - emulated cpu structure, instructions have to be decoded by cpuDecode
+ *      directory - cache directory
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise
+ */
+int cpuCacheStore(struct cpu *cpu, const char *directory)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+    assert(cpu->traps == NULL);
+    assert(directory != NULL);
+
+    struct cacheHeader header;
+    struct cacheLayout layout;
+    cache_header(cpu, &header);
+    if (cpu->decodedSize != header.size) {
+        return 1;
+    }
+    header.verified = cpuVerify(cpu) == 0;
+    header.loopCount = cpu->loopCount;
+    cache_layout(&header, &layout);
+
+    char *path = cache_path(directory, &header);
+    if (path == NULL) {
+        return 1;
+    }
+    size_t length = strlen(directory) + 32;
+    char *temporary = malloc(length);
+    char *data = calloc(layout.size, 1);
+    if (temporary == NULL || data == NULL) {
+        fprintf(stderr, "Allocation error!");
+        free(path);
+        free(temporary);
+        free(data);
+        return 1;
+    }
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + layout.words, cpu->memory, header.size * sizeof(int32_t));
+    memcpy(data + layout.records, cpu->decoded, header.size * sizeof(struct cpuInstruction));
+    if (header.loopCount > 0) {
+        memcpy(data + layout.loops, cpu->loops, header.loopCount * sizeof(struct cpuLoop));
+    }
+    if (header.verified) {
+        memcpy(data + layout.verified, cpu->verified, header.size);
+    }
+
+    snprintf(temporary, length, "%s/.tmp-XXXXXX", directory);
+    int ret = 1;
+    int fd = mkstemp(temporary);
+    if (fd < 0) {
+        perror(temporary);
+    } else {
+        fchmod(fd, 0644);
+        FILE *out = fdopen(fd, "wb");
+        if (out == NULL) {
+            close(fd);
+        } else {
+            ret = fwrite(data, 1, layout.size, out) != layout.size;
+            ret |= fclose(out) != 0;
+        }
+        // rename is atomic, readers never see a partial file
+        if (ret == 0 && rename(temporary, path) != 0) {
+            perror(path);
+            ret = 1;
+        }
+        if (ret != 0) {
+            unlink(temporary);
+        }
+    }
+    free(path);
+    free(temporary);
+    free(data);
+    return ret;
+}
+
+
+/*
+ * Unmap cached program of the cpu, the cpu is not decoded after it.
+ */
+void cpuCacheClose(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->cache == NULL) {
+        return;
+    }
+    munmap(cpu->cache->map, cpu->cache->size);
+    free(cpu->cache);
+    cpu->cache = NULL;
+    cpu->decoded = NULL;
+    cpu->decodedSize = 0;
+    cpu->verified = NULL;
+    cpu->loops = NULL;
+    cpu->loopCount = 0;
+}
+
+#else
+
+int cpuCacheLoad(struct cpu *cpu, const char *directory)
+{
+    (void) cpu;
+    (void) directory;
+    return 1;
+}
+
+
+int cpuCacheStore(struct cpu *cpu, const char *directory)
+{
+    (void) cpu;
+    (void) directory;
+    return 1;
+}
+
+
+void cpuCacheClose(struct cpu *cpu)
+{
+    (void) cpu;
+}
+
+#endif
@@ -0,0 +1,655 @@
+#include "cpu.h"
+#include "varint.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Compact bytecode. Program image is a sequence of items, every item stands for
+ * one instruction (all its words) or one word which is not an instruction:
+ *      opcode      - one byte, COMPACT_RAW for a word which is not an instruction
+ *      registers   - one byte with register operands in nibbles (the first one low)
+ *      immediate   - value of movr, offset of load/store (zigzag varint)
+ *      target      - target of loop, jumps and call relative to the instruction (zigzag varint)
+ *      word        - the word of COMPACT_RAW (zigzag varint)
+ * Numbers are LEB128 varints. A word is an instruction if its opcode is valid
+ * in some profile, all its operands are in the image and register operands are 0-3.
+ * Converting back gives the same words, so the format is lossless.
+ *
+ * File is magic, version, number of words (varint) and items. cpuCompactCreate
+ * encodes memory of a cpu in the same way and cpuRunCompact executes the items
+ * directly. Instruction pointer stays a word address, jump targets are remapped
+ * to items by table of item offsets by words.
+ */
+
+#define COMPACT_MAGIC "CPUC"
+#define COMPACT_VERSION 1
+#define COMPACT_RAW 0xff
+#define COMPACT_END 0xfe            // end of executable code
+#define COMPACT_MAX_ITEM 12
+
+enum compactOperands
+{
+    OPERANDS_NONE,
+    OPERANDS_REG,
+    OPERANDS_REG_IMMEDIATE,
+    OPERANDS_REGS,
+    OPERANDS_TARGET
+};
+
+struct cpuCompact
+{
+    uint8_t *code;
+    size_t size;
+    int32_t *offsets;           // offset of item by word, -1 inside of instructions
+    int32_t words;
+};
+
+/*
+ * Growable byte buffer for encoded items.
+ */
+struct compactBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+};
+
+
+static enum compactOperands compact_operands(int32_t opcode)
+{
+    switch (opcode) {
+    case cpuOpNop:
+    case cpuOpHalt:
+    case cpuOpRet:
+        return OPERANDS_NONE;
+    case cpuOpMovr:
+    case cpuOpLoad:
+    case cpuOpStore:
+        return OPERANDS_REG_IMMEDIATE;
+    case cpuOpSwap:
+    case cpuOpCmp:
+        return OPERANDS_REGS;
+    case cpuOpLoop:
+    case cpuOpJmp:
+    case cpuOpJz:
+    case cpuOpJnz:
+    case cpuOpJgt:
+    case cpuOpCall:
+        return OPERANDS_TARGET;
+    default:
+        return OPERANDS_REG;
+    }
+}
+
+
+static void buffer_append(struct compactBuffer *buffer, const uint8_t *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (buffer->size + size > capacity) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(&buffer->data[buffer->size], data, size);
+    buffer->size += size;
+}
+
+
+/*
+ * Returns:
+ *      number of words of the instruction at ip if it can be encoded as instruction, 0 otherwise
+ */
+static int32_t instruction_words(const int32_t *words, int32_t count, int32_t ip)
+{
+    int32_t opcode = words[ip];
+    int32_t length = cpuOpcodeLength(opcode, CPU_PROFILES - 1);
+    if (length == 0 || length > count - ip) {
+        return 0;
+    }
+    switch (compact_operands(opcode)) {
+    case OPERANDS_REGS:
+        if ((uint32_t) words[ip + 2] > 3) {
+            return 0;
+        }
+        /* fall through */
+    case OPERANDS_REG:
+    case OPERANDS_REG_IMMEDIATE:
+        if ((uint32_t) words[ip + 1] > 3) {
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+    return length;
+}
+
+
+/*
+ * Encode count words into items, offsets of items are stored to offsets (may be NULL).
+ */
+static void compact_encode(const int32_t *words, int32_t count, struct compactBuffer *out, int32_t *offsets)
+{
+    int32_t ip = 0;
+    while (ip < count && !out->failed) {
+        uint8_t item[COMPACT_MAX_ITEM];
+        size_t size = 0;
+        int32_t length = instruction_words(words, count, ip);
+        if (offsets != NULL) {
+            offsets[ip] = out->size;
+            for (int32_t i = 1; i < length; i++) {
+                offsets[ip + i] = -1;
+            }
+        }
+        if (length == 0) {
+            item[size++] = COMPACT_RAW;
+            size += varint_put(&item[size], zigzag_encode(words[ip]));
+            length = 1;
+        } else {
+            item[size++] = (uint8_t) words[ip];
+            switch (compact_operands(words[ip])) {
+            case OPERANDS_NONE:
+                break;
+            case OPERANDS_REG:
+                item[size++] = (uint8_t) words[ip + 1];
+                break;
+            case OPERANDS_REG_IMMEDIATE:
+                item[size++] = (uint8_t) words[ip + 1];
+                size += varint_put(&item[size], zigzag_encode(words[ip + 2]));
+                break;
+            case OPERANDS_REGS:
+                item[size++] = (uint8_t) (words[ip + 1] | words[ip + 2] << 4);
+                break;
+            case OPERANDS_TARGET:
+                size += varint_put(&item[size], zigzag_encode((uint32_t) words[ip + 1] - (uint32_t) ip));
+                break;
+            }
+        }
+        buffer_append(out, item, size);
+        ip += length;
+    }
+}
+
+
+/*
+ * Read whole stream to a buffer.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+static int read_all(FILE *in, struct compactBuffer *buffer)
+{
+    uint8_t chunk[64 * 1024];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        buffer_append(buffer, chunk, n);
+    }
+    if (buffer->failed) {
+        fprintf(stderr, "Allocation error!");
+    }
+    return buffer->failed || ferror(in);
+}
+
+
+/*
+ * Convert program image (as read by cpuCreateMemory) to compact bytecode.
+ *
+ * Args:
+ *      program - program image
+ *      out - stream for compact bytecode
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise
+ */
+int cpuCompactEncode(FILE *program, FILE *out)
+{
+    assert(program != NULL);
+    assert(out != NULL);
+
+    struct compactBuffer image = { NULL, 0, 0, 0 };
+    if (read_all(program, &image) != 0 || image.size % 4 != 0 || image.size / 4 > INT32_MAX) {
+        if (!image.failed) {
+            fprintf(stderr, "Binary file corrupted!");
+        }
+        free(image.data);
+        return 1;
+    }
+
+    int32_t count = image.size / 4;
+    int32_t *words = malloc((count > 0 ? count : 1) * sizeof(int32_t));
+    struct compactBuffer code = { NULL, 0, 0, 0 };
+    uint8_t header[16];
+    size_t size = strlen(COMPACT_MAGIC);
+    memcpy(header, COMPACT_MAGIC, size);
+    header[size++] = COMPACT_VERSION;
+    size += varint_put(&header[size], count);
+    buffer_append(&code, header, size);
+    if (words != NULL) {
+        for (int32_t i = 0; i < count; i++) {
+            const uint8_t *bytes = &image.data[4 * i];
+            words[i] = (int32_t) ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 |
+                                  (uint32_t) bytes[3] << 24);
+        }
+        compact_encode(words, count, &code, NULL);
+    }
+    int ret = 1;
+    if (words == NULL || code.failed) {
+        fprintf(stderr, "Allocation error!");
+    } else {
+        ret = fwrite(code.data, 1, code.size, out) != code.size;
+    }
+    free(words);
+    free(image.data);
+    free(code.data);
+    return ret;
+}
+
+
+/*
+ * Convert compact bytecode back to program image.
+ *
+ * Args:
+ *      compact - compact bytecode written by cpuCompactEncode
+ *      out - stream for the program image
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise (including invalid bytecode)
+ */
+int cpuCompactDecode(FILE *compact, FILE *out)
+{
+    assert(compact != NULL);
+    assert(out != NULL);
+
+    struct compactBuffer input = { NULL, 0, 0, 0 };
+    size_t magic = strlen(COMPACT_MAGIC);
+    if (read_all(compact, &input) != 0) {
+        free(input.data);
+        return 1;
+    }
+    if (input.size < magic + 1 || memcmp(input.data, COMPACT_MAGIC, magic) != 0 ||
+            input.data[magic] != COMPACT_VERSION) {
+        fprintf(stderr, "Compact file corrupted!");
+        free(input.data);
+        return 1;
+    }
+
+    const uint8_t *pc = &input.data[magic + 1];
+    const uint8_t *end = &input.data[input.size];
+    uint64_t count;
+    int32_t ip = 0;
+    int ret = varint_read(&pc, end, VARINT_MAX_32, &count) || count > INT32_MAX;
+    while (ret == 0 && (uint32_t) ip < count) {
+        int32_t item[3];
+        int32_t length = 1;
+        uint64_t value = 0;
+        uint8_t op = pc < end ? *pc++ : COMPACT_END;
+        if (op == COMPACT_RAW) {
+            ret = varint_read(&pc, end, VARINT_MAX_32, &value);
+            item[0] = (int32_t) zigzag_decode(value);
+        } else if (op < CPU_OPCODES) {
+            item[0] = op;
+            length = cpuOpcodeLength(op, CPU_PROFILES - 1);
+            switch (compact_operands(op)) {
+            case OPERANDS_NONE:
+                break;
+            case OPERANDS_REG:
+                ret = pc == end || *pc > 3;
+                item[1] = ret ? 0 : *pc++;
+                break;
+            case OPERANDS_REG_IMMEDIATE:
+                ret = pc == end || *pc > 3;
+                item[1] = ret ? 0 : *pc++;
+                ret |= varint_read(&pc, end, VARINT_MAX_32, &value);
+                item[2] = (int32_t) zigzag_decode(value);
+                break;
+            case OPERANDS_REGS:
+                ret = pc == end || (*pc & 0xf) > 3 || *pc >> 4 > 3;
+                item[1] = ret ? 0 : *pc & 0xf;
+                item[2] = ret ? 0 : *pc++ >> 4;
+                break;
+            case OPERANDS_TARGET:
+                ret = varint_read(&pc, end, VARINT_MAX_32, &value);
+                item[1] = (int32_t) ((uint32_t) ip + zigzag_decode(value));
+                break;
+            }
+            ret |= (uint32_t) length > count - ip;
+        } else {
+            ret = 1;
+        }
+        for (int32_t i = 0; i < length && ret == 0; i++) {
+            uint8_t bytes[4] = {
+                (uint8_t) item[i], (uint8_t) ((uint32_t) item[i] >> 8),
+                (uint8_t) ((uint32_t) item[i] >> 16), (uint8_t) ((uint32_t) item[i] >> 24)
+            };
+            ret = fwrite(bytes, 1, 4, out) != 4;
+        }
+        ip += length;
+    }
+    ret |= pc != end;
+    if (ret != 0) {
+        fprintf(stderr, "Compact file corrupted!");
+    }
+    free(input.data);
+    return ret;
+}
+
+
+/*
+ * Encode code region of the cpu memory to compact bytecode executed by cpuRunCompact.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+int cpuCompactCreate(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    assert(cpu->memory != NULL);
+
+    int32_t words = cpu->stackLimit - cpu->memory + 1;
+    struct cpuCompact *compact = malloc(sizeof(struct cpuCompact));
+    int32_t *offsets = malloc((words + 1) * sizeof(int32_t));
+    struct compactBuffer code = { NULL, 0, 0, 0 };
+    if (compact != NULL && offsets != NULL) {
+        compact_encode(cpu->memory, words, &code, offsets);
+        offsets[words] = code.size;
+        buffer_append(&code, (const uint8_t []) { COMPACT_END }, 1);
+    }
+    if (compact == NULL || offsets == NULL || code.failed) {
+        fprintf(stderr, "Allocation error!");
+        free(compact);
+        free(offsets);
+        free(code.data);
+        return 1;
+    }
+    compact->code = code.data;
+    compact->size = code.size;
+    compact->offsets = offsets;
+    compact->words = words;
+    cpuCompactDestroy(cpu);
+    cpu->compact = compact;
+    return 0;
+}
+
+
+void cpuCompactDestroy(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->compact == NULL) {
+        return;
+    }
+    free(cpu->compact->code);
+    free(cpu->compact->offsets);
+    free(cpu->compact);
+    cpu->compact = NULL;
+}
+
+
+/*
+ * Same as cpuRun, but executes compact bytecode made by cpuCompactCreate. Items are decoded
+ * as they are executed, I/O, words which are not instructions of the profile and addresses
+ * which are not starts of items are executed by cpuStep.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions
+ */
+int cpuRunCompact(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(cpu->compact != NULL);
+
+    size_t i = 0;
+    if (steps <= 0) {
+        return 0;
+    }
+    if (cpu->status != cpuOK) {
+        return cpu->status == cpuHalted ? 1 : -1;
+    }
+
+    const uint8_t *code = cpu->compact->code;
+    const int32_t *offsets = cpu->compact->offsets;
+    uint32_t words = cpu->compact->words;
+    uint8_t valid[CPU_OPCODES];     // opcodes of the profile
+    int32_t *stackBottom = cpu->stackBottom;
+    int32_t capacity = cpu->stackBottom - cpu->stackLimit;
+    int32_t regs[4] = { cpu->A, cpu->B, cpu->C, cpu->D };
+    int32_t result = cpu->result;
+    int32_t stackSize = cpu->stackSize;
+    int32_t highWater = cpu->stackHighWater;
+    int32_t ip = cpu->instructionPointer;
+    const uint8_t *pc = NULL;       // item at ip, NULL if it has to be looked up
+    int32_t val;
+    for (int op = 0; op < CPU_OPCODES; op++) {
+        valid[op] = cpuOpcodeLength(op, cpu->profile) != 0;
+    }
+
+    while (i < steps) {
+        i++;
+        if (pc == NULL) {
+            if ((uint32_t) ip > words || offsets[ip] < 0) {
+                goto slow;
+            }
+            pc = &code[offsets[ip]];
+        }
+        uint8_t op = *pc;
+        if (op >= CPU_OPCODES || !valid[op]) {
+            goto slow;
+        }
+
+        switch (op) {
+        case cpuOpNop:
+            pc++;
+            ip += 1;
+            continue;
+
+        case cpuOpHalt:
+            ip += 1;
+            cpu->status = cpuHalted;
+            goto finished;
+
+        case cpuOpAdd:
+            regs[0] += regs[pc[1]];
+            result = regs[0];
+            break;
+
+        case cpuOpSub:
+            regs[0] -= regs[pc[1]];
+            result = regs[0];
+            break;
+
+        case cpuOpMul:
+            regs[0] *= regs[pc[1]];
+            result = regs[0];
+            break;
+
+        case cpuOpDiv:
+            val = regs[pc[1]];
+            if (val == 0) {
+                cpu->status = cpuDivByZero;
+                goto finished;
+            }
+            regs[0] /= val;
+            result = regs[0];
+            break;
+
+        case cpuOpInc:
+            regs[pc[1]] += 1;
+            result = regs[pc[1]];
+            break;
+
+        case cpuOpDec:
+            regs[pc[1]] -= 1;
+            result = regs[pc[1]];
+            break;
+
+        case cpuOpMovr: {
+            const uint8_t *operand = &pc[2];
+            regs[pc[1]] = (int32_t) zigzag_decode(varint_get(&operand));
+            pc = operand;
+            ip += 3;
+            continue;
+        }
+
+        case cpuOpLoad:
+        case cpuOpStore: {
+            const uint8_t *operand = &pc[2];
+            int64_t depth = (int64_t) regs[3] + (int32_t) zigzag_decode(varint_get(&operand)) + 1;
+            if (depth <= 0 || depth > stackSize) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            if (op == cpuOpLoad) {
+                regs[pc[1]] = stackBottom[depth - stackSize];
+            } else {
+                stackBottom[depth - stackSize] = regs[pc[1]];
+            }
+            pc = operand;
+            ip += 3;
+            continue;
+        }
+
+        case cpuOpSwap:
+            val = regs[pc[1] & 0xf];
+            regs[pc[1] & 0xf] = regs[pc[1] >> 4];
+            regs[pc[1] >> 4] = val;
+            pc += 2;
+            ip += 3;
+            continue;
+
+        case cpuOpCmp:
+            result = regs[pc[1] & 0xf] - regs[pc[1] >> 4];
+            pc += 2;
+            ip += 3;
+            continue;
+
+        case cpuOpPush:
+            if (stackSize >= capacity) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            stackBottom[-stackSize] = regs[pc[1]];
+            stackSize++;
+            if (stackSize > highWater) {
+                highWater = stackSize;
+            }
+            break;
+
+        case cpuOpPop:
+            if (stackSize <= 0) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            regs[pc[1]] = stackBottom[-stackSize + 1];
+            stackSize--;
+            break;
+
+        case cpuOpLoop:
+        case cpuOpJmp:
+        case cpuOpJz:
+        case cpuOpJnz:
+        case cpuOpJgt: {
+            const uint8_t *operand = &pc[1];
+            uint32_t delta = varint_get(&operand);
+            int taken = op == cpuOpLoop ? regs[2] != 0 : op == cpuOpJmp ? 1 :
+                        op == cpuOpJz ? result == 0 : op == cpuOpJnz ? result != 0 : result > 0;
+            if (taken) {
+                ip = (int32_t) ((uint32_t) ip + zigzag_decode(delta));
+                pc = NULL;
+            } else {
+                pc = operand;
+                ip += 2;
+            }
+            continue;
+        }
+
+        case cpuOpCall: {
+            const uint8_t *operand = &pc[1];
+            uint32_t delta = varint_get(&operand);
+            if (stackSize >= capacity) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            stackBottom[-stackSize] = ip + 2;
+            stackSize++;
+            if (stackSize > highWater) {
+                highWater = stackSize;
+            }
+            ip = (int32_t) ((uint32_t) ip + zigzag_decode(delta));
+            pc = NULL;
+            continue;
+        }
+
+        case cpuOpRet:
+            if (stackSize == 0) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            ip = stackBottom[-stackSize + 1];
+            stackSize--;
+            stackBottom[-stackSize] = 0;
+            pc = NULL;
+            continue;
+
+        default:
+            goto slow;
+        }
+        /* instructions with one register operand */
+        pc += 2;
+        ip += 2;
+        continue;
+
+slow:
+        /* I/O and words which are not instructions are left to cpuStep */
+        cpu->A = regs[0];
+        cpu->B = regs[1];
+        cpu->C = regs[2];
+        cpu->D = regs[3];
+        cpu->result = result;
+        cpu->stackSize = stackSize;
+        cpu->stackHighWater = highWater;
+        cpu->instructionPointer = ip;
+        cpuStep(cpu);
+        regs[0] = cpu->A;
+        regs[1] = cpu->B;
+        regs[2] = cpu->C;
+        regs[3] = cpu->D;
+        result = cpu->result;
+        stackSize = cpu->stackSize;
+        highWater = cpu->stackHighWater;
+        ip = cpu->instructionPointer;
+        pc = NULL;
+        if (cpu->status != cpuOK) {
+            goto finished;
+        }
+    }
+
+finished:
+    cpu->A = regs[0];
+    cpu->B = regs[1];
+    cpu->C = regs[2];
+    cpu->D = regs[3];
+    cpu->result = result;
+    cpu->stackSize = stackSize;
+    cpu->stackHighWater = highWater;
+    cpu->instructionPointer = ip;
+    if (cpu->status != cpuOK && cpu->status != cpuHalted) {
+        i = -i;
+    }
+    cpuFlush(cpu);
+    return i;
+}
@@ -1,9 +1,45 @@
+/* MAP_ANONYMOUS is not part of POSIX */
+#define _DEFAULT_SOURCE
 #include "cpu.h"
+#include "varint.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+#define CHUNK_SIZE (1024 * sizeof(int32_t))
+/* Memory of programs of at least this size is an anonymous mapping */
+#define MEMORY_MAP_SIZE (256 * 1024)
+#define IOLOG_MAGIC "CPUIOLOG"
+#define IOLOG_VERSION 1
+
+/*
+ * Offsets of registers A, B, C and D (by their number) inside of the cpu structure.
+ */
+static const size_t reg_offsets[] = {
+    offsetof(struct cpu, A), offsetof(struct cpu, B), offsetof(struct cpu, C), offsetof(struct cpu, D)
+};
+
+/*
+ * Get pointer to register by its (already validated) number.
+ */
+static inline int32_t *cpu_reg(struct cpu *cpu, int reg_num)
+{
+    return (int32_t *) ((char *) cpu + reg_offsets[reg_num]);
+}
 
 /*
  * Get value of selected register.
@@ -52,10 +88,7 @@ static int modify_reg(struct cpu *cpu, int reg_num, int value, int add)
     if (add) {
         *p_reg += value;
 
-#ifdef BONUS_JMP
         cpu->result = *p_reg;
-#endif
-
     } else {
         *p_reg = value;
     }
@@ -82,6 +115,392 @@ static int check_instruction(struct cpu *cpu, int len)
     return 1;
 }
 
+/*
+ * Append data to the cpu output, flush output buffer when it is full.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      data - bytes to write
+ *      len - number of bytes
+ *
+ * Returns:
+ *      0 if ok, 1 (and sets cpu status) if caller supplied buffer is full
+ */
+static int output_write(struct cpu *cpu, const char *data, size_t len)
+{
+    struct cpuOutput *output = &cpu->output;
+    if (output->size - output->used < len) {
+        if (output->stream == NULL) {
+            cpu->status = cpuIOError;
+            return 1;
+        }
+        cpuFlush(cpu);
+        if (output->buffer == NULL) {
+            output->buffer = malloc(OUTPUT_BUFFER_SIZE);
+            output->size = output->buffer != NULL ? OUTPUT_BUFFER_SIZE : 0;
+        }
+        if (output->size < len) {
+            fwrite(data, 1, len, output->stream);
+            return 0;
+        }
+    }
+    memcpy(&output->buffer[output->used], data, len);
+    output->used += len;
+    return 0;
+}
+
+/*
+ * Append decimal representation of value to the cpu output.
+ */
+static int output_int(struct cpu *cpu, int32_t value)
+{
+    char digits[11];
+    char *p = &digits[sizeof(digits)];
+    uint32_t abs_value = value < 0 ? -(uint32_t) value : (uint32_t) value;
+    do {
+        *--p = '0' + abs_value % 10;
+        abs_value /= 10;
+    } while (abs_value != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    return output_write(cpu, p, &digits[sizeof(digits)] - p);
+}
+
+/*
+ * Prepare input stream for reading: map regular files, allocate buffer for other streams.
+ */
+static void input_open(struct cpuInput *input)
+{
+    input->ready = 1;
+    input->data = NULL;
+    input->size = 0;
+    input->pos = 0;
+    if (input->stream == NULL) {
+        return;
+    }
+    if (input->shared) {
+        return;
+    }
+#ifdef HAVE_MMAP
+    int fd = fileno(input->stream);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            input->data = data;
+            input->mapped = st.st_size;
+            input->size = st.st_size;
+            input->pos = offset > 0 && offset <= st.st_size ? (size_t) offset : 0;
+            return;
+        }
+    }
+    if (fd >= 0 && isatty(fd)) {
+        return;
+    }
+#endif
+    input->buffer = malloc(INPUT_BUFFER_SIZE);
+}
+
+/*
+ * Refill input buffer.
+ *
+ * Returns:
+ *      next input byte or EOF
+ */
+static int input_fill(struct cpuInput *input)
+{
+    if (!input->ready) {
+        input_open(input);
+        if (input->pos < input->size) {
+            return input->data[input->pos];
+        }
+    }
+    if (input->mapped || input->stream == NULL) {
+        return EOF;
+    }
+
+    input->pos = 0;
+    input->size = 0;
+    if (input->buffer == NULL) {
+        int c = getc(input->stream);
+        if (c == EOF) {
+            return EOF;
+        }
+        input->byte = c;
+        input->data = &input->byte;
+        input->size = 1;
+        return c;
+    }
+#ifdef HAVE_MMAP
+    ssize_t len;
+    do {
+        len = read(fileno(input->stream), input->buffer, INPUT_BUFFER_SIZE);
+    } while (len < 0 && errno == EINTR);
+#else
+    size_t len = fread(input->buffer, 1, INPUT_BUFFER_SIZE, input->stream);
+#endif
+    if (len <= 0) {
+        return EOF;
+    }
+    input->data = input->buffer;
+    input->size = len;
+    return input->data[0];
+}
+
+/*
+ * Returns next input byte (without consuming it) or EOF.
+ */
+static inline int input_peek(struct cpuInput *input)
+{
+    if (input->pos < input->size) {
+        return input->data[input->pos];
+    }
+    return input_fill(input);
+}
+
+/*
+ * Release mapping and buffer of the input.
+ */
+static void input_close(struct cpuInput *input)
+{
+#ifdef HAVE_MMAP
+    if (input->mapped) {
+        munmap((void *) input->data, input->mapped);
+    }
+#endif
+    free(input->buffer);
+    input->buffer = NULL;
+    input->data = NULL;
+    input->mapped = 0;
+    input->size = 0;
+    input->pos = 0;
+    input->ready = 0;
+}
+
+/*
+ * Read int32 from the cpu input, same as scanf("%" SCNd32) (or 4 raw bytes in binary mode).
+ *
+ * Returns:
+ *      0 if ok, 1 if there is no number on the input
+ */
+static int input_int(struct cpu *cpu, int32_t *value)
+{
+    struct cpuInput *input = &cpu->input;
+    int c;
+
+    if (input->binary) {
+        uint32_t word = 0;
+        for (int i = 0; i < 4; i++) {
+            if ((c = input_peek(input)) == EOF) {
+                return 1;
+            }
+            input->pos++;
+            word |= (uint32_t) c << (8 * i);
+        }
+        *value = (int32_t) word;
+        return 0;
+    }
+
+    c = input_peek(input);
+    while (c == ' ' || (c >= '\t' && c <= '\r')) {
+        input->pos++;
+        c = input_peek(input);
+    }
+    int negative = c == '-';
+    if (c == '-' || c == '+') {
+        input->pos++;
+        c = input_peek(input);
+    }
+    if (c < '0' || c > '9') {
+        return 1;
+    }
+
+    /* Out of range values saturate to long and are truncated to int32 like in scanf */
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+    uint64_t magnitude = 0;
+    do {
+        if (magnitude <= (limit - (c - '0')) / 10) {
+            magnitude = magnitude * 10 + (c - '0');
+        } else {
+            magnitude = limit;
+        }
+        input->pos++;
+        c = input_peek(input);
+    } while (c >= '0' && c <= '9');
+    *value = (int32_t) (uint32_t) (negative ? 0 - magnitude : magnitude);
+    return 0;
+}
+
+/*
+ * Read char from the cpu input, same as scanf("%c").
+ *
+ * Returns:
+ *      0 if ok, 1 on the end of input
+ */
+static int input_char(struct cpu *cpu, char *value)
+{
+    int c = input_peek(&cpu->input);
+    if (c == EOF) {
+        return 1;
+    }
+    cpu->input.pos++;
+    *value = (char) c;
+    return 0;
+}
+
+/*
+ * I/O log. Every value consumed by in/get and produced by out/put is one event,
+ * a LEB128 varint of zigzag(value) << 3 | end of input << 2 | kind. Replayed log
+ * replaces the input and output, so nothing is parsed nor formatted.
+ */
+enum ioKind
+{
+    IO_IN,
+    IO_GET,
+    IO_OUT,
+    IO_PUT
+};
+
+struct cpuIoLog
+{
+    FILE *record;               // stream of recorded log, NULL when replaying
+    uint8_t *data;              // replayed log
+    size_t size;
+    size_t pos;
+    size_t events;              // events recorded or replayed so far
+    int failed;                 // replay did not match
+};
+
+/*
+ * Append event to recorded log.
+ */
+static void iolog_record(struct cpuIoLog *log, int kind, int end, int32_t value)
+{
+    uint8_t bytes[VARINT_MAX_64];
+    uint64_t event = (uint64_t) zigzag_encode(value) << 3 | (uint64_t) end << 2 | kind;
+    fwrite(bytes, 1, varint_put(bytes, event), log->record);
+    log->events++;
+}
+
+/*
+ * Take the next event of replayed log, it has to be of kind. Mismatch is reported and
+ * fails the cpu with cpuIOError.
+ *
+ * Returns:
+ *      0 if ok, 1 on mismatch
+ */
+static int iolog_replay(struct cpu *cpu, int kind, int *end, int32_t *value)
+{
+    struct cpuIoLog *log = cpu->ioLog;
+    const uint8_t *pc = &log->data[log->pos];
+    uint64_t event = 0;
+    int failed = varint_read(&pc, &log->data[log->size], VARINT_MAX_64, &event);
+    log->pos = pc - log->data;
+    if (failed || (int) (event & 3) != kind) {
+        fprintf(stderr, "I/O log mismatch at event %zu\n", log->events);
+        log->failed = 1;
+        cpu->status = cpuIOError;
+        return 1;
+    }
+    *value = (int32_t) zigzag_decode((uint32_t) (event >> 3));
+    *end = (event >> 2) & 1;
+    log->events++;
+    return 0;
+}
+
+/*
+ * Read value of in (int32) or get (char) from the input or from replayed log.
+ *
+ * Returns:
+ *      0 if ok, 1 at the end of input (or on mismatch of replayed log)
+ */
+static int io_input(struct cpu *cpu, int kind, int32_t *value)
+{
+    struct cpuIoLog *log = cpu->ioLog;
+    int end;
+    if (log != NULL && log->record == NULL) {
+        return iolog_replay(cpu, kind, &end, value) != 0 || end;
+    }
+    if (kind == IO_IN) {
+        end = input_int(cpu, value);
+    } else {
+        char c = 0;
+        end = input_char(cpu, &c);
+        *value = c;
+    }
+    if (log != NULL) {
+        iolog_record(log, kind, end, end ? 0 : *value);
+    }
+    return end;
+}
+
+/*
+ * Write value of out (decimal) or put (char) to the output or check it against replayed log.
+ *
+ * Returns:
+ *      0 if ok, 1 (and sets cpu status) on error
+ */
+static int io_output(struct cpu *cpu, int kind, int32_t value)
+{
+    struct cpuIoLog *log = cpu->ioLog;
+    if (log != NULL && log->record == NULL) {
+        int32_t expected;
+        int end;
+        if (iolog_replay(cpu, kind, &end, &expected) != 0) {
+            return 1;
+        }
+        if (expected != value) {
+            fprintf(stderr, "I/O log mismatch at event %zu: expected %" PRId32 ", got %" PRId32 "\n",
+                    log->events - 1, expected, value);
+            log->failed = 1;
+            cpu->status = cpuIOError;
+            return 1;
+        }
+        return 0;
+    }
+    char c = value;
+    if (kind == IO_OUT ? output_int(cpu, value) : output_write(cpu, &c, 1)) {
+        return 1;
+    }
+    if (log != NULL) {
+        iolog_record(log, kind, 0, value);
+    }
+    return 0;
+}
+
+/*
+ * Remember the deepest stack slot written so far, cpuReset clears only slots up to it.
+ */
+static inline void stack_mark(struct cpu *cpu)
+{
+    if (cpu->stackSize > cpu->stackHighWater) {
+        cpu->stackHighWater = cpu->stackSize;
+    }
+}
+
+
+/*
+ * Get stack slot on top of stack + reg D + offset.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      offset - offset operand of load/store
+ *
+ * Returns:
+ *      pointer to the slot, NULL (and sets cpu status) if slot is outside of the stack
+ */
+static int32_t *stack_slot(struct cpu *cpu, int32_t offset)
+{
+    int64_t depth = (int64_t) cpu->D + offset + 1;
+    if (depth <= 0 || depth > cpu->stackSize) {
+        cpu->status = cpuInvalidStackOperation;
+        return NULL;
+    }
+    return &cpu->stackBottom[depth - cpu->stackSize];
+}
+
 
 /*
  *******************
@@ -118,14 +537,12 @@ static int halt(struct cpu *cpu)
 static int add(struct cpu *cpu)
 {
     int val = get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]);
-    if (val == -1) {
+    if (cpu->status != cpuOK) {
         return 0;
     }
     cpu->A += val;
 
-#ifdef BONUS_JMP
     cpu->result = cpu->A;
-#endif
     return 1;
 }
 
@@ -137,14 +554,12 @@ static int add(struct cpu *cpu)
 static int sub(struct cpu *cpu)
 {
     int val = get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]);
-    if (val == -1) {
+    if (cpu->status != cpuOK) {
         return 0;
     }
     cpu->A -= val;
 
-#ifdef BONUS_JMP
     cpu->result = cpu->A;
-#endif
     return 1;
 }
 
@@ -156,14 +571,12 @@ static int sub(struct cpu *cpu)
 static int mul(struct cpu *cpu)
 {
     int val = get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]);
-    if (val == -1) {
+    if (cpu->status != cpuOK) {
         return 0;
     }
     cpu->A *= val;
 
-#ifdef BONUS_JMP
     cpu->result = cpu->A;
-#endif
     return 1;
 }
 
@@ -184,9 +597,7 @@ static int divi(struct cpu *cpu)
     }
     cpu->A /= val;
 
-#ifdef BONUS_JMP
     cpu->result = cpu->A;
-#endif
     return 1;
 }
 
@@ -252,9 +663,8 @@ static int movr(struct cpu *cpu)
  */
 static int load(struct cpu *cpu)
 {
-    int *mem_val = &cpu->stackBottom[-cpu->stackSize + cpu->D + cpu->memory[cpu->instructionPointer + 2] + 1];
-    if (mem_val <= &cpu->stackBottom[-cpu->stackSize] || mem_val > cpu->stackBottom) {
-        cpu->status = cpuInvalidStackOperation;
+    int32_t *mem_val = stack_slot(cpu, cpu->memory[cpu->instructionPointer + 2]);
+    if (mem_val == NULL) {
         return 0;
     }
     if (modify_reg(cpu, cpu->memory[cpu->instructionPointer + 1], *(mem_val), 0)) {
@@ -271,9 +681,8 @@ static int load(struct cpu *cpu)
  */
 static int store(struct cpu *cpu)
 {
-    int *mem_val = &cpu->stackBottom[-cpu->stackSize + cpu->D + cpu->memory[cpu->instructionPointer + 2] + 1];
-    if (mem_val <= &cpu->stackBottom[-cpu->stackSize] || mem_val > cpu->stackBottom) {
-        cpu->status = cpuInvalidStackOperation;
+    int32_t *mem_val = stack_slot(cpu, cpu->memory[cpu->instructionPointer + 2]);
+    if (mem_val == NULL) {
         return 0;
     }
     *(mem_val) = get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]);
@@ -288,7 +697,7 @@ static int store(struct cpu *cpu)
 static int in(struct cpu *cpu)
 {
     int32_t val;
-    if (scanf("%" SCNd32, &val) != 1) {
+    if (io_input(cpu, IO_IN, &val)) {
         cpu->status = cpuIOError;
         return 0;
     }
@@ -313,11 +722,12 @@ static int in(struct cpu *cpu)
  */
 static int get(struct cpu *cpu)
 {
-    char val;
-    if (scanf("%c", &val) != 1) {
+    int32_t value;
+    if (io_input(cpu, IO_GET, &value)) {
         cpu->status = cpuIOError;
         return 0;
     }
+    char val = value;
     if (val == EOF) {
         if (modify_reg(cpu, 2, 0, 0)) {
             return 0;
@@ -339,7 +749,9 @@ static int get(struct cpu *cpu)
  */
 static int out(struct cpu *cpu)
 {
-    printf("%d", get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]));
+    if (io_output(cpu, IO_OUT, get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]))) {
+        return 0;
+    }
     return 1;
 }
 
@@ -355,7 +767,9 @@ static int put(struct cpu *cpu)
         cpu->status = cpuIllegalOperand;
         return 0;
     }
-    printf("%c", pom);
+    if (io_output(cpu, IO_PUT, pom)) {
+        return 0;
+    }
     return 1;
 }
 
@@ -391,6 +805,7 @@ static int push(struct cpu *cpu)
     if (&cpu->stackBottom[-cpu->stackSize] > cpu->stackLimit) {
         cpu->stackBottom[-cpu->stackSize] = get_reg_by_num(cpu, cpu->memory[cpu->instructionPointer + 1]);
         cpu->stackSize++;
+        stack_mark(cpu);
         return 1;
     }
     cpu->status = cpuInvalidStackOperation;
@@ -416,7 +831,6 @@ static int pop(struct cpu *cpu)
     return 0;
 }
 
-#ifdef BONUS_JMP
 /*
  * Compare REG1 - REG2 and result is stored in result register.
  * arg1 - REG1
@@ -479,10 +893,7 @@ static int jgt(struct cpu *cpu)
     return 1;
 }
 
-#endif
-
 
-#ifdef BONUS_CALL
 /*
  * Copy index of next instruction to the top of stack.
  * Then jump to instruction index given by INDEX.
@@ -496,6 +907,7 @@ static int call(struct cpu *cpu)
     }
     cpu->stackBottom[-cpu->stackSize] = cpu->instructionPointer + 2;
     cpu->stackSize++;
+    stack_mark(cpu);
     return jmp(cpu);
 }
 
@@ -511,159 +923,1635 @@ static int ret(struct cpu *cpu)
     }
     cpu->instructionPointer = cpu->stackBottom[-cpu->stackSize + 1];
     cpu->stackSize--;
-    cpu->stackLimit[-cpu->stackSize] = 0;
+    cpu->stackBottom[-cpu->stackSize] = 0;
     return 2;
 }
-#endif
 
 
 /*
- ************************
- * Predefined functions
- ************************
+ * Length of instructions (including operands) by opcode.
  */
+static const int inst_lengths[] = {
+#define INST_LENGTH(name, mnemonic, length, profile) length,
+    CPU_INSTRUCTIONS(INST_LENGTH)
+#undef INST_LENGTH
+};
 
+/*
+ * The first profile with instruction by opcode.
+ */
+static const enum cpuProfile inst_profiles[] = {
+#define INST_PROFILE(name, mnemonic, length, profile) cpuProfile##profile,
+    CPU_INSTRUCTIONS(INST_PROFILE)
+#undef INST_PROFILE
+};
 
 /*
- * Allocating 4KiB blocks of memory and load binary instructions into it.
- * In finale realocare memory using size of loaded instructions + size of stack.
- * 
- * Args:
- *      program - handle of file where are stored instructions
- *      stackCapacity - size of stack * sizeof(int32_t)
- *      stackBottom - empty pointer (end of memory pointer will be stored here)
- * 
- * Output:
- *      pointer to begin of allocated memory
+ * Instruction handlers by opcode.
  */
-int32_t *cpuCreateMemory(FILE *program, size_t stackCapacity, int32_t **stackBottom)
-{
-    assert(program != NULL);
-    assert(stackBottom != NULL);
+static int (*const instructions[])(struct cpu*) = {
+    nop, halt, add, sub, mul, divi, inc, dec, loop, movr, load, store, in, get, out, put, swap, push, pop,
+    cmp, jmp, jz, jnz, jgt, call, ret,
+};
 
-    int curr_char;
-    int32_t *p_temp;
-    size_t count = 0;
-    size_t chunk_size = 1024 * sizeof(int32_t);
-    int32_t codes[4];
-    size_t mem_size = chunk_size;
-    int32_t *memory = malloc(mem_size);
-    if (memory == NULL) {
-        fprintf(stderr, "Allocation error!");
-        return NULL;
-    }
-    do {
-        curr_char = fgetc(program);
-        count++;
-        if (count == mem_size) {
-            mem_size += chunk_size;
-            p_temp = memory;
-            memory = realloc(memory, mem_size);
-            if (memory == NULL) {
-                free(p_temp);
-                fprintf(stderr, "Allocation error!");
-                return NULL;
-            }
-        }
-        if (count % 4 == 1) {
-            codes[0] = curr_char;
-        } else if (count % 4 == 2) {
-            codes[1] = curr_char;
-            codes[1] = codes[1] << 8;
-        } else if (count % 4 == 3) {
-            codes[2] = curr_char;
-            codes[2] = codes[2] << 16;
-        } else if (count % 4 == 0) {
-            codes[3] = curr_char;
-            codes[3] = codes[3] << 24;
-            memory[(count / 4) - 1] = codes[0] | codes[1] | codes[2] | codes[3];
-        }
-    } while (curr_char != EOF);
-
-    if (count % 4 != 1) {
-        free(memory);
-        fprintf(stderr, "Binary file corrupted!");
-        return NULL;
-    }
-    while (&memory[(count - 1) / 4 - 1] > &memory[((mem_size / 4) - 1) - stackCapacity]) {
-        mem_size += chunk_size;
-        p_temp = memory;
-        memory = realloc(memory, mem_size);
-        if (memory == NULL) {
-            free(p_temp);
-            fprintf(stderr, "Allocation error!");
-            return NULL;
-        }
-    }
-    for (int32_t *i = &memory[(count - 1) / 4]; i <= &memory[((mem_size / 4) - 1) - stackCapacity]; i = &i[1]) {
-        *i = 0;
-    }
-    *stackBottom = &memory[(mem_size / 4) - 1];
-    return memory;
+/*
+ * Check if opcode is valid in the instruction set of the cpu.
+ */
+static int valid_opcode(const struct cpu *cpu, int32_t opcode)
+{
+    return opcode >= 0 && opcode < CPU_OPCODES && inst_profiles[opcode] <= cpu->profile;
 }
 
 
 /*
- * Assign values for pointers and set set stack offset and instruction offset to zero.
- * 
- * Args:
- *      cpu - emulated cpu structure
- *      memory - pointer to begin of allocated memory
- *      stackBottom - pointer to end of allocated memory
- *      stackCapacity - size of stack * sizeof(int32_t)
+ *************************
+ * DECODED INSTRUCTIONS
+ *************************
+ *
+ * Same semantics as instructions above, but operands are taken from pre-decoded record.
+ * Handlers return 0 if error occours (or cpu halted), 1 if instruction pointer should be
+ * moved by instruction length and 2 if instruction pointer was already set.
+ * Fused handlers return FUSED_SPLIT if instructions have to be executed one by one,
+ * head of counted loop returns LOOP_HEAD if the loop can be run by cpuRunLoop
+ * and trap returns TRAP, the engine stops before it.
  */
-void cpuCreate(struct cpu *cpu, int32_t *memory, int32_t *stackBottom, size_t stackCapacity)
-{
-    assert(cpu != NULL);
-    assert(memory != NULL);
-    assert(stackBottom != NULL);
-
-    cpu->memory = memory;
-    cpu->stackBottom = stackBottom;
-    cpu->stackLimit = &stackBottom[-stackCapacity];
-    cpuReset(cpu);
-}
 
+#define FUSED_SPLIT 3
+#define LOOP_HEAD 4
+#define TRAP 5
 
 /*
- * Free allocated memory and set pointers to NULL value.
+ * Records store handlers as indexes to decoded_instructions, so decoded program holds
+ * no pointers and can be cached on disk (see cpuCacheStore). Indexes of instruction
+ * handlers are their opcodes.
  */
-void cpuDestroy(struct cpu *cpu)
+enum
 {
-    assert(cpu != NULL);
+    handlerSlow = CPU_OPCODES,
+    handlerLoopHead,
+    handlerDecLoop,
+    handlerMovrPush,
+    handlerLoadAddStore,
+    handlerCmpJz,
+    handlerCmpJnz,
+    handlerCmpJgt,
+    handlerTrap
+};
 
-    free(cpu->memory);
-    cpu->memory = NULL;
-    cpu->stackBottom = NULL;
-    cpu->stackLimit = NULL;
+
+/*
+ * Execute instruction which could not be decoded (illegal opcode, operand or
+ * instruction crossing end of memory) by cpuStep, so it fails the same way.
+ */
+static int op_slow(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    (void) inst;
+    return cpuStep(cpu) ? 2 : 0;
 }
 
 
 /*
- * Set registers to zero, set stack values to zero, set stack offset and instruction offset to zero.
- * 
- * Args:
- *      cpu - emulated cpu structure
+ * Breakpoint set by cpuSetTraps, nothing is executed.
  */
-void cpuReset(struct cpu *cpu)
+static int op_trap(struct cpu *cpu, const struct cpuInstruction *inst)
 {
-    assert(cpu != NULL);
+    (void) cpu;
+    (void) inst;
+    return TRAP;
+}
 
-    cpu->A = 0;
-    cpu->B = 0;
+
+static int op_nop(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    (void) cpu;
+    (void) inst;
+    return 1;
+}
+
+
+static int op_halt(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    (void) inst;
+    cpu->status = cpuHalted;
+    cpu->instructionPointer += 1;
+    return 0;
+}
+
+
+static int op_add(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->A += *cpu_reg(cpu, inst->reg);
+    cpu->result = cpu->A;
+    return 1;
+}
+
+
+static int op_sub(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->A -= *cpu_reg(cpu, inst->reg);
+    cpu->result = cpu->A;
+    return 1;
+}
+
+
+static int op_mul(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->A *= *cpu_reg(cpu, inst->reg);
+    cpu->result = cpu->A;
+    return 1;
+}
+
+
+static int op_div(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t val = *cpu_reg(cpu, inst->reg);
+    if (val == 0) {
+        cpu->status = cpuDivByZero;
+        return 0;
+    }
+    cpu->A /= val;
+    cpu->result = cpu->A;
+    return 1;
+}
+
+
+static int op_inc(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t *p_reg = cpu_reg(cpu, inst->reg);
+    *p_reg += 1;
+    cpu->result = *p_reg;
+    return 1;
+}
+
+
+static int op_dec(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t *p_reg = cpu_reg(cpu, inst->reg);
+    *p_reg -= 1;
+    cpu->result = *p_reg;
+    return 1;
+}
+
+
+static int op_loop(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (cpu->C != 0) {
+        cpu->instructionPointer = inst->arg;
+        return 2;
+    }
+    return 1;
+}
+
+
+static int op_movr(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    *cpu_reg(cpu, inst->reg) = inst->arg;
+    return 1;
+}
+
+
+static int op_load(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t *mem_val = stack_slot(cpu, inst->arg);
+    if (mem_val == NULL) {
+        return 0;
+    }
+    *cpu_reg(cpu, inst->reg) = *mem_val;
+    return 1;
+}
+
+
+static int op_store(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t *mem_val = stack_slot(cpu, inst->arg);
+    if (mem_val == NULL) {
+        return 0;
+    }
+    *mem_val = *cpu_reg(cpu, inst->reg);
+    return 1;
+}
+
+
+static int op_in(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t val;
+    if (io_input(cpu, IO_IN, &val)) {
+        cpu->status = cpuIOError;
+        return 0;
+    }
+    if (val == EOF) {
+        cpu->C = 0;
+    }
+    *cpu_reg(cpu, inst->reg) = val;
+    return 1;
+}
+
+
+static int op_get(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t value;
+    if (io_input(cpu, IO_GET, &value)) {
+        cpu->status = cpuIOError;
+        return 0;
+    }
+    char val = value;
+    if (val == EOF) {
+        cpu->C = 0;
+    }
+    *cpu_reg(cpu, inst->reg) = val;
+    return 1;
+}
+
+
+static int op_out(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (io_output(cpu, IO_OUT, *cpu_reg(cpu, inst->reg))) {
+        return 0;
+    }
+    return 1;
+}
+
+
+static int op_put(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t pom = *cpu_reg(cpu, inst->reg);
+    if (pom >= 255 || pom < 0) {
+        cpu->status = cpuIllegalOperand;
+        return 0;
+    }
+    if (io_output(cpu, IO_PUT, pom)) {
+        return 0;
+    }
+    return 1;
+}
+
+
+static int op_swap(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t *p_reg1 = cpu_reg(cpu, inst->reg);
+    int32_t *p_reg2 = cpu_reg(cpu, inst->arg);
+    int32_t pom = *p_reg1;
+    *p_reg1 = *p_reg2;
+    *p_reg2 = pom;
+    return 1;
+}
+
+
+static int op_push(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (&cpu->stackBottom[-cpu->stackSize] > cpu->stackLimit) {
+        cpu->stackBottom[-cpu->stackSize] = *cpu_reg(cpu, inst->reg);
+        cpu->stackSize++;
+        stack_mark(cpu);
+        return 1;
+    }
+    cpu->status = cpuInvalidStackOperation;
+    return 0;
+}
+
+
+static int op_pop(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (cpu->stackSize > 0) {
+        *cpu_reg(cpu, inst->reg) = cpu->stackBottom[-cpu->stackSize + 1];
+        cpu->stackSize--;
+        return 1;
+    }
+    cpu->status = cpuInvalidStackOperation;
+    return 0;
+}
+
+static int op_cmp(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->result = *cpu_reg(cpu, inst->reg) - *cpu_reg(cpu, inst->arg);
+    return 1;
+}
+
+
+static int op_jmp(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->instructionPointer = inst->arg;
+    return 2;
+}
+
+
+static int op_jz(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (cpu->result == 0) {
+        return op_jmp(cpu, inst);
+    }
+    return 1;
+}
+
+
+static int op_jnz(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (cpu->result != 0) {
+        return op_jmp(cpu, inst);
+    }
+    return 1;
+}
+
+
+static int op_jgt(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (cpu->result > 0) {
+        return op_jmp(cpu, inst);
+    }
+    return 1;
+}
+
+
+static int op_call(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (&cpu->stackBottom[-cpu->stackSize] <= cpu->stackLimit) {
+        cpu->status = cpuInvalidStackOperation;
+        return 0;
+    }
+    cpu->stackBottom[-cpu->stackSize] = cpu->instructionPointer + 2;
+    cpu->stackSize++;
+    stack_mark(cpu);
+    return op_jmp(cpu, inst);
+}
+
+
+static int op_ret(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    (void) inst;
+    if (cpu->stackSize == 0) {
+        cpu->status = cpuInvalidStackOperation;
+        return 0;
+    }
+    cpu->instructionPointer = cpu->stackBottom[-cpu->stackSize + 1];
+    cpu->stackSize--;
+    cpu->stackBottom[-cpu->stackSize] = 0;
+    return 2;
+}
+
+
+/*
+ *************************
+ * FUSED INSTRUCTIONS
+ *************************
+ *
+ * Handlers of common instruction sequences. They never fail in the middle of
+ * a sequence, if any of the instructions would fail, they return FUSED_SPLIT
+ * and the sequence is executed instruction by instruction.
+ */
+
+
+/*
+ * dec REG; loop INDEX
+ */
+static int op_dec_loop(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int32_t *p_reg = cpu_reg(cpu, inst->reg);
+    *p_reg -= 1;
+    cpu->result = *p_reg;
+    if (cpu->C != 0) {
+        cpu->instructionPointer = inst[2].arg;
+    } else {
+        cpu->instructionPointer += 4;
+    }
+    return 2;
+}
+
+
+/*
+ * movr REG1 value; push REG2
+ */
+static int op_movr_push(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    if (&cpu->stackBottom[-cpu->stackSize] <= cpu->stackLimit) {
+        return FUSED_SPLIT;
+    }
+    *cpu_reg(cpu, inst->reg) = inst->arg;
+    cpu->stackBottom[-cpu->stackSize] = *cpu_reg(cpu, inst[3].reg);
+    cpu->stackSize++;
+    stack_mark(cpu);
+    cpu->instructionPointer += 5;
+    return 2;
+}
+
+
+/*
+ * load REG1 offset1; add REG2; store REG3 offset2
+ */
+static int op_load_add_store(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    int64_t depth = (int64_t) cpu->D + inst->arg + 1;
+    if (depth <= 0 || depth > cpu->stackSize) {
+        return FUSED_SPLIT;
+    }
+    int32_t val = cpu->stackBottom[depth - cpu->stackSize];
+    int64_t store_depth = (int64_t) (inst->reg == 3 ? val : cpu->D) + inst[5].arg + 1;
+    if (store_depth <= 0 || store_depth > cpu->stackSize) {
+        return FUSED_SPLIT;
+    }
+    *cpu_reg(cpu, inst->reg) = val;
+    cpu->A += *cpu_reg(cpu, inst[3].reg);
+    cpu->result = cpu->A;
+    cpu->stackBottom[store_depth - cpu->stackSize] = *cpu_reg(cpu, inst[5].reg);
+    cpu->instructionPointer += 8;
+    return 2;
+}
+
+/*
+ * cmp REG1 REG2; jz INDEX
+ */
+static int op_cmp_jz(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->result = *cpu_reg(cpu, inst->reg) - *cpu_reg(cpu, inst->arg);
+    cpu->instructionPointer = cpu->result == 0 ? inst[3].arg : cpu->instructionPointer + 5;
+    return 2;
+}
+
+
+/*
+ * cmp REG1 REG2; jnz INDEX
+ */
+static int op_cmp_jnz(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->result = *cpu_reg(cpu, inst->reg) - *cpu_reg(cpu, inst->arg);
+    cpu->instructionPointer = cpu->result != 0 ? inst[3].arg : cpu->instructionPointer + 5;
+    return 2;
+}
+
+
+/*
+ * cmp REG1 REG2; jgt INDEX
+ */
+static int op_cmp_jgt(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    cpu->result = *cpu_reg(cpu, inst->reg) - *cpu_reg(cpu, inst->arg);
+    cpu->instructionPointer = cpu->result > 0 ? inst[3].arg : cpu->instructionPointer + 5;
+    return 2;
+}
+
+/*
+ * Instruction sequences replaced by fused handlers.
+ */
+static const struct
+{
+    uint8_t ops[3];
+    int count;
+    uint8_t handler;
+} fused_instructions[] = {
+    { { cpuOpDec, cpuOpLoop }, 2, handlerDecLoop },
+    { { cpuOpMovr, cpuOpPush }, 2, handlerMovrPush },
+    { { cpuOpLoad, cpuOpAdd, cpuOpStore }, 3, handlerLoadAddStore },
+    { { cpuOpCmp, cpuOpJz }, 2, handlerCmpJz },
+    { { cpuOpCmp, cpuOpJnz }, 2, handlerCmpJnz },
+    { { cpuOpCmp, cpuOpJgt }, 2, handlerCmpJgt },
+};
+
+
+/*
+ * Returns:
+ *      nonzero if instructions on "ip" are the sequence of fused_instructions[i]
+ */
+static int fused_sequence(const struct cpuInstruction *decoded, int32_t ip, int32_t size, size_t i)
+{
+    int32_t next = ip;
+    int count = 0;
+    while (count < fused_instructions[i].count && next < size &&
+            decoded[next].op == fused_instructions[i].ops[count]) {
+        next += decoded[next].length;
+        count++;
+    }
+    return count == fused_instructions[i].count;
+}
+
+
+/*
+ * Replace handler of instruction on "ip" by fused handler if it starts one of fused sequences.
+ */
+static void fuse_instruction(struct cpuInstruction *decoded, int32_t ip, int32_t size)
+{
+    for (size_t i = 0; i < sizeof(fused_instructions) / sizeof(fused_instructions[0]); i++) {
+        if (fused_sequence(decoded, ip, size, i)) {
+            decoded[ip].handler = fused_instructions[i].handler;
+            decoded[ip].count = fused_instructions[i].count;
+            return;
+        }
+    }
+}
+
+
+/*
+ *************************
+ * COUNTED LOOPS
+ *************************
+ *
+ * Loop "L: body; loop L" whose body is straight-line code working only with registers
+ * (nop, add, sub, inc, dec, movr, swap, cmp) and which decrements C by exactly one
+ * is an affine map of (A, B, C, D, result, 1) modulo 2^32, n iterations are its n-th
+ * power. Powers 2^i of the map are computed by cpuDecode, so any number of iterations
+ * is applied by at most LOOP_POWERS matrix-vector products with exact wraparound.
+ */
+
+#define LOOP_VARS CPU_LOOP_VARS
+#define LOOP_RESULT 4
+#define LOOP_ONE 5
+#define LOOP_POWERS CPU_LOOP_POWERS
+#define LOOP_MAX_BODY 64
+
+
+/*
+ * First instruction of counted loop with enough iterations left, cpuRunDecoded runs
+ * the loop by cpuRunLoop (and instructions one by one if it can not).
+ */
+static int op_loop_head(struct cpu *cpu, const struct cpuInstruction *inst)
+{
+    (void) inst;
+    if (cpu->C == 0 || (uint32_t) cpu->C >= CPU_LOOP_MIN_ITERATIONS) {
+        return LOOP_HEAD;
+    }
+    return FUSED_SPLIT;
+}
+
+
+/*
+ * Matrix product out = a * b modulo 2^32, out may not be a or b.
+ */
+static void loop_multiply(uint32_t out[LOOP_VARS][LOOP_VARS], uint32_t a[LOOP_VARS][LOOP_VARS],
+                          uint32_t b[LOOP_VARS][LOOP_VARS])
+{
+    for (int row = 0; row < LOOP_VARS; row++) {
+        for (int col = 0; col < LOOP_VARS; col++) {
+            uint32_t sum = 0;
+            for (int k = 0; k < LOOP_VARS; k++) {
+                sum += a[row][k] * b[k][col];
+            }
+            out[row][col] = sum;
+        }
+    }
+}
+
+
+/*
+ * Compose map of one iteration of loop closed by loop instruction on index "end".
+ * Row of the map gives new value of variable as combination of the old ones.
+ *
+ * Args:
+ *      decoded - decoded instructions
+ *      end - index of the loop instruction
+ *      map - the map is stored here
+ *
+ * Returns:
+ *      number of instructions of one iteration, 0 if it is not a counted loop
+ */
+static uint32_t loop_map(const struct cpuInstruction *decoded, int32_t end, uint32_t map[LOOP_VARS][LOOP_VARS])
+{
+    int32_t ip = decoded[end].arg;
+    uint32_t length = 1;
+    if (ip < 0 || ip >= end) {
+        return 0;
+    }
+
+    memset(map, 0, LOOP_VARS * sizeof(map[0]));
+    for (int i = 0; i < LOOP_VARS; i++) {
+        map[i][i] = 1;
+    }
+    for (; ip < end && length <= LOOP_MAX_BODY; ip += decoded[ip].length, length++) {
+        const struct cpuInstruction *inst = &decoded[ip];
+        uint32_t *dst = map[inst->reg];
+        uint32_t src[LOOP_VARS];
+        switch (inst->op) {
+        case cpuOpNop:
+            break;
+        case cpuOpAdd:
+        case cpuOpSub:
+            memcpy(src, map[inst->reg], sizeof(src));
+            for (int i = 0; i < LOOP_VARS; i++) {
+                map[0][i] += inst->op == cpuOpAdd ? src[i] : 0u - src[i];
+            }
+            memcpy(map[LOOP_RESULT], map[0], sizeof(src));
+            break;
+        case cpuOpInc:
+        case cpuOpDec:
+            dst[LOOP_ONE] += inst->op == cpuOpInc ? 1u : 0u - 1u;
+            memcpy(map[LOOP_RESULT], dst, sizeof(src));
+            break;
+        case cpuOpMovr:
+            memset(dst, 0, sizeof(src));
+            dst[LOOP_ONE] = inst->arg;
+            break;
+        case cpuOpSwap:
+            memcpy(src, dst, sizeof(src));
+            memcpy(dst, map[inst->arg], sizeof(src));
+            memcpy(map[inst->arg], src, sizeof(src));
+            break;
+        case cpuOpCmp:
+            for (int i = 0; i < LOOP_VARS; i++) {
+                src[i] = map[inst->reg][i] - map[inst->arg][i];
+            }
+            memcpy(map[LOOP_RESULT], src, sizeof(src));
+            break;
+        default:
+            return 0;
+        }
+    }
+    if (ip != end) {
+        return 0;
+    }
+
+    /* C has to count down: C = C - 1 */
+    for (int i = 0; i < LOOP_VARS; i++) {
+        if (map[2][i] != (i == 2 ? 1u : i == LOOP_ONE ? 0u - 1u : 0u)) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+
+/*
+ * Find counted loops of decoded program, their loop instructions are marked by cpuCountedLoop
+ * flag and their first instructions get op_loop_head handler.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+static int find_loops(struct cpu *cpu, struct cpuInstruction *decoded, int32_t size)
+{
+    uint32_t map[LOOP_VARS][LOOP_VARS];
+    int32_t capacity = 0;
+
+    free(cpu->loops);
+    cpu->loops = NULL;
+    cpu->loopCount = 0;
+    for (int32_t ip = 0; ip < size; ip++) {
+        uint32_t length;
+        if (decoded[ip].op != cpuOpLoop || (length = loop_map(decoded, ip, map)) == 0) {
+            continue;
+        }
+        if (cpu->loopCount == capacity) {
+            capacity = capacity == 0 ? 4 : 2 * capacity;
+            struct cpuLoop *loops = realloc(cpu->loops, capacity * sizeof(struct cpuLoop));
+            if (loops == NULL) {
+                fprintf(stderr, "Allocation error!");
+                return 1;
+            }
+            cpu->loops = loops;
+        }
+
+        struct cpuLoop *loop = &cpu->loops[cpu->loopCount++];
+        loop->start = decoded[ip].arg;
+        loop->end = ip;
+        loop->length = length;
+        memcpy(loop->powers[0], map, sizeof(map));
+        for (int i = 1; i < LOOP_POWERS; i++) {
+            loop_multiply(loop->powers[i], loop->powers[i - 1], loop->powers[i - 1]);
+        }
+        decoded[ip].flags |= cpuCountedLoop;
+        decoded[loop->start].handler = handlerLoopHead;
+        decoded[loop->start].count = 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Run whole iterations of the counted loop starting on instruction pointer at once.
+ * State after them is the same as after executing the instructions one by one, the loop
+ * is left if C gets to zero.
+ *
+ * Args:
+ *      cpu - emulated cpu structure, instructions have to be decoded by cpuDecode
+ *      steps - maximal number of instructions to do
+ *
+ * Returns:
+ *      number of executed instructions, 0 if the cpu is not on a counted loop
+ *      or less than CPU_LOOP_MIN_ITERATIONS iterations could be done
+ */
+size_t cpuRunLoop(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+
+    // the loop ends when C is zero after dec C
+    uint64_t left = cpu->C == 0 ? UINT64_C(1) << 32 : (uint32_t) cpu->C;
+    if (left < CPU_LOOP_MIN_ITERATIONS || cpu->status != cpuOK) {
+        return 0;
+    }
+
+    int32_t low = 0;
+    int32_t high = cpu->loopCount;
+    while (low < high) {
+        int32_t middle = low + (high - low) / 2;
+        if (cpu->loops[middle].start < cpu->instructionPointer) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == cpu->loopCount || cpu->loops[low].start != cpu->instructionPointer) {
+        return 0;
+    }
+    const struct cpuLoop *loop = &cpu->loops[low];
+    uint64_t count = steps / loop->length;
+    if (count > left) {
+        count = left;
+    }
+    if (count < CPU_LOOP_MIN_ITERATIONS) {
+        return 0;
+    }
+
+    uint32_t vars[LOOP_VARS] = { cpu->A, cpu->B, cpu->C, cpu->D, cpu->result, 1 };
+    for (int i = 0; count >> i != 0; i++) {
+        if ((count >> i & 1) == 0) {
+            continue;
+        }
+        uint32_t next[LOOP_VARS];
+        for (int row = 0; row < LOOP_VARS; row++) {
+            uint32_t sum = 0;
+            for (int k = 0; k < LOOP_VARS; k++) {
+                sum += loop->powers[i][row][k] * vars[k];
+            }
+            next[row] = sum;
+        }
+        memcpy(vars, next, sizeof(vars));
+    }
+    cpu->A = vars[0];
+    cpu->B = vars[1];
+    cpu->C = vars[2];
+    cpu->D = vars[3];
+    cpu->result = vars[LOOP_RESULT];
+    cpu->instructionPointer = count == left ? loop->end + 2 : loop->start;
+    return count * loop->length;
+}
+
+
+/*
+ * Decoded instruction handlers by opcode, followed by the other handlers.
+ */
+static int (*const decoded_instructions[])(struct cpu*, const struct cpuInstruction*) = {
+#define DECODED_HANDLER(name, mnemonic, length, profile) op_##mnemonic,
+    CPU_INSTRUCTIONS(DECODED_HANDLER)
+#undef DECODED_HANDLER
+    [handlerSlow] = op_slow,
+    [handlerLoopHead] = op_loop_head,
+    [handlerDecLoop] = op_dec_loop,
+    [handlerMovrPush] = op_movr_push,
+    [handlerLoadAddStore] = op_load_add_store,
+    [handlerCmpJz] = op_cmp_jz,
+    [handlerCmpJnz] = op_cmp_jnz,
+    [handlerCmpJgt] = op_cmp_jgt,
+    [handlerTrap] = op_trap,
+};
+
+
+/*
+ * Decode instruction stored in the memory on index "ip".
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      inst - record where decoded instruction is stored
+ *      ip - index of instruction in the memory
+ *      size - number of memory words which can hold instructions
+ */
+static void decode_instruction(struct cpu *cpu, struct cpuInstruction *inst, int32_t ip, int32_t size)
+{
+    int32_t opcode = cpu->memory[ip];
+
+    inst->handler = handlerSlow;
+    inst->op = cpuOpSlow;
+    inst->length = 1;
+    inst->reg = 0;
+    inst->arg = 0;
+    inst->count = 1;
+    inst->flags = 0;
+    if (!valid_opcode(cpu, opcode) || inst_lengths[opcode] > size - ip) {
+        return;
+    }
+
+    int32_t arg1 = inst_lengths[opcode] > 1 ? cpu->memory[ip + 1] : 0;
+    int32_t arg2 = inst_lengths[opcode] > 2 ? cpu->memory[ip + 2] : 0;
+    switch (opcode) {
+    case cpuOpNop:
+    case cpuOpHalt:
+    case cpuOpRet:
+        break;
+    case cpuOpLoop:
+    case cpuOpJmp:
+    case cpuOpJz:
+    case cpuOpJnz:
+    case cpuOpJgt:
+    case cpuOpCall:
+        inst->arg = arg1;
+        break;
+    case cpuOpMovr:
+    case cpuOpLoad:
+    case cpuOpStore:
+        if (arg1 < 0 || arg1 > 3) {
+            return;
+        }
+        inst->reg = arg1;
+        inst->arg = arg2;
+        break;
+    case cpuOpSwap:
+    case cpuOpCmp:
+        if (arg1 < 0 || arg1 > 3 || arg2 < 0 || arg2 > 3) {
+            return;
+        }
+        inst->reg = arg1;
+        inst->arg = arg2;
+        break;
+    default:
+        if (arg1 < 0 || arg1 > 3) {
+            return;
+        }
+        inst->reg = arg1;
+        break;
+    }
+    inst->handler = opcode;
+    inst->op = opcode;
+    inst->length = inst_lengths[opcode];
+}
+
+
+/*
+ ************************
+ * Predefined functions
+ ************************
+ */
+
+
+/*
+ * Size of memory for image of image_size bytes and stack of stackCapacity words,
+ * 4KiB blocks with at least one free byte behind the image.
+ */
+static size_t memory_size(size_t image_size, size_t stackCapacity)
+{
+    size_t mem_size = CHUNK_SIZE * ((image_size + 1) / CHUNK_SIZE + 1);
+    size_t words = image_size / 4;
+    if (words + stackCapacity > mem_size / 4) {
+        mem_size += (words + stackCapacity - mem_size / 4 + CHUNK_SIZE / 4 - 1) / (CHUNK_SIZE / 4) * CHUNK_SIZE;
+    }
+    return mem_size;
+}
+
+/*
+ * Memory of size bytes is mapped (see memory_allocate).
+ */
+static int memory_mapped(size_t size)
+{
+#ifdef HAVE_MMAP
+    return size >= MEMORY_MAP_SIZE;
+#else
+    (void) size;
+    return 0;
+#endif
+}
+
+/*
+ * Allocate zeroed memory of size bytes. Large memory (mostly stack) is an anonymous
+ * mapping whatever the malloc thresholds are, so its pages are zeroed by the system
+ * on first touch and untouched stack costs neither time nor resident memory.
+ *
+ * Returns:
+ *      the memory, NULL on allocation error
+ */
+static char *memory_allocate(size_t size)
+{
+#ifdef HAVE_MMAP
+    if (memory_mapped(size)) {
+        void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return block == MAP_FAILED ? NULL : block;
+    }
+#endif
+    return calloc(size, 1);
+}
+
+/*
+ * Free memory of size bytes allocated by memory_allocate.
+ */
+static void memory_free(char *buffer, size_t size)
+{
+#ifdef HAVE_MMAP
+    if (memory_mapped(size)) {
+        munmap(buffer, size);
+        return;
+    }
+#endif
+    free(buffer);
+}
+
+/*
+ * Resize memory allocated by memory_allocate, the first keep bytes are kept and
+ * the rest is zeroed. Mapped memory is never copied past keep, so its untouched
+ * pages stay unallocated.
+ *
+ * Returns:
+ *      the memory, NULL on allocation error (old memory is freed)
+ */
+static char *memory_resize(char *buffer, size_t size, size_t newSize, size_t keep)
+{
+    if (!memory_mapped(size) && !memory_mapped(newSize)) {
+        char *resized = realloc(buffer, newSize);
+        if (resized == NULL) {
+            free(buffer);
+            return NULL;
+        }
+        memset(&resized[keep], 0, newSize - keep);
+        return resized;
+    }
+    char *resized = memory_allocate(newSize);
+    if (resized != NULL) {
+        memcpy(resized, buffer, keep);
+    }
+    memory_free(buffer, size);
+    return resized;
+}
+
+/*
+ * Convert loaded words from little-endian (as instructions are stored) to the host order.
+ */
+static void memory_byte_order(int32_t *words, size_t count)
+{
+    const union { uint32_t word; uint8_t bytes[4]; } probe = { 1 };
+    if (probe.bytes[0] != 1) {
+        for (size_t i = 0; i < count; i++) {
+            uint32_t word = (uint32_t) words[i];
+            words[i] = (int32_t) ((word >> 24) | ((word >> 8) & 0xff00) | ((word << 8) & 0xff0000) | (word << 24));
+        }
+    }
+}
+
+/*
+ * Expected size of the rest of the program file, 0 if it is not known (e.g. pipe).
+ */
+static size_t program_size(FILE *program)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    int fd = fileno(program);
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t offset = ftello(program);
+        if (offset >= 0 && offset < st.st_size) {
+            return st.st_size - offset;
+        }
+    }
+#else
+    (void) program;
+#endif
+    return 0;
+}
+
+/*
+ * Allocate memory sized by the program file and load binary instructions into it
+ * by one bulk read (the buffer is grown geometrically if the size is not known).
+ * Memory behind the instructions is zeroed and the stack is placed at its end.
+ * 
+ * Args:
+ *      program - handle of file where are stored instructions
+ *      stackCapacity - size of stack * sizeof(int32_t)
+ *      stackBottom - empty pointer (end of memory pointer will be stored here)
+ * 
+ * Output:
+ *      pointer to begin of allocated memory
+ */
+int32_t *cpuCreateMemory(FILE *program, size_t stackCapacity, int32_t **stackBottom)
+{
+    size_t mem_size = 0;
+    size_t used = 0;
+    return cpuLoadMemory(program, stackCapacity, NULL, &mem_size, &used, stackBottom);
+}
+
+
+/*
+ * Same as cpuCreateMemory, but loads instructions into already allocated memory
+ * (grown if it is too small), so memory can be reused for more programs.
+ * Only the first memoryUsed bytes of reused memory are cleared, the rest has to be
+ * zero already (stack of the previous program cleared by cpuReset), so reloading
+ * does not depend on stack capacity.
+ * 
+ * Args:
+ *      program - handle of file where are stored instructions
+ *      stackCapacity - size of stack * sizeof(int32_t)
+ *      memory - memory of cpuLoadMemory or NULL
+ *      memorySize - size of memory in bytes, updated if memory is grown
+ *      memoryUsed - bytes of memory which may be nonzero, set to size of the loaded instructions
+ *      stackBottom - empty pointer (end of memory pointer will be stored here)
+ * 
+ * Output:
+ *      pointer to begin of memory, NULL on error (memory is freed)
+ */
+int32_t *cpuLoadMemory(FILE *program, size_t stackCapacity, int32_t *memory, size_t *memorySize, size_t *memoryUsed,
+                       int32_t **stackBottom)
+{
+    assert(program != NULL);
+    assert(memorySize != NULL);
+    assert(memoryUsed != NULL);
+    assert(stackBottom != NULL);
+
+    size_t count = 0;
+    size_t mem_size = memory_size(program_size(program), stackCapacity);
+    size_t capacity = memory == NULL ? 0 : *memorySize;
+    size_t dirty = memory == NULL ? 0 : *memoryUsed;
+    char *buffer = (char *) memory;
+    *memorySize = 0;
+    *memoryUsed = 0;
+    if (mem_size < capacity) {
+        mem_size = capacity;
+    }
+    if (buffer == NULL) {
+        buffer = memory_allocate(mem_size);
+        if (buffer == NULL) {
+            fprintf(stderr, "Allocation error!");
+            return NULL;
+        }
+        capacity = mem_size;
+    }
+    for (;;) {
+        if (mem_size > capacity) {
+            buffer = memory_resize(buffer, capacity, mem_size, count);
+            if (buffer == NULL) {
+                fprintf(stderr, "Allocation error!");
+                return NULL;
+            }
+            capacity = mem_size;
+            dirty = count;
+        }
+        count += fread(&buffer[count], 1, capacity - count, program);
+        if (count < capacity) {
+            break;
+        }
+        mem_size = 2 * capacity;
+    }
+
+    if (count % 4 != 0) {
+        memory_free(buffer, capacity);
+        fprintf(stderr, "Binary file corrupted!");
+        return NULL;
+    }
+    mem_size = memory_size(count, stackCapacity);
+    if (mem_size > capacity || (memory == NULL && mem_size < capacity)) {
+        buffer = memory_resize(buffer, capacity, mem_size, count);
+        if (buffer == NULL) {
+            fprintf(stderr, "Allocation error!");
+            return NULL;
+        }
+        capacity = mem_size;
+        dirty = count;
+    }
+    if (count < dirty) {
+        memset(&buffer[count], 0, dirty - count);
+    }
+
+    int32_t *words = (int32_t *) buffer;
+    memory_byte_order(words, count / 4);
+    *memorySize = capacity;
+    *memoryUsed = count;
+    *stackBottom = &words[(mem_size / 4) - 1];
+    return words;
+}
+
+
+/*
+ * Free memory of memorySize bytes made by cpuCreateMemory or cpuLoadMemory. Large
+ * memory is mapped, the size tells how it was allocated.
+ */
+void cpuFreeMemory(int32_t *memory, size_t memorySize)
+{
+    memory_free((char *) memory, memorySize);
+}
+
+
+/*
+ * Same as cpuCreateMemory, but loads instructions into memory of memorySize bytes
+ * which is never grown nor freed (e.g. memory of a pool). As in cpuLoadMemory only
+ * the first memoryUsed bytes are cleared, the rest has to be zero already.
+ *
+ * Args:
+ *      program - handle of file where are stored instructions
+ *      stackCapacity - size of stack * sizeof(int32_t)
+ *      memory - memory for the program
+ *      memorySize - size of memory in bytes
+ *      memoryUsed - bytes of memory which may be nonzero, set to size of the loaded instructions
+ *      stackBottom - empty pointer (end of memory pointer will be stored here)
+ *
+ * Output:
+ *      pointer to begin of memory, NULL if the program and stack do not fit or on error
+ */
+int32_t *cpuReadMemory(FILE *program, size_t stackCapacity, int32_t *memory, size_t memorySize, size_t *memoryUsed,
+                       int32_t **stackBottom)
+{
+    assert(program != NULL);
+    assert(memory != NULL);
+    assert(memoryUsed != NULL);
+    assert(stackBottom != NULL);
+
+    char *buffer = (char *) memory;
+    size_t dirty = *memoryUsed;
+    size_t count = fread(buffer, 1, memorySize, program);
+    // on error the read bytes stay in memory
+    if (count > dirty) {
+        *memoryUsed = count;
+    }
+    if (count % 4 != 0) {
+        fprintf(stderr, "Binary file corrupted!");
+        return NULL;
+    }
+    size_t mem_size = memory_size(count, stackCapacity);
+    if (count == memorySize || mem_size > memorySize) {
+        fprintf(stderr, "Program does not fit into memory!");
+        return NULL;
+    }
+    if (count < dirty) {
+        memset(&buffer[count], 0, dirty - count);
+    }
+    *memoryUsed = count;
+
+    memory_byte_order(memory, count / 4);
+    *stackBottom = &memory[(mem_size / 4) - 1];
+    return memory;
+}
+
+
+/*
+ * Assign values for pointers and set set stack offset and instruction offset to zero.
+ * 
+ * Args:
+ *      cpu - emulated cpu structure
+ *      memory - pointer to begin of allocated memory
+ *      stackBottom - pointer to end of allocated memory
+ *      stackCapacity - size of stack * sizeof(int32_t)
+ */
+void cpuCreate(struct cpu *cpu, int32_t *memory, int32_t *stackBottom, size_t stackCapacity)
+{
+    assert(cpu != NULL);
+    assert(memory != NULL);
+    assert(stackBottom != NULL);
+
+    cpu->memory = memory;
+    cpu->stackBottom = stackBottom;
+    cpu->stackLimit = &stackBottom[-stackCapacity];
+    cpu->stackHighWater = 0;
+    cpu->decoded = NULL;
+    cpu->decodedSize = 0;
+    cpu->cache = NULL;
+    cpu->verified = NULL;
+    cpu->loops = NULL;
+    cpu->loopCount = 0;
+    cpu->traps = NULL;
+    cpu->ioLog = NULL;
+    cpu->jit = NULL;
+    cpu->native = NULL;
+    cpu->compact = NULL;
+    cpu->counters = NULL;
+    cpu->profile = cpuProfileBase;
+    cpu->output.stream = stdout;
+    cpu->output.buffer = NULL;
+    cpu->output.size = 0;
+    cpu->output.used = 0;
+    cpu->input.stream = stdin;
+    cpu->input.buffer = NULL;
+    cpu->input.mapped = 0;
+    cpu->input.binary = 0;
+    cpu->input.shared = 0;
+    cpu->input.ready = 0;
+    cpuReset(cpu);
+}
+
+
+/*
+ * Free execution counters of the cpu.
+ */
+static void counters_free(struct cpu *cpu)
+{
+    if (cpu->counters != NULL) {
+        free(cpu->counters->addresses);
+        free(cpu->counters);
+        cpu->counters = NULL;
+    }
+}
+
+
+/*
+ * Replace memory of created cpu and reset it. Output, input and allocated buffers
+ * of the cpu are kept, so one cpu can run many programs. Previous memory is not freed,
+ * decoded instructions are dropped (cpuDecode has to be called again) and so are
+ * verification and execution counters.
+ * Stack in the new memory must be zeroed (as by cpuLoadMemory).
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      memory - new memory of the cpu
+ *      stackBottom - end of the memory (see cpuCreateMemory)
+ *      stackCapacity - size of stack
+ */
+void cpuSetMemory(struct cpu *cpu, int32_t *memory, int32_t *stackBottom, size_t stackCapacity)
+{
+    assert(cpu != NULL);
+    assert(memory != NULL);
+    assert(stackBottom != NULL);
+    assert(cpu->jit == NULL);
+    assert(cpu->native == NULL);
+    assert(cpu->compact == NULL);
+    assert(cpu->cache == NULL);
+
+    cpu->memory = memory;
+    cpu->stackBottom = stackBottom;
+    cpu->stackLimit = &stackBottom[-stackCapacity];
+    cpu->stackHighWater = 0;
+    cpu->decodedSize = 0;
+    free(cpu->verified);
+    cpu->verified = NULL;
+    free(cpu->loops);
+    cpu->loops = NULL;
+    cpu->loopCount = 0;
+    free(cpu->traps);
+    cpu->traps = NULL;
+    counters_free(cpu);
+    cpuReset(cpu);
+}
+
+
+/*
+ * Select instruction set of the cpu. Instructions which are not in the profile are illegal,
+ * so the decoded program is dropped and cpuDecode has to be called again.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      profile - instruction set
+ */
+void cpuSetProfile(struct cpu *cpu, enum cpuProfile profile)
+{
+    assert(cpu != NULL);
+    assert((unsigned) profile < CPU_PROFILES);
+    assert(cpu->jit == NULL);
+    assert(cpu->native == NULL);
+    assert(cpu->cache == NULL);
+
+    cpu->profile = profile;
+    cpu->decodedSize = 0;
+    free(cpu->verified);
+    cpu->verified = NULL;
+    free(cpu->loops);
+    cpu->loops = NULL;
+    cpu->loopCount = 0;
+}
+
+
+/*
+ * Free allocated memory and set pointers to NULL value.
+ */
+void cpuDestroy(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    assert(cpu->cache == NULL);
+
+    cpuSetOutputBuffer(cpu, NULL, 0);
+    input_close(&cpu->input);
+    cpuIoLogClose(cpu);
+    if (cpu->memory != NULL) {
+        cpuFreeMemory(cpu->memory, (cpu->stackBottom - cpu->memory + 1) * sizeof(int32_t));
+    }
+    free(cpu->decoded);
+    free(cpu->verified);
+    free(cpu->loops);
+    free(cpu->traps);
+    counters_free(cpu);
+    cpu->memory = NULL;
+    cpu->verified = NULL;
+    cpu->loops = NULL;
+    cpu->loopCount = 0;
+    cpu->traps = NULL;
+    cpu->decoded = NULL;
+    cpu->decodedSize = 0;
+    cpu->stackBottom = NULL;
+    cpu->stackLimit = NULL;
+}
+
+
+/*
+ * Write output of the cpu to stream (stdout by default). Output is buffered
+ * and written when the buffer is full, when cpuRun finishes or by cpuFlush.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      stream - output stream
+ */
+void cpuSetOutput(struct cpu *cpu, FILE *stream)
+{
+    assert(cpu != NULL);
+    assert(stream != NULL);
+
+    cpuFlush(cpu);
+    if (cpu->output.stream == NULL) {
+        cpu->output.buffer = NULL;
+        cpu->output.size = 0;
+        cpu->output.used = 0;
+    }
+    cpu->output.stream = stream;
+}
+
+
+/*
+ * Write output of the cpu to caller supplied buffer. When it is full,
+ * out/put instructions fail with cpuIOError.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      buffer - output buffer, cpu->output.used holds length of the output
+ *      size - size of the buffer
+ */
+void cpuSetOutputBuffer(struct cpu *cpu, char *buffer, size_t size)
+{
+    assert(cpu != NULL);
+
+    cpuFlush(cpu);
+    if (cpu->output.stream != NULL) {
+        free(cpu->output.buffer);
+    }
+    cpu->output.stream = NULL;
+    cpu->output.buffer = buffer;
+    cpu->output.size = size;
+    cpu->output.used = 0;
+}
+
+
+/*
+ * Write buffered output to the output stream.
+ */
+void cpuFlush(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->output.stream == NULL || cpu->output.used == 0) {
+        return;
+    }
+    fwrite(cpu->output.buffer, 1, cpu->output.used, cpu->output.stream);
+    fflush(cpu->output.stream);
+    cpu->output.used = 0;
+}
+
+
+/*
+ * Read input of the cpu from stream (stdin by default). Regular files are memory mapped,
+ * pipes are read in large blocks. Stream is prepared on the first read.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      stream - input stream, NULL if the program has no input
+ *      flags - cpuInputBinary if in reads raw little-endian int32 values instead of text,
+ *              cpuInputShared if stream is read by others too (e.g. stdin in trace mode)
+ */
+void cpuSetInput(struct cpu *cpu, FILE *stream, int flags)
+{
+    assert(cpu != NULL);
+
+    input_close(&cpu->input);
+    cpu->input.stream = stream;
+    cpu->input.binary = (flags & cpuInputBinary) != 0;
+    cpu->input.shared = (flags & cpuInputShared) != 0;
+}
+
+
+/*
+ * Record values consumed by in/get and produced by out/put to log, input and output
+ * work as usual. Stream of the log is owned by the caller, it is complete after
+ * cpuIoLogClose.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+int cpuRecordIo(struct cpu *cpu, FILE *log)
+{
+    assert(cpu != NULL);
+    assert(log != NULL);
+    assert(cpu->ioLog == NULL);
+
+    struct cpuIoLog *ioLog = calloc(1, sizeof(struct cpuIoLog));
+    if (ioLog == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+    ioLog->record = log;
+    fwrite(IOLOG_MAGIC, 1, strlen(IOLOG_MAGIC), log);
+    putc(IOLOG_VERSION, log);
+    cpu->ioLog = ioLog;
+    return ferror(log) != 0;
+}
+
+
+/*
+ * Replay log recorded by cpuRecordIo. In/get take their values from the log (input is
+ * not read) and out/put compare their values with it (output is not written). First
+ * difference fails the cpu with cpuIOError.
+ *
+ * Returns:
+ *      0 if ok, 1 if the log can not be read or is not an I/O log
+ */
+int cpuReplayIo(struct cpu *cpu, FILE *log)
+{
+    assert(cpu != NULL);
+    assert(log != NULL);
+    assert(cpu->ioLog == NULL);
+
+    struct cpuIoLog *ioLog = calloc(1, sizeof(struct cpuIoLog));
+    size_t capacity = CHUNK_SIZE;
+    unsigned char *data = malloc(capacity);
+    size_t size = 0;
+    size_t len;
+    while (data != NULL && (len = fread(&data[size], 1, capacity - size, log)) > 0) {
+        size += len;
+        if (size == capacity) {
+            unsigned char *grown = realloc(data, 2 * capacity);
+            if (grown == NULL) {
+                free(data);
+            }
+            data = grown;
+            capacity *= 2;
+        }
+    }
+    if (ioLog == NULL || data == NULL) {
+        fprintf(stderr, "Allocation error!");
+        free(ioLog);
+        free(data);
+        return 1;
+    }
+    size_t header = strlen(IOLOG_MAGIC);
+    if (ferror(log) || size <= header || memcmp(data, IOLOG_MAGIC, header) != 0 || data[header] != IOLOG_VERSION) {
+        fprintf(stderr, "I/O log corrupted!");
+        free(ioLog);
+        free(data);
+        return 1;
+    }
+    ioLog->data = data;
+    ioLog->size = size;
+    ioLog->pos = header + 1;
+    cpu->ioLog = ioLog;
+    return 0;
+}
+
+
+/*
+ * Stop recording or replaying I/O of the cpu.
+ *
+ * Returns:
+ *      0 if the recorded log was written or the whole replayed log matched, 1 otherwise
+ */
+int cpuIoLogClose(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    struct cpuIoLog *log = cpu->ioLog;
+    if (log == NULL) {
+        return 0;
+    }
+    int ret;
+    if (log->record != NULL) {
+        ret = fflush(log->record) != 0 || ferror(log->record);
+    } else {
+        ret = log->failed || log->pos != log->size;
+        if (!log->failed && log->pos != log->size) {
+            fprintf(stderr, "I/O log has events after event %zu\n", log->events);
+        }
+    }
+    free(log->data);
+    free(log);
+    cpu->ioLog = NULL;
+    return ret;
+}
+
+
+/*
+ * Set registers to zero, set stack values to zero, set stack offset and instruction offset to zero.
+ * Only stack slots up to stackHighWater are cleared, the rest was never written.
+ * 
+ * Args:
+ *      cpu - emulated cpu structure
+ */
+void cpuReset(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    cpu->A = 0;
+    cpu->B = 0;
     cpu->C = 0;
     cpu->D = 0;
-#ifdef BONUS_JMP
     cpu->result = 0;
-#endif
     cpu->status = cpuOK;
     cpu->stackSize = 0;
     cpu->instructionPointer = 0;
-    int32_t *i = cpu->stackBottom;
-    while (i > cpu->stackLimit) {
-        *i = 0;
-        i = &i[-1];
+    memset(&cpu->stackBottom[1 - cpu->stackHighWater], 0, cpu->stackHighWater * sizeof(int32_t));
+    cpu->stackHighWater = 0;
+}
+
+
+/*
+ * Translate cpu->status to string and returns it.
+ */
+const char *cpuStatusName(enum cpuStatus status)
+{
+    switch (status) {
+    case cpuOK:
+        return "cpuOK";
+    case cpuHalted:
+        return "cpuHalted";
+    case cpuIllegalInstruction:
+        return "cpuIllegalInstruction";
+    case cpuIllegalOperand:
+        return "cpuIllegalOperand";
+    case cpuInvalidAddress:
+        return "cpuInvalidAddress";
+    case cpuInvalidStackOperation:
+        return "cpuInvalidStackOperation";
+    case cpuDivByZero:
+        return "cpuDivByZero";
+    case cpuIOError:
+        return "cpuIOError";
+    default:
+        fprintf(stderr, "BUG: Unknown status (%d)\n", status);
+        abort();
+    }
+}
+
+
+/*
+ * Mnemonics by opcode.
+ */
+static const char *const opcode_names[CPU_OPCODES] = {
+#define OPCODE_NAME(name, mnemonic, length, profile) #mnemonic,
+    CPU_INSTRUCTIONS(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+
+/*
+ * Names of instruction set profiles.
+ */
+static const char *const profile_names[CPU_PROFILES] = { "base", "jmp", "call" };
+
+
+/*
+ * Translate profile to string.
+ */
+const char *cpuProfileName(enum cpuProfile profile)
+{
+    assert((unsigned) profile < CPU_PROFILES);
+
+    return profile_names[profile];
+}
+
+
+/*
+ * Translate opcode to mnemonic.
+ *
+ * Returns:
+ *      mnemonic or NULL if opcode is not valid in any profile
+ */
+const char *cpuOpcodeName(int32_t opcode)
+{
+    if (opcode < 0 || opcode >= CPU_OPCODES) {
+        return NULL;
+    }
+    return opcode_names[opcode];
+}
+
+
+/*
+ * Length of instruction (including operands) by opcode.
+ *
+ * Args:
+ *      opcode - opcode of the instruction
+ *      profile - instruction set, CPU_PROFILES - 1 for opcodes of any profile
+ *
+ * Returns:
+ *      number of words of the instruction, 0 if opcode is not valid in profile
+ */
+int cpuOpcodeLength(int32_t opcode, enum cpuProfile profile)
+{
+    if (opcode < 0 || opcode >= CPU_OPCODES || inst_profiles[opcode] > profile) {
+        return 0;
+    }
+    return inst_lengths[opcode];
+}
+
+
+/*
+ * Prints cpu registers and stack memory to stream.
+ */
+void cpuPrintState(struct cpu *cpu, FILE *stream)
+{
+    assert(cpu != NULL);
+    assert(stream != NULL);
+
+    fprintf(stream, "A: %d, B: %d, C: %d, D: %d\n", cpu->A, cpu->B, cpu->C, cpu->D);
+
+    fprintf(stream, "Stack size: %d\n", cpu->stackSize);
+    fprintf(stream, "Stack:");
+    for (int i = 0; i < cpu->stackSize; i++) {
+        fprintf(stream, " %d", cpu->stackBottom[-i]);
+    }
+    fprintf(stream, "\n");
+    if (cpu->profile >= cpuProfileJmp) {
+        fprintf(stream, "Result: %d\n", cpu->result);
     }
+    fprintf(stream, "Status: %s\n", cpuStatusName(cpu->status));
+    fprintf(stream, "Instruction pointer: %d\n", cpu->instructionPointer);
 }
 
 
@@ -699,32 +2587,12 @@ int cpuStep(struct cpu *cpu)
         cpu->status = cpuInvalidAddress;
         return 0;
     }
-    int inst_lengths[] = { 1, 1, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 2, 2, 2, 2, 3, 2, 2, 3, 2, 2, 2, 2, 2, 1 };
-
-#ifndef BONUS_CALL
-#ifndef BONUS_JMP
-    int instruction_count = 18;
-    int (*int_foo[])(struct cpu*) = {nop, halt, add, sub, mul, divi, inc, dec, loop, movr, load, store,
-                                     in, get, out, put, swap, push, pop};
-#endif
-#ifdef BONUS_JMP
-    int instruction_count = 23;
-    int (*int_foo[])(struct cpu*) = {nop, halt, add, sub, mul, divi, inc, dec, loop, movr, load, store,
-                                     in, get, out, put, swap, push, pop, cmp, jmp, jz, jnz, jgt};
-#endif
-#endif
-#ifdef BONUS_CALL
-    int instruction_count = 25;
-    int (*int_foo[])(struct cpu*) = {nop, halt, add, sub, mul, divi, inc, dec, loop, movr, load, store,
-                                     in, get, out, put, swap, push, pop, cmp, jmp, jz, jnz, jgt, call, ret};
-#endif
-
-    if (cpu->memory[cpu->instructionPointer] >= 0 && cpu->memory[cpu->instructionPointer] <= instruction_count) {
+    if (valid_opcode(cpu, cpu->memory[cpu->instructionPointer])) {
         int inst_len = inst_lengths[cpu->memory[cpu->instructionPointer]];
         if (check_instruction(cpu, inst_len)) {
             return 0;
         }
-        int ret_code = (*int_foo[cpu->memory[cpu->instructionPointer]])(cpu);
+        int ret_code = (*instructions[cpu->memory[cpu->instructionPointer]])(cpu);
         if (ret_code == 1) {
             cpu->instructionPointer += inst_len;
         }
@@ -736,7 +2604,7 @@ int cpuStep(struct cpu *cpu)
 
 
 /*
- * Call cpuStep function "step" times.
+ * Call cpuStep function "step" times and flush output of the cpu.
  * 
  * Args:
  *      cpu - emulated cpu structure
@@ -764,6 +2632,544 @@ int cpuRun(struct cpu *cpu, size_t steps)
             break;
         }
     }
+    cpuFlush(cpu);
+    return i;
+}
+
+
+/*
+ * Allocate execution counters of the cpu, one address counter for every word
+ * instruction pointer can reach.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+static int counters_create(struct cpu *cpu)
+{
+    struct cpuCounters *counters = calloc(1, sizeof(struct cpuCounters));
+    if (counters == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+    counters->addressCount = cpu->stackLimit - cpu->memory + 1;
+    counters->addresses = calloc(counters->addressCount, sizeof(uint64_t));
+    if (counters->addresses == NULL) {
+        fprintf(stderr, "Allocation error!");
+        free(counters);
+        return 1;
+    }
+    cpu->counters = counters;
+    return 0;
+}
+
+
+/*
+ * Condition of loop and conditional jumps before the instruction is executed.
+ *
+ * Returns:
+ *      1 if the jump will be taken, 0 if not, -1 if the opcode is not conditional
+ */
+static int branch_taken(struct cpu *cpu, int32_t opcode)
+{
+    switch (opcode) {
+    case cpuOpLoop:
+        return cpu->C != 0;
+    case cpuOpJz:
+        return cpu->result == 0;
+    case cpuOpJnz:
+        return cpu->result != 0;
+    case cpuOpJgt:
+        return cpu->result > 0;
+    default:
+        return -1;
+    }
+}
+
+
+/*
+ * Same as cpuRun, but counts executed instructions by opcode and address,
+ * taken and not taken branches and the deepest stack. Counters are kept
+ * in the cpu, so other engines pay nothing for them.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions (same as cpuRun)
+ */
+int cpuRunCounted(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+
+    if (steps <= 0) {
+        return 0;
+    }
+    if (cpu->counters == NULL && counters_create(cpu) != 0) {
+        return cpuRun(cpu, steps);
+    }
+    struct cpuCounters *counters = cpu->counters;
+
+    size_t i = 0;
+    while (i < steps) {
+        int32_t ip = cpu->instructionPointer;
+        counters->steps++;
+        if (cpu->status != cpuOK || ip < 0 || (size_t) ip >= counters->addressCount
+                || !valid_opcode(cpu, cpu->memory[ip])) {
+            counters->illegal++;
+            cpuStep(cpu);
+        } else {
+            int32_t opcode = cpu->memory[ip];
+            int taken = branch_taken(cpu, opcode);
+            counters->opcodes[opcode]++;
+            counters->addresses[ip]++;
+            if (cpuStep(cpu) != 0 && taken >= 0) {
+                if (taken) {
+                    counters->taken[opcode]++;
+                } else {
+                    counters->notTaken[opcode]++;
+                }
+            }
+            if (cpu->stackSize > counters->stackHighWater) {
+                counters->stackHighWater = cpu->stackSize;
+            }
+        }
+        i++;
+        if (cpu->status == cpuHalted) {
+            break;
+        }
+        if (cpu->status != cpuOK) {
+            i = -i;
+            break;
+        }
+    }
+    cpuFlush(cpu);
+    return i;
+}
+
+
+/*
+ * Returns:
+ *      execution counters of the cpu, NULL if cpuRunCounted was not called
+ */
+const struct cpuCounters *cpuGetCounters(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return cpu->counters;
+}
+
+
+/*
+ * Decode code region of the memory into array of pre-validated instructions.
+ * Every word of the region gets its record, so jumps can land anywhere.
+ * Memory below the stack is never written, so decoding stays valid until cpuDestroy.
+ * Common instruction sequences get fused handlers executing them at once.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise
+ */
+int cpuDecode(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    assert(cpu->memory != NULL);
+    assert(cpu->cache == NULL);
+
+    int32_t size = cpu->stackLimit - cpu->memory + 1;
+    struct cpuInstruction *decoded = realloc(cpu->decoded, size * sizeof(struct cpuInstruction));
+    if (decoded == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+    cpu->decoded = decoded;
+    for (int32_t ip = 0; ip < size; ip++) {
+        decode_instruction(cpu, &decoded[ip], ip, size);
+    }
+    if (cpu->traps != NULL) {
+        // traps are never fused nor part of counted loops
+        for (int32_t ip = 0; ip < size; ip++) {
+            if (cpu->traps[ip]) {
+                decoded[ip].op = cpuOpTrap;
+                decoded[ip].handler = handlerTrap;
+            }
+        }
+    }
+    for (int32_t ip = 0; ip < size; ip++) {
+        fuse_instruction(decoded, ip, size);
+    }
+    if (find_loops(cpu, decoded, size) != 0) {
+        return 1;
+    }
+
+    cpu->decoded = decoded;
+    cpu->decodedSize = size;
+    return 0;
+}
+
+
+/*
+ * Check that decoded program which was not decoded by cpuDecode of this process
+ * (mapped from cache) can be run: opcodes are valid in the profile of the cpu, registers
+ * and lengths are in range, handlers match their instructions and counted loops are
+ * within the code region and match the records of their instructions.
+ *
+ * Args:
+ *      cpu - emulated cpu structure, the program is its code region
+ *      decoded - decoded instructions, one for every word of the code region
+ *      loops - counted loops, sorted by start
+ *      loopCount - number of counted loops
+ *
+ * Returns:
+ *      0 if the program is valid, 1 otherwise
+ */
+int cpuCheckDecoded(const struct cpu *cpu, const struct cpuInstruction *decoded,
+                    const struct cpuLoop *loops, int32_t loopCount)
+{
+    assert(cpu != NULL);
+    assert(decoded != NULL);
+
+    int32_t size = cpu->stackLimit - cpu->memory + 1;
+    for (int32_t ip = 0; ip < size; ip++) {
+        const struct cpuInstruction *inst = &decoded[ip];
+        if (inst->op == cpuOpSlow) {
+            if (inst->handler != handlerSlow || inst->length != 1 || inst->count != 1 || inst->flags != 0) {
+                return 1;
+            }
+        } else if (!valid_opcode(cpu, inst->op) || inst->length != inst_lengths[inst->op] ||
+                   inst->length > size - ip || inst->reg > 3 || (inst->flags & ~cpuCountedLoop) != 0 ||
+                   ((inst->flags & cpuCountedLoop) && inst->op != cpuOpLoop) ||
+                   ((inst->op == cpuOpSwap || inst->op == cpuOpCmp) && (inst->arg < 0 || inst->arg > 3))) {
+            return 1;
+        }
+    }
+
+    uint32_t map[LOOP_VARS][LOOP_VARS];
+    for (int32_t i = 0; i < loopCount; i++) {
+        const struct cpuLoop *loop = &loops[i];
+        if (loop->start < 0 || loop->start >= loop->end || loop->end >= size ||
+                (i > 0 && loop->start <= loops[i - 1].start) || decoded[loop->end].op != cpuOpLoop ||
+                decoded[loop->end].arg != loop->start || !(decoded[loop->end].flags & cpuCountedLoop) ||
+                decoded[loop->start].handler != handlerLoopHead ||
+                loop->length != loop_map(decoded, loop->end, map) ||
+                memcmp(loop->powers[0], map, sizeof(map)) != 0) {
+            return 1;
+        }
+    }
+
+    int32_t next_loop = 0;
+    for (int32_t ip = 0; ip < size; ip++) {
+        const struct cpuInstruction *inst = &decoded[ip];
+        while (next_loop < loopCount && loops[next_loop].start < ip) {
+            next_loop++;
+        }
+        if (inst->op == cpuOpSlow || (inst->handler == inst->op && inst->count == 1)) {
+            continue;
+        }
+        if (inst->handler == handlerLoopHead) {
+            if (inst->count != 1 || next_loop == loopCount || loops[next_loop].start != ip) {
+                return 1;
+            }
+            continue;
+        }
+        size_t i = 0;
+        while (i < sizeof(fused_instructions) / sizeof(fused_instructions[0]) &&
+                (inst->handler != fused_instructions[i].handler || inst->count != fused_instructions[i].count ||
+                 !fused_sequence(decoded, ip, size, i))) {
+            i++;
+        }
+        if (i == sizeof(fused_instructions) / sizeof(fused_instructions[0])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static uint64_t fingerprint_add(uint64_t hash, uint32_t value)
+{
+    for (int byte = 0; byte < 4; byte++) {
+        hash = (hash ^ ((value >> (8 * byte)) & 0xff)) * 1099511628211u;
+    }
+    return hash;
+}
+
+
+/*
+ * Fingerprint of decoded programs: FNV-1a of the layout of records and loops, indexes
+ * of handlers and fused sequences. It changes when handlers are reordered or added,
+ * so records decoded by another build are not run by this one.
+ */
+uint64_t cpuDecodedFingerprint(void)
+{
+    const uint32_t values[] = {
+        sizeof(struct cpuInstruction), sizeof(struct cpuLoop), CPU_OPCODES, handlerSlow, handlerLoopHead,
+        handlerDecLoop, handlerMovrPush, handlerLoadAddStore, handlerCmpJz, handlerCmpJnz, handlerCmpJgt,
+        handlerTrap,
+    };
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        hash = fingerprint_add(hash, values[i]);
+    }
+    for (int opcode = 0; opcode < CPU_OPCODES; opcode++) {
+        hash = fingerprint_add(hash, inst_lengths[opcode]);
+    }
+    for (size_t i = 0; i < sizeof(fused_instructions) / sizeof(fused_instructions[0]); i++) {
+        for (int k = 0; k < 3; k++) {
+            hash = fingerprint_add(hash, fused_instructions[i].ops[k]);
+        }
+        hash = fingerprint_add(hash, fused_instructions[i].count);
+        hash = fingerprint_add(hash, fused_instructions[i].handler);
+    }
+    return hash;
+}
+
+
+/*
+ * Breakpoints without cost for the other instructions. Trapped instructions are decoded
+ * as cpuOpTrap, so engines of decoded program stop before them and the debugger executes
+ * them by cpuStep (which reads the memory, not the decoded program).
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      traps - 1 for every trapped word of the code region, NULL to remove all traps
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+int cpuSetTraps(struct cpu *cpu, const uint8_t *traps)
+{
+    assert(cpu != NULL);
+    assert(cpu->memory != NULL);
+
+    int32_t size = cpu->stackLimit - cpu->memory + 1;
+    free(cpu->traps);
+    cpu->traps = NULL;
+    if (traps != NULL) {
+        if ((cpu->traps = malloc(size)) == NULL) {
+            fprintf(stderr, "Allocation error!");
+            return 1;
+        }
+        memcpy(cpu->traps, traps, size);
+    }
+    return cpuDecode(cpu);
+}
+
+
+/*
+ * Returns:
+ *      nonzero if instruction on index ip may change register reg ('A', 'B', 'C', 'D' or 'S'),
+ *      instructions which fail are not counted
+ */
+int cpuWritesRegister(struct cpu *cpu, int32_t ip, char reg)
+{
+    assert(cpu != NULL);
+
+    int32_t size = cpu->stackLimit - cpu->memory + 1;
+    if (ip < 0 || ip >= size || !valid_opcode(cpu, cpu->memory[ip])) {
+        return 0;
+    }
+    int32_t arg1 = ip + 1 < size ? cpu->memory[ip + 1] : -1;
+    int32_t arg2 = ip + 2 < size ? cpu->memory[ip + 2] : -1;
+    char first = arg1 >= 0 && arg1 <= 3 ? "ABCD"[arg1] : 0;
+    char second = arg2 >= 0 && arg2 <= 3 ? "ABCD"[arg2] : 0;
+
+    switch (cpu->memory[ip]) {
+    case cpuOpAdd:
+    case cpuOpSub:
+    case cpuOpMul:
+    case cpuOpDiv:
+        return reg == 'A';
+    case cpuOpInc:
+    case cpuOpDec:
+    case cpuOpMovr:
+    case cpuOpLoad:
+        return reg == first;
+    case cpuOpIn:
+    case cpuOpGet:
+        // C is cleared at the end of input
+        return reg == first || reg == 'C';
+    case cpuOpSwap:
+        return reg == first || reg == second;
+    case cpuOpPop:
+        return reg == first || reg == 'S';
+    case cpuOpPush:
+    case cpuOpCall:
+    case cpuOpRet:
+        return reg == 'S';
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Static verifier. Instructions reachable from instruction 0 are found by walking
+ * the control flow graph (fall through and targets of loop, jumps and call,
+ * return addresses of call are the fall through of call). The program is verified
+ * if every reachable instruction was decoded (valid opcode, registers 0-3 and whole
+ * in the memory), every target and fall through is start of a reachable instruction
+ * inside of the code region and no reachable instruction starts inside of operands
+ * of another one. Then the only way to an invalid instruction pointer is ret.
+ *
+ * Args:
+ *      cpu - emulated cpu structure, instructions have to be decoded by cpuDecode
+ *
+ * Returns:
+ *      0 if the program is verified (cpu->verified is set), 1 otherwise
+ */
+int cpuVerify(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+
+    if (cpu->cache != NULL) {
+        // verdict was cached with the program
+        return cpu->verified == NULL;
+    }
+
+    free(cpu->verified);
+    cpu->verified = NULL;
+
+    int32_t size = cpu->decodedSize;
+    const struct cpuInstruction *decoded = cpu->decoded;
+    if (size <= 0) {
+        return 1;
+    }
+    uint8_t *verified = calloc(size, sizeof(uint8_t));
+    int32_t *pending = malloc(size * sizeof(int32_t));
+    if (verified == NULL || pending == NULL) {
+        fprintf(stderr, "Allocation error!");
+        free(verified);
+        free(pending);
+        return 1;
+    }
+
+    int ret = 0;
+    size_t count = 0;
+    pending[count++] = 0;
+    verified[0] = 1;
+    while (count > 0 && ret == 0) {
+        const struct cpuInstruction *inst = &decoded[pending[--count]];
+        int32_t ip = inst - decoded;
+        int32_t next[2];
+        int successors = 0;
+
+        switch (inst->op) {
+        case cpuOpSlow:
+            ret = 1;
+            break;
+        case cpuOpHalt:
+        case cpuOpRet:
+            break;
+        case cpuOpJmp:
+            next[successors++] = inst->arg;
+            break;
+        case cpuOpLoop:
+        case cpuOpJz:
+        case cpuOpJnz:
+        case cpuOpJgt:
+        case cpuOpCall:
+            next[successors++] = inst->arg;
+            next[successors++] = ip + inst->length;
+            break;
+        default:
+            next[successors++] = ip + inst->length;
+            break;
+        }
+
+        for (int i = 0; i < successors && ret == 0; i++) {
+            if (next[i] < 0 || next[i] >= size) {
+                ret = 1;
+            } else if (!verified[next[i]]) {
+                verified[next[i]] = 1;
+                pending[count++] = next[i];
+            }
+        }
+    }
+
+    // operands must not be instructions
+    for (int32_t ip = 0; ip < size && ret == 0; ip++) {
+        if (verified[ip]) {
+            for (int32_t i = 1; i < decoded[ip].length; i++) {
+                if (verified[ip + i]) {
+                    ret = 1;
+                }
+            }
+        }
+    }
+
+    free(pending);
+    if (ret != 0) {
+        free(verified);
+        return 1;
+    }
+    cpu->verified = verified;
+    return 0;
+}
+
+
+/*
+ * Same as cpuRun, but executes instructions decoded by cpuDecode.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions
+ */
+int cpuRunDecoded(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+
+    size_t i = 0;
+    if (steps <= 0) {
+        return 0;
+    }
+    if (cpu->status != cpuOK) {
+        return cpu->status == cpuHalted ? 1 : -1;
+    }
+    const struct cpuInstruction *decoded = cpu->decoded;
+    while (i < steps) {
+        int32_t ip = cpu->instructionPointer;
+        i++;
+        if (ip < 0 || ip >= cpu->decodedSize) {
+            cpu->status = cpuInvalidAddress;
+            i = -i;
+            break;
+        }
+        const struct cpuInstruction *inst = &decoded[ip];
+        size_t count = inst->count;
+        int ret_code = FUSED_SPLIT;
+        if (count <= steps - i + 1) {
+            ret_code = decoded_instructions[inst->handler](cpu, inst);
+        }
+        if (ret_code == TRAP) {
+            i--;
+            break;
+        }
+        if (ret_code == LOOP_HEAD && (count = cpuRunLoop(cpu, steps - i + 1)) > 0) {
+            i += count - 1;
+            continue;
+        }
+        if (ret_code == FUSED_SPLIT || ret_code == LOOP_HEAD) {
+            count = 1;
+            ret_code = decoded_instructions[inst->op](cpu, inst);
+        }
+        i += count - 1;
+        if (ret_code == 1) {
+            cpu->instructionPointer = ip + inst->length;
+        } else if (cpu->status != cpuOK) {
+            if (cpu->status != cpuHalted) {
+                i = -i;
+            }
+            break;
+        }
+    }
+    cpuFlush(cpu);
     return i;
 }
 
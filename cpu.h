@@ -21,6 +21,181 @@ enum cpuStatus
     cpuIOError
 };
 
+/*
+ * Instruction set, one X(name, mnemonic, length, profile) for every opcode in
+ * opcode order. Length includes operands, profile is the first profile with
+ * the instruction (see cpuProfile).
+ */
+#define CPU_INSTRUCTIONS(X)         \
+    X(Nop, nop, 1, Base)            \
+    X(Halt, halt, 1, Base)          \
+    X(Add, add, 2, Base)            \
+    X(Sub, sub, 2, Base)            \
+    X(Mul, mul, 2, Base)            \
+    X(Div, div, 2, Base)            \
+    X(Inc, inc, 2, Base)            \
+    X(Dec, dec, 2, Base)            \
+    X(Loop, loop, 2, Base)          \
+    X(Movr, movr, 3, Base)          \
+    X(Load, load, 3, Base)          \
+    X(Store, store, 3, Base)        \
+    X(In, in, 2, Base)              \
+    X(Get, get, 2, Base)            \
+    X(Out, out, 2, Base)            \
+    X(Put, put, 2, Base)            \
+    X(Swap, swap, 3, Base)          \
+    X(Push, push, 2, Base)          \
+    X(Pop, pop, 2, Base)            \
+    X(Cmp, cmp, 3, Jmp)             \
+    X(Jmp, jmp, 2, Jmp)             \
+    X(Jz, jz, 2, Jmp)               \
+    X(Jnz, jnz, 2, Jmp)             \
+    X(Jgt, jgt, 2, Jmp)             \
+    X(Call, call, 2, Call)          \
+    X(Ret, ret, 1, Call)
+
+/*
+ * Instruction opcodes as they are stored in the program image.
+ */
+enum cpuOpcode
+{
+#define CPU_OPCODE(name, mnemonic, length, profile) cpuOp##name,
+    CPU_INSTRUCTIONS(CPU_OPCODE)
+#undef CPU_OPCODE
+
+    /* Decoded only: breakpoint, engines stop before it (see cpuSetTraps) */
+    cpuOpTrap = 0xfe,
+    /* Decoded only: instruction which has to be executed by cpuStep */
+    cpuOpSlow = 0xff
+};
+
+/*
+ * Instruction set profiles, every profile contains instructions of the previous ones.
+ * Result register is used only with cpuProfileJmp and above.
+ */
+enum cpuProfile
+{
+    cpuProfileBase,     // without bonus instructions
+    cpuProfileJmp,      // + cmp, jmp, jz, jnz, jgt
+    cpuProfileCall,     // + call, ret
+};
+
+/*
+ * Number of instruction set profiles.
+ */
+#define CPU_PROFILES (cpuProfileCall + 1)
+
+/*
+ * Number of opcodes (including bonus instructions).
+ */
+#define CPU_OPCODES (cpuOpRet + 1)
+
+struct cpu;
+struct cpuJit;
+struct cpuNative;
+struct cpuCompact;
+struct cpuCache;
+struct cpuIoLog;
+
+/*
+ * Pre-decoded instruction, one record for every word of the code region.
+ * Register operands are already validated (0 = A ... 3 = D), the second
+ * register of swap/cmp is stored in arg, loop which closes a counted loop has
+ * cpuCountedLoop flag (see cpuRunLoop). Handler of a record can execute "count"
+ * instructions at once (fused instructions), op, length and operands always
+ * describe the first of them. Records hold no pointers, so they can be cached (see cpuCacheStore).
+ */
+struct cpuInstruction
+{
+    int32_t arg;
+    uint8_t op;
+    uint8_t length;
+    uint8_t reg;
+    uint8_t count;
+    uint8_t handler;            // index of the handler in cpu.c
+    uint8_t flags;              // enum cpuInstructionFlag
+};
+
+/*
+ * Flags of decoded instructions.
+ */
+enum cpuInstructionFlag
+{
+    cpuCountedLoop = 1,         // loop instruction of a counted loop, the rest of it can be run by cpuRunLoop
+};
+
+#define CPU_LOOP_VARS 6         // A, B, C, D, result and constant 1
+#define CPU_LOOP_POWERS 33      // C = 0 loops 2^32 times
+
+/*
+ * Counted loop found by cpuDecode, powers 2^i of the affine map of one iteration.
+ */
+struct cpuLoop
+{
+    int32_t start;
+    int32_t end;                // the loop instruction
+    uint32_t length;            // instructions of one iteration (including loop)
+    uint32_t powers[CPU_LOOP_POWERS][CPU_LOOP_VARS][CPU_LOOP_VARS];
+};
+
+/*
+ * Output of out/put instructions. Output is collected in buffer and written
+ * to stream when the buffer is full or cpu stops. Without stream the buffer
+ * is supplied by caller and holds "used" bytes of output.
+ */
+struct cpuOutput
+{
+    FILE *stream;
+    char *buffer;
+    size_t size;
+    size_t used;
+};
+
+/*
+ * Input of in/get instructions. Regular files are memory mapped, other
+ * streams are read in large blocks (terminals by stdio, one byte at a time).
+ * In binary mode in reads raw little-endian int32 values.
+ */
+struct cpuInput
+{
+    FILE *stream;
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    unsigned char *buffer;
+    size_t mapped;
+    unsigned char byte;
+    int binary;
+    int shared;
+    int ready;
+};
+
+/*
+ * Flags of cpuSetInput.
+ */
+enum cpuInputFlags
+{
+    cpuInputText = 0,
+    cpuInputBinary = 1,     // in reads raw little-endian int32 values
+    cpuInputShared = 2,     // stream is shared with other readers, read it only by stdio
+};
+
+/*
+ * Execution counters collected by cpuRunCounted. Faulting instructions are
+ * counted too, steps with invalid address or opcode only in "illegal".
+ */
+struct cpuCounters
+{
+    uint64_t steps;
+    uint64_t illegal;
+    uint64_t opcodes[CPU_OPCODES];
+    uint64_t taken[CPU_OPCODES];        // loop and conditional jumps
+    uint64_t notTaken[CPU_OPCODES];
+    uint64_t *addresses;                // hits by instruction pointer
+    size_t addressCount;
+    int32_t stackHighWater;             // the deepest stack seen
+};
+
 /*
  * Emulated cpu structure.
  */
@@ -36,23 +211,72 @@ struct cpu
     int32_t *memory;
     int *stackBottom;
     int *stackLimit;
-
-#ifdef BONUS_JMP
+    int32_t stackHighWater;     // stack slots which may be nonzero (cleared by cpuReset)
+    struct cpuInstruction *decoded;
+    int32_t decodedSize;
+    struct cpuCache *cache;             // decoded, verified and loops are mapped by cpuCacheLoad
+    uint8_t *verified;                  // 1 for instructions proven by cpuVerify, NULL if not verified
+    struct cpuLoop *loops;              // counted loops found by cpuDecode, sorted by start
+    uint8_t *traps;                     // 1 for instructions decoded as cpuOpTrap, NULL if none
+    int32_t loopCount;
+    struct cpuJit *jit;
+    struct cpuNative *native;           // translated program loaded by cpuNativeCreate
+    struct cpuCompact *compact;         // compact bytecode made by cpuCompactCreate
+    struct cpuCounters *counters;       // NULL until cpuRunCounted
+    struct cpuOutput output;
+    struct cpuInput input;
+    struct cpuIoLog *ioLog;             // I/O recorded by cpuRecordIo or replayed by cpuReplayIo
+    enum cpuProfile profile;            // instruction set, cpuProfileBase by default
     int32_t result;
-#endif
 };
 
 /*
- * Allocating 4KiB blocks of memory and load binary instructions into it.
- * In finale realocare memory using size of loaded instructions + size of stack.
+ * Allocate memory sized by the program file and load binary instructions into it.
+ * Memory size is multiple of 4KiB and holds instructions + stack, pages of the stack
+ * are not touched, so the system allocates them when the program first uses them.
  */
 int32_t *cpuCreateMemory(FILE *program, size_t stackCapacity, int32_t **stackBottom);
 
+/*
+ * Same as cpuCreateMemory, but reuses memory of *memorySize bytes (may be NULL)
+ * and grows it if needed. Only the first *memoryUsed bytes of the memory are cleared,
+ * the rest must be zero (stack cleared by cpuReset), *memoryUsed is set to the size
+ * of the loaded program. On error memory is freed and NULL is returned.
+ */
+int32_t *cpuLoadMemory(FILE *program, size_t stackCapacity, int32_t *memory, size_t *memorySize, size_t *memoryUsed,
+                       int32_t **stackBottom);
+
+/*
+ * Free memory of memorySize bytes made by cpuCreateMemory (its size is stackBottom - memory + 1
+ * words) or cpuLoadMemory. Memory of a created cpu is freed by cpuDestroy.
+ */
+void cpuFreeMemory(int32_t *memory, size_t memorySize);
+
+/*
+ * Same as cpuCreateMemory, but uses memory of memorySize bytes which is never grown nor freed.
+ * *memoryUsed is cleared and updated as by cpuLoadMemory. Returns NULL if the program with
+ * stack does not fit.
+ */
+int32_t *cpuReadMemory(FILE *program, size_t stackCapacity, int32_t *memory, size_t memorySize, size_t *memoryUsed,
+                       int32_t **stackBottom);
+
 /*
  * Assign values for pointers and set set stack offset and instruction offset to zero.
+ * Stack in memory must be zeroed (as by cpuCreateMemory).
  */
 void cpuCreate(struct cpu *cpu, int32_t *memory, int32_t *stackBottom, size_t stackCapacity);
 
+/*
+ * Replace memory of created cpu (keeping its buffers and input/output) and reset it.
+ * Previous memory is not freed, cpuDecode has to be called again before decoded engines.
+ */
+void cpuSetMemory(struct cpu *cpu, int32_t *memory, int32_t *stackBottom, size_t stackCapacity);
+
+/*
+ * Select instruction set of the cpu. Decoded program is dropped, cpuDecode has to be called again.
+ */
+void cpuSetProfile(struct cpu *cpu, enum cpuProfile profile);
+
 /*
  * Free allocated memory and set pointers to NULL value.
  */
@@ -74,10 +298,230 @@ int cpuStatus(struct cpu *cpu);
 int cpuStep(struct cpu *cpu);
 
 /*
- * Call cpuStep function "step" times.
+ * Call cpuStep function "step" times and flush output of the cpu.
  */
 int cpuRun(struct cpu *cpu, size_t steps);
 
+/*
+ * Same as cpuRun, but updates execution counters of the cpu (see cpuGetCounters).
+ */
+int cpuRunCounted(struct cpu *cpu, size_t steps);
+
+/*
+ * Returns execution counters summed over all cpuRunCounted calls since the program
+ * was set, NULL if there were none.
+ */
+const struct cpuCounters *cpuGetCounters(struct cpu *cpu);
+
+/*
+ * Write output of the cpu to stream (stdout by default).
+ */
+void cpuSetOutput(struct cpu *cpu, FILE *stream);
+
+/*
+ * Write output of the cpu to caller supplied buffer, cpu fails with cpuIOError when it is full.
+ */
+void cpuSetOutputBuffer(struct cpu *cpu, char *buffer, size_t size);
+
+/*
+ * Write buffered output to the output stream.
+ */
+void cpuFlush(struct cpu *cpu);
+
+/*
+ * Read input of the cpu from stream (stdin by default, NULL for none), flags are cpuInputFlags.
+ */
+void cpuSetInput(struct cpu *cpu, FILE *stream, int flags);
+
+/*
+ * Record values consumed by in/get and produced by out/put to binary log, returns nonzero on error.
+ */
+int cpuRecordIo(struct cpu *cpu, FILE *log);
+
+/*
+ * Replay I/O log: in/get read values from it and out/put are checked against it instead of
+ * being written. Returns nonzero if the log is not valid.
+ */
+int cpuReplayIo(struct cpu *cpu, FILE *log);
+
+/*
+ * Stop recording or replaying I/O, returns nonzero on write error or if the replay did not match
+ * the whole log.
+ */
+int cpuIoLogClose(struct cpu *cpu);
+
+/*
+ * Same as cpuRun for each of count cpus with the same program and profile (the first one decoded),
+ * but runs them in lockstep. Results are stored to results, returns 1 on allocation error.
+ */
+int cpuRunLockstep(struct cpu **cpus, size_t count, size_t steps, int *results);
+
+/*
+ * Translate cpu status to string.
+ */
+const char *cpuStatusName(enum cpuStatus status);
+
+/*
+ * Translate profile to string ("base", "jmp", "call").
+ */
+const char *cpuProfileName(enum cpuProfile profile);
+
+/*
+ * Translate opcode to mnemonic, NULL if the opcode is not valid.
+ */
+const char *cpuOpcodeName(int32_t opcode);
+
+/*
+ * Returns number of words of instruction (including operands) with opcode, 0 if the opcode
+ * is not valid in profile (CPU_PROFILES - 1 accepts opcodes of all profiles).
+ */
+int cpuOpcodeLength(int32_t opcode, enum cpuProfile profile);
+
+/*
+ * Print registers, stack and status of the cpu to stream.
+ */
+void cpuPrintState(struct cpu *cpu, FILE *stream);
+
+/*
+ * Decode code region of the memory into array of pre-validated instructions.
+ */
+int cpuDecode(struct cpu *cpu);
+
+/*
+ * Check decoded program which was not decoded by cpuDecode (e.g. mapped from file) before
+ * it is run, returns 0 if records and loops are valid for the code region and profile of the cpu.
+ */
+int cpuCheckDecoded(const struct cpu *cpu, const struct cpuInstruction *decoded,
+                    const struct cpuLoop *loops, int32_t loopCount);
+
+/*
+ * Returns fingerprint of decoding of this build, decoded programs of other builds can not be run.
+ */
+uint64_t cpuDecodedFingerprint(void);
+
+/*
+ * Counted loops with fewer iterations left are executed instruction by instruction.
+ */
+#define CPU_LOOP_MIN_ITERATIONS 64
+
+/*
+ * Run whole iterations of the counted loop starting on instruction pointer (found by cpuDecode)
+ * at once, at most steps instructions. Returns number of instructions done, 0 if the cpu is not
+ * on a counted loop or it has too few iterations left.
+ */
+size_t cpuRunLoop(struct cpu *cpu, size_t steps);
+
+/*
+ * Prove that decoded program can not fail on invalid opcode, operand or instruction address
+ * (except after ret), returns 0 if it is verified.
+ */
+int cpuVerify(struct cpu *cpu);
+
+/*
+ * Same as cpuRun, but executes instructions decoded by cpuDecode.
+ */
+int cpuRunDecoded(struct cpu *cpu, size_t steps);
+
+/*
+ * Same as cpuRun, but executes instructions decoded by cpuDecode in one threaded dispatch loop.
+ */
+int cpuRunThreaded(struct cpu *cpu, size_t steps);
+
+/*
+ * Same as cpuRunThreaded without checks of instruction pointer if the program was verified by cpuVerify.
+ */
+int cpuRunVerified(struct cpu *cpu, size_t steps);
+
+/*
+ * Prepare x86-64 JIT for the cpu, instructions have to be decoded by cpuDecode.
+ * Returns nonzero if JIT is not available.
+ */
+int cpuJitCreate(struct cpu *cpu);
+
+/*
+ * Free JIT of the cpu, has to be called before cpuDestroy.
+ */
+void cpuJitDestroy(struct cpu *cpu);
+
+/*
+ * Same as cpuRun, but executes native code compiled by JIT where possible.
+ */
+int cpuRunJit(struct cpu *cpu, size_t steps);
+
+/*
+ * Write the decoded program as a C translation unit for cpuNativeCreate, returns nonzero on write error.
+ */
+int cpuTranslate(struct cpu *cpu, FILE *out);
+
+/*
+ * Load the program translated to C and compiled to a shared library (NULL = translate and compile
+ * it now), instructions have to be decoded by cpuDecode. Returns nonzero if it is not available.
+ */
+int cpuNativeCreate(struct cpu *cpu, const char *library);
+
+/*
+ * Unload translated program of the cpu, has to be called before cpuDestroy.
+ */
+void cpuNativeDestroy(struct cpu *cpu);
+
+/*
+ * Same as cpuRun, but executes the program translated to native code.
+ */
+int cpuRunNative(struct cpu *cpu, size_t steps);
+
+/*
+ * Decode the program again with instructions marked in traps (one byte for every word of the code
+ * region, NULL = none) replaced by cpuOpTrap. Decoded, threaded and verified engines stop before
+ * a trap without executing it, cpuStep ignores traps. Returns nonzero on allocation error.
+ */
+int cpuSetTraps(struct cpu *cpu, const uint8_t *traps);
+
+/*
+ * Returns nonzero if instruction on index ip may change register reg (A, B, C, D or S as in cpuPeek).
+ */
+int cpuWritesRegister(struct cpu *cpu, int32_t ip, char reg);
+
+/*
+ * Convert program image to compact variable-length bytecode, returns nonzero on error.
+ */
+int cpuCompactEncode(FILE *program, FILE *out);
+
+/*
+ * Convert compact bytecode back to the same program image, returns nonzero on error or invalid bytecode.
+ */
+int cpuCompactDecode(FILE *compact, FILE *out);
+
+/*
+ * Encode code region of the cpu memory to compact bytecode for cpuRunCompact, returns nonzero on error.
+ */
+int cpuCompactCreate(struct cpu *cpu);
+
+/*
+ * Free compact bytecode of the cpu, has to be called before cpuDestroy.
+ */
+void cpuCompactDestroy(struct cpu *cpu);
+
+/*
+ * Same as cpuRun, but executes the compact bytecode.
+ */
+int cpuRunCompact(struct cpu *cpu, size_t steps);
+
+/*
+ * Map decoded program, verification and counted loops cached for the program in memory
+ * of the cpu and its profile from directory. Returns nonzero if it is not cached.
+ */
+int cpuCacheLoad(struct cpu *cpu, const char *directory);
+
+/*
+ * Verify the decoded program and store it to the cache in directory, returns nonzero on error.
+ */
+int cpuCacheStore(struct cpu *cpu, const char *directory);
+
+/*
+ * Unmap cached program of the cpu, has to be called before cpuDestroy (and before decoding again).
+ */
+void cpuCacheClose(struct cpu *cpu);
+
 /*
  * Returns value of selected register.
  */
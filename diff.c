@@ -0,0 +1,803 @@
+#include "cpu.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define invalidArgs "Invalid arguments, run ./cpu_diff [-e engine] [-p base|jmp|call] [-c step|block|exit|STEPS] " \
+                    "[-n programs] [-l steps] [-s seed] [-o FILE] [FILE...]\n"
+
+/*
+ * Differential harness of engines. The reference cpu runs a program by cpuRun
+ * (instruction by instruction by cpuStep), the other one by an optimized engine.
+ * Both get the same input and the same budgets of steps: one instruction, one
+ * basic block of the reference, fixed number of steps or the whole run. After
+ * every budget return values and states are compared (registers, stack size and
+ * contents, status, instruction pointer and output) and the first divergence is
+ * reported. Programs are generated randomly from all instructions of the profile,
+ * with sequences which get fused handlers, counted loops and calls, or given as files.
+ *
+ * Both sides record their I/O (see cpuRecordIo) and the logs have to be the same.
+ * Then the log of the reference is replayed by the engine from the start and its
+ * final state is compared again.
+ */
+
+#define DEFAULT_PROGRAMS 1000
+#define DEFAULT_STEPS 10000
+#define STACK_CAPACITY 16
+#define MAX_WORDS 256
+#define MAX_INSTRUCTIONS 48
+#define OUTPUT_SIZE 4096
+#define INPUT_SIZE 256
+
+enum compareMode
+{
+    COMPARE_STEP,
+    COMPARE_BLOCK,
+    COMPARE_EXIT,
+    COMPARE_INTERVAL
+};
+
+static int prepare_decoded(struct cpu *cpu)
+{
+    return cpuDecode(cpu);
+}
+
+
+static int prepare_verified(struct cpu *cpu)
+{
+    if (cpuDecode(cpu) != 0) {
+        return 1;
+    }
+    // unverified programs are run checked
+    cpuVerify(cpu);
+    return 0;
+}
+
+
+static int prepare_jit(struct cpu *cpu)
+{
+    return cpuDecode(cpu) != 0 || cpuJitCreate(cpu) != 0;
+}
+
+
+static int prepare_native(struct cpu *cpu)
+{
+    return cpuDecode(cpu) != 0 || cpuNativeCreate(cpu, NULL) != 0;
+}
+
+
+static int prepare_compact(struct cpu *cpu)
+{
+    return cpuCompactCreate(cpu);
+}
+
+
+static int prepare_none(struct cpu *cpu)
+{
+    (void) cpu;
+    return 0;
+}
+
+
+static int run_lockstep(struct cpu *cpu, size_t steps)
+{
+    int result = 0;
+    if (cpuRunLockstep(&cpu, 1, steps, &result) != 0) {
+        fprintf(stderr, "Allocation error!");
+    }
+    return result;
+}
+
+
+struct engine
+{
+    const char *name;
+    int (*prepare)(struct cpu *cpu);
+    int (*run)(struct cpu *cpu, size_t steps);
+    void (*release)(struct cpu *cpu);
+    bool standard;              // tested unless engine is selected by -e
+};
+
+static const struct engine engines[] = {
+    { "decoded", prepare_decoded, cpuRunDecoded, NULL, true },
+    { "threaded", prepare_decoded, cpuRunThreaded, NULL, true },
+    { "verified", prepare_verified, cpuRunVerified, NULL, true },
+    { "jit", prepare_jit, cpuRunJit, cpuJitDestroy, true },
+    { "compact", prepare_compact, cpuRunCompact, cpuCompactDestroy, true },
+    { "counted", prepare_none, cpuRunCounted, NULL, true },
+    { "lockstep", prepare_decoded, run_lockstep, NULL, true },
+    /* compiles every program by the system compiler */
+    { "native", prepare_native, cpuRunNative, cpuNativeDestroy, false },
+};
+
+/*
+ * Program with its input.
+ */
+struct program
+{
+    int32_t words[MAX_WORDS];
+    size_t size;
+    char input[INPUT_SIZE];
+    enum cpuProfile profile;
+    uint64_t seed;              // seed of generated program
+    const char *path;           // path of program from file
+};
+
+/*
+ * Cpu of one side of the comparison.
+ */
+struct side
+{
+    struct cpu cpu;
+    FILE *input;
+    FILE *log;                  // recorded I/O log, NULL if not recorded
+    char output[OUTPUT_SIZE];
+};
+
+
+static uint64_t random_state;
+
+/*
+ * Returns next pseudo-random number (SplitMix64).
+ */
+static uint32_t random_next(void)
+{
+    uint64_t z = (random_state += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return (uint32_t) ((z ^ (z >> 31)) >> 32);
+}
+
+
+static int32_t random_below(uint32_t bound)
+{
+    return (int32_t) (random_next() % bound);
+}
+
+
+/*
+ * Returns random register number, sometimes invalid one.
+ */
+static int32_t random_register(void)
+{
+    return random_below(50) == 0 ? random_below(3) == 0 ? -1 : 4 + random_below(3) : random_below(4);
+}
+
+
+/*
+ * Returns random value, mostly small so loops end and stack offsets are valid.
+ */
+static int32_t random_value(void)
+{
+    switch (random_below(8)) {
+    case 0:
+        return (int32_t) random_next();
+    case 1:
+        // INT32_MIN / -1 traps on the host in every engine
+        return INT32_MIN + 1 + random_below(3);
+    case 2:
+        return INT32_MAX - random_below(3);
+    default:
+        return random_below(11) - 3;
+    }
+}
+
+
+/*
+ * Append words to the program if they fit.
+ */
+static void emit(struct program *program, const int32_t *words, size_t count)
+{
+    if (program->size + count <= MAX_WORDS - 1) {
+        memcpy(&program->words[program->size], words, count * sizeof(int32_t));
+        program->size += count;
+    }
+}
+
+
+/*
+ * Append random instruction of the profile (with random operands).
+ *
+ * Args:
+ *      program - generated program
+ *      targets - indexes of jump targets to be set later are appended here
+ *      targetCount - number of targets
+ */
+static void emit_random(struct program *program, size_t *targets, size_t *targetCount)
+{
+    int32_t opcode;
+    do {
+        opcode = random_below(CPU_OPCODES);
+    } while (cpuOpcodeLength(opcode, program->profile) == 0 && random_below(20) != 0);
+
+    int32_t words[3] = { opcode, random_register(), random_register() };
+    switch (opcode) {
+    case cpuOpMovr:
+        words[2] = random_value();
+        break;
+    case cpuOpLoad:
+    case cpuOpStore:
+        words[2] = random_below(7) - 3;
+        break;
+    case cpuOpLoop:
+    case cpuOpJmp:
+    case cpuOpJz:
+    case cpuOpJnz:
+    case cpuOpJgt:
+    case cpuOpCall:
+        if (program->size + 2 <= MAX_WORDS - 1) {
+            targets[(*targetCount)++] = program->size + 1;
+        }
+        break;
+    default:
+        break;
+    }
+    emit(program, words, cpuOpcodeLength(opcode, CPU_PROFILES - 1));
+}
+
+
+/*
+ * Generate random program of the profile and its input from seed. Jump targets
+ * are mostly starts of instructions.
+ */
+static void generate(struct program *program, enum cpuProfile profile, uint64_t seed)
+{
+    size_t starts[MAX_WORDS];
+    size_t targets[MAX_WORDS];
+    size_t startCount = 0;
+    size_t targetCount = 0;
+
+    random_state = seed;
+    memset(program, 0, sizeof(struct program));
+    program->profile = profile;
+    program->seed = seed;
+
+    if (random_below(4) != 0) {
+        const int32_t prologue[] = { cpuOpMovr, 3, random_below(4) };
+        starts[startCount++] = program->size;
+        emit(program, prologue, 3);
+    }
+    int instructions = 1 + random_below(MAX_INSTRUCTIONS);
+    for (int i = 0; i < instructions && program->size < MAX_WORDS - 16; i++) {
+        int32_t r = random_register();
+        int32_t s = random_register();
+        starts[startCount++] = program->size;
+        switch (random_below(16)) {
+        case 0: {
+            /* counted loop */
+            int32_t count = random_below(4) == 0 ? random_value() : random_below(100);
+            const int32_t head[] = { cpuOpMovr, 2, count };
+            emit(program, head, 3);
+            size_t start = program->size;
+            int body = random_below(4);
+            for (int j = 0; j < body; j++) {
+                const int32_t ops[] = { cpuOpNop, cpuOpAdd, cpuOpSub, cpuOpInc, cpuOpMovr, cpuOpSwap, cpuOpCmp };
+                int32_t op = ops[random_below(profile >= cpuProfileJmp ? 7 : 6)];
+                const int32_t words[] = { op, random_below(2), op == cpuOpMovr ? random_value() : 3 };
+                emit(program, words, cpuOpcodeLength(op, CPU_PROFILES - 1));
+            }
+            const int32_t tail[] = { cpuOpDec, 2, cpuOpLoop, (int32_t) start };
+            emit(program, tail, 4);
+            break;
+        }
+        case 1: {
+            /* fused sequences */
+            const int32_t movrPush[] = { cpuOpMovr, r, random_value(), cpuOpPush, r };
+            const int32_t loadAddStore[] = {
+                cpuOpLoad, r, random_below(5) - 3, cpuOpAdd, s, cpuOpStore, r, random_below(5) - 3
+            };
+            if (random_below(2) == 0) {
+                emit(program, movrPush, 5);
+            } else {
+                emit(program, loadAddStore, 8);
+            }
+            break;
+        }
+        case 2:
+            if (profile >= cpuProfileJmp) {
+                const int32_t cmpJump[] = { cpuOpCmp, r, s, cpuOpJz + random_below(3), 0 };
+                emit(program, cmpJump, 5);
+                targets[targetCount++] = program->size - 1;
+                break;
+            }
+            /* fall through */
+        default:
+            emit_random(program, targets, &targetCount);
+            break;
+        }
+        if (random_below(50) == 0) {
+            // word which is not an instruction
+            const int32_t invalid = random_below(2) == 0 ? CPU_OPCODES + random_below(5) : -1 - random_below(3);
+            emit(program, &invalid, 1);
+        }
+    }
+    const int32_t halt = cpuOpHalt;
+    starts[startCount++] = program->size;
+    program->words[program->size++] = halt;
+
+    for (size_t i = 0; i < targetCount; i++) {
+        int32_t *target = &program->words[targets[i]];
+        switch (random_below(20)) {
+        case 0:
+            *target = random_below(program->size + 2);
+            break;
+        case 1:
+            *target = random_value();
+            break;
+        default:
+            *target = starts[random_below(startCount)];
+            break;
+        }
+    }
+
+    /* numbers and characters, in fails on the first one which is not a number */
+    size_t used = 0;
+    int tokens = random_below(12);
+    for (int i = 0; i < tokens && used < INPUT_SIZE - 16; i++) {
+        if (random_below(6) == 0) {
+            used += snprintf(&program->input[used], INPUT_SIZE - used, "%c", 'a' + random_below(26));
+        } else {
+            used += snprintf(&program->input[used], INPUT_SIZE - used, "%" PRId32 " ", random_value());
+        }
+    }
+}
+
+
+/*
+ * Load program from file, input of the program is empty.
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise
+ */
+static int load(struct program *program, const char *path, enum cpuProfile profile)
+{
+    memset(program, 0, sizeof(struct program));
+    program->profile = profile;
+    program->path = path;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    unsigned char bytes[4];
+    while (program->size < MAX_WORDS && fread(bytes, 1, 4, file) == 4) {
+        program->words[program->size++] = (int32_t) ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 |
+                                                     (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+    }
+    int ret = !feof(file) && fgetc(file) != EOF;
+    fclose(file);
+    if (ret != 0) {
+        fprintf(stderr, "%s: program has more than %d words\n", path, MAX_WORDS);
+    }
+    return ret;
+}
+
+
+/*
+ * Create cpu with the program, its input and output buffer.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+static int side_create(struct side *side, const struct program *program)
+{
+    unsigned char image[MAX_WORDS * 4];
+    for (size_t i = 0; i < program->size; i++) {
+        uint32_t word = (uint32_t) program->words[i];
+        for (int byte = 0; byte < 4; byte++) {
+            image[4 * i + byte] = (unsigned char) (word >> (8 * byte));
+        }
+    }
+    FILE *file = tmpfile();
+    side->input = tmpfile();
+    if (file == NULL || side->input == NULL) {
+        perror("tmpfile");
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (side->input != NULL) {
+            fclose(side->input);
+        }
+        return 1;
+    }
+    side->log = NULL;
+    fwrite(image, 4, program->size, file);
+    rewind(file);
+    fputs(program->input, side->input);
+    rewind(side->input);
+
+    int32_t *stackBottom;
+    int32_t *memory = cpuCreateMemory(file, STACK_CAPACITY, &stackBottom);
+    fclose(file);
+    if (memory == NULL) {
+        fclose(side->input);
+        return 1;
+    }
+    cpuCreate(&side->cpu, memory, stackBottom, STACK_CAPACITY);
+    cpuSetProfile(&side->cpu, program->profile);
+    cpuSetInput(&side->cpu, side->input, cpuInputText);
+    cpuSetOutputBuffer(&side->cpu, side->output, sizeof(side->output));
+    return 0;
+}
+
+
+static void side_destroy(struct side *side)
+{
+    cpuDestroy(&side->cpu);
+    fclose(side->input);
+    if (side->log != NULL) {
+        fclose(side->log);
+    }
+}
+
+
+/*
+ * Record I/O of the side to a temporary log.
+ *
+ * Returns:
+ *      0 if ok, 1 on error
+ */
+static int side_record(struct side *side)
+{
+    side->log = tmpfile();
+    if (side->log == NULL) {
+        perror("tmpfile");
+        return 1;
+    }
+    return cpuRecordIo(&side->cpu, side->log);
+}
+
+
+/*
+ * Returns:
+ *      true if recorded logs of the sides are the same (both are complete)
+ */
+static bool same_logs(struct side *reference, struct side *tested)
+{
+    int ret = cpuIoLogClose(&reference->cpu) | cpuIoLogClose(&tested->cpu);
+    rewind(reference->log);
+    rewind(tested->log);
+    int a;
+    int b;
+    do {
+        a = getc(reference->log);
+        b = getc(tested->log);
+    } while (a == b && a != EOF);
+    return ret == 0 && a == b;
+}
+
+
+/*
+ * Returns:
+ *      number of instructions to the end of basic block at the instruction pointer
+ *      (including the instruction which ends it), at most limit
+ */
+static size_t block_length(const struct cpu *cpu, size_t limit)
+{
+    int32_t size = cpu->stackLimit - cpu->memory + 1;
+    int32_t ip = cpu->instructionPointer;
+    size_t count = 0;
+    while (count < limit) {
+        count++;
+        if (ip < 0 || ip >= size) {
+            break;
+        }
+        int32_t opcode = cpu->memory[ip];
+        int length = cpuOpcodeLength(opcode, cpu->profile);
+        if (length == 0 || opcode == cpuOpHalt ||
+                opcode == cpuOpLoop || (opcode >= cpuOpJmp && opcode <= cpuOpJgt) || opcode == cpuOpCall ||
+                opcode == cpuOpRet) {
+            break;
+        }
+        ip += length;
+    }
+    return count;
+}
+
+
+/*
+ * Returns:
+ *      name of the first different part of states, NULL if they are the same
+ */
+static const char *difference(const struct cpu *reference, const struct cpu *cpu, bool output)
+{
+    if (reference->A != cpu->A) {
+        return "A";
+    }
+    if (reference->B != cpu->B) {
+        return "B";
+    }
+    if (reference->C != cpu->C) {
+        return "C";
+    }
+    if (reference->D != cpu->D) {
+        return "D";
+    }
+    // result register is not kept by engines without bonus instructions
+    if (reference->profile >= cpuProfileJmp && reference->result != cpu->result) {
+        return "result";
+    }
+    if (reference->stackSize != cpu->stackSize) {
+        return "stack size";
+    }
+    if (reference->status != cpu->status) {
+        return "status";
+    }
+    if (reference->instructionPointer != cpu->instructionPointer) {
+        return "instruction pointer";
+    }
+    int32_t size = reference->stackSize;
+    if (size > 0 && memcmp(&reference->stackBottom[1 - size], &cpu->stackBottom[1 - size], size * sizeof(int32_t)) != 0) {
+        return "stack";
+    }
+    if (output && (reference->output.used != cpu->output.used ||
+                   memcmp(reference->output.buffer, cpu->output.buffer, reference->output.used) != 0)) {
+        return "output";
+    }
+    return NULL;
+}
+
+
+static void print_state(const char *name, const struct cpu *cpu, int result)
+{
+    printf("  %-10s returned %d: A=%" PRId32 " B=%" PRId32 " C=%" PRId32 " D=%" PRId32 " result=%" PRId32
+           " stack=%" PRId32 " ip=%" PRId32 " %s\n", name, result, cpu->A, cpu->B, cpu->C, cpu->D, cpu->result,
+           cpu->stackSize, cpu->instructionPointer, cpuStatusName(cpu->status));
+}
+
+
+static void print_program(const struct program *program)
+{
+    if (program->path != NULL) {
+        printf("%s: ", program->path);
+    } else {
+        printf("seed %" PRIu64 ": ", program->seed);
+    }
+}
+
+
+/*
+ * Returns:
+ *      true if the cpu failed on full output buffer, such out/put is not recorded
+ *      and replayed out/put writes nothing, so the replay can not fail the same way
+ */
+static bool output_full(const struct cpu *cpu)
+{
+    int32_t ip = cpu->instructionPointer;
+    return cpu->status == cpuIOError && ip >= 0 && ip <= cpu->stackLimit - cpu->memory &&
+           (cpu->memory[ip] == cpuOpOut || cpu->memory[ip] == cpuOpPut);
+}
+
+
+/*
+ * Replay I/O log of the reference by the engine (input is not read, output is only
+ * checked against the log) and compare final states.
+ *
+ * Returns:
+ *      0 if they are the same, 1 if they differ, -1 on error
+ */
+static int replay(const struct program *program, const struct engine *engine, struct side *reference, size_t steps)
+{
+    struct side *replayed = malloc(sizeof(struct side));
+    if (replayed == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return -1;
+    }
+    int ret = -1;
+    if (side_create(replayed, program) == 0) {
+        rewind(reference->log);
+        if (engine->prepare(&replayed->cpu) == 0 && cpuReplayIo(&replayed->cpu, reference->log) == 0) {
+            int result = engine->run(&replayed->cpu, steps);
+            const char *part = difference(&reference->cpu, &replayed->cpu, false);
+            if (part == NULL && cpuIoLogClose(&replayed->cpu) != 0) {
+                part = "replayed I/O log";
+            }
+            ret = 0;
+            if (part != NULL) {
+                print_program(program);
+                printf("%s replaying I/O log differs from cpuStep in %s (profile %s, %zu steps)\n", engine->name,
+                       part, cpuProfileName(program->profile), steps);
+                print_state("reference", &reference->cpu, 0);
+                print_state(engine->name, &replayed->cpu, result);
+                ret = 1;
+            }
+        }
+        if (engine->release != NULL) {
+            engine->release(&replayed->cpu);
+        }
+        side_destroy(replayed);
+    }
+    free(replayed);
+    return ret;
+}
+
+
+/*
+ * Run the program by reference and by engine and compare them after every budget of steps.
+ *
+ * Returns:
+ *      0 if they are the same, 1 if they differ, -1 if the engine is not available
+ */
+static int compare(const struct program *program, const struct engine *engine, enum compareMode mode,
+                   size_t interval, size_t steps)
+{
+    struct side *reference = malloc(sizeof(struct side));
+    struct side *tested = malloc(sizeof(struct side));
+    if (reference == NULL || tested == NULL) {
+        fprintf(stderr, "Allocation error!");
+        free(reference);
+        free(tested);
+        return -1;
+    }
+    int ret = -1;
+    if (side_create(reference, program) == 0) {
+        if (side_create(tested, program) == 0) {
+            if (engine->prepare(&tested->cpu) == 0 && side_record(reference) == 0 && side_record(tested) == 0) {
+                ret = 0;
+            }
+            size_t done = 0;
+            while (ret == 0 && done < steps && reference->cpu.status == cpuOK) {
+                size_t budget = mode == COMPARE_STEP ? 1 : mode == COMPARE_EXIT ? steps - done :
+                                mode == COMPARE_BLOCK ? block_length(&reference->cpu, steps - done) :
+                                interval < steps - done ? interval : steps - done;
+                int32_t ip = reference->cpu.instructionPointer;
+                int32_t opcode = ip >= 0 && ip <= reference->cpu.stackLimit - reference->cpu.memory ?
+                                 reference->cpu.memory[ip] : -1;
+                int expected = cpuRun(&reference->cpu, budget);
+                int result = engine->run(&tested->cpu, budget);
+                const char *part = expected != result ? "return value" :
+                                   difference(&reference->cpu, &tested->cpu, true);
+                if (part != NULL) {
+                    print_program(program);
+                    printf("%s differs from cpuStep in %s (profile %s, steps %zu-%zu from ip %" PRId32 " %s)\n",
+                           engine->name, part, cpuProfileName(program->profile), done + 1, done + budget, ip,
+                           cpuOpcodeName(opcode));
+                    print_state("reference", &reference->cpu, expected);
+                    print_state(engine->name, &tested->cpu, result);
+                    ret = 1;
+                }
+                done += budget;
+            }
+            if (ret == 0 && !same_logs(reference, tested)) {
+                print_program(program);
+                printf("%s differs from cpuStep in recorded I/O log (profile %s)\n", engine->name,
+                       cpuProfileName(program->profile));
+                ret = 1;
+            }
+            if (ret == 0 && !output_full(&reference->cpu)) {
+                ret = replay(program, engine, reference, done);
+            }
+            if (engine->release != NULL) {
+                engine->release(&tested->cpu);
+            }
+            side_destroy(tested);
+        }
+        side_destroy(reference);
+    }
+    free(reference);
+    free(tested);
+    return ret;
+}
+
+
+/*
+ * Write program to path.
+ */
+static void save(const struct program *program, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return;
+    }
+    for (size_t i = 0; i < program->size; i++) {
+        uint32_t word = (uint32_t) program->words[i];
+        const unsigned char bytes[4] = {
+            (unsigned char) word, (unsigned char) (word >> 8), (unsigned char) (word >> 16), (unsigned char) (word >> 24)
+        };
+        fwrite(bytes, 1, 4, file);
+    }
+    fclose(file);
+    printf("Program written to %s\n", path);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *onlyEngine = NULL;
+    const char *outputPath = NULL;
+    int onlyProfile = -1;
+    enum compareMode mode = COMPARE_BLOCK;
+    size_t interval = 0;
+    size_t programs = DEFAULT_PROGRAMS;
+    size_t steps = DEFAULT_STEPS;
+    uint64_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:p:c:n:l:s:o:")) != -1) {
+        switch (opt) {
+        case 'e':
+            onlyEngine = optarg;
+            break;
+        case 'p':
+            onlyProfile = 0;
+            while (onlyProfile < CPU_PROFILES && strcmp(optarg, cpuProfileName(onlyProfile)) != 0) {
+                onlyProfile++;
+            }
+            break;
+        case 'c':
+            mode = strcmp(optarg, "step") == 0 ? COMPARE_STEP : strcmp(optarg, "block") == 0 ? COMPARE_BLOCK :
+                   strcmp(optarg, "exit") == 0 ? COMPARE_EXIT : COMPARE_INTERVAL;
+            interval = mode == COMPARE_INTERVAL ? strtoul(optarg, NULL, 10) : 0;
+            break;
+        case 'n':
+            programs = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            steps = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            outputPath = optarg;
+            break;
+        default:
+            printf(invalidArgs);
+            return 1;
+        }
+    }
+    if (onlyProfile == CPU_PROFILES || (mode == COMPARE_INTERVAL && interval == 0) || steps == 0 ||
+            steps > INT32_MAX) {
+        printf(invalidArgs);
+        return 1;
+    }
+
+    size_t engineCount = sizeof(engines) / sizeof(engines[0]);
+    size_t tested = 0;
+    for (size_t e = 0; e < engineCount; e++) {
+        const struct engine *engine = &engines[e];
+        if (onlyEngine != NULL ? strcmp(onlyEngine, engine->name) != 0 : !engine->standard) {
+            continue;
+        }
+        tested++;
+        size_t count = optind < argc ? (size_t) (argc - optind) : programs;
+        size_t skipped = 0;
+        for (int profile = 0; profile < CPU_PROFILES; profile++) {
+            if (onlyProfile >= 0 && profile != onlyProfile) {
+                continue;
+            }
+            for (size_t i = 0; i < count; i++) {
+                struct program program;
+                if (optind < argc) {
+                    if (load(&program, argv[optind + i], profile) != 0) {
+                        return 1;
+                    }
+                } else {
+                    generate(&program, profile, seed + i);
+                }
+                int ret = compare(&program, engine, mode, interval, steps);
+                if (ret > 0) {
+                    if (outputPath != NULL) {
+                        save(&program, outputPath);
+                    }
+                    return 1;
+                }
+                skipped += ret < 0;
+            }
+        }
+        if (skipped > 0) {
+            printf("%-10s not available for %zu programs\n", engine->name, skipped);
+        } else {
+            printf("%-10s same as cpuStep\n", engine->name);
+        }
+    }
+    if (tested == 0) {
+        printf(invalidArgs);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,506 @@
+#include "history.h"
+#include "cpu.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Time travel for the cpu. Every "interval" steps the registers and the dirty
+ * part of the stack (up to stackHighWater) are saved to a checkpoint. Going
+ * back restores the nearest earlier checkpoint and replays instructions from
+ * it. Results of in/get are logged when they are executed for the first time
+ * and replayed from the log, output of replayed instructions is dropped.
+ * When checkpoints take more than the memory limit, every other one is freed
+ * and the interval is doubled, so the history of any run fits into the limit.
+ */
+
+#define HISTORY_INTERVAL 1024
+
+/*
+ * Registers of the cpu (without memory and input/output).
+ */
+struct snapshot
+{
+    int32_t A;
+    int32_t B;
+    int32_t C;
+    int32_t D;
+    enum cpuStatus status;
+    int32_t stackSize;
+    int32_t instructionPointer;
+    int32_t stackHighWater;
+    int32_t result;
+};
+
+struct checkpoint
+{
+    size_t step;
+    struct snapshot state;
+    int32_t *stack;         // stackHighWater slots, the deepest first
+};
+
+/*
+ * State after in/get instruction executed as step.
+ */
+struct inputRecord
+{
+    size_t step;
+    struct snapshot state;
+};
+
+struct history
+{
+    struct cpu *cpu;
+    size_t step;            // instructions executed to get to the current state
+    size_t frontier;        // steps executed so far, later steps are new
+    size_t interval;
+    size_t memoryLimit;
+    size_t memoryUsed;
+    struct checkpoint *checkpoints;
+    size_t checkpointCount;
+    size_t checkpointCapacity;
+    struct inputRecord *inputs;
+    size_t inputCount;
+    size_t inputCapacity;
+    int failed;             // input was not logged, history can not go back
+    char scratch[64];       // output of replayed instructions
+};
+
+
+static void snapshot_save(const struct cpu *cpu, struct snapshot *state)
+{
+    state->A = cpu->A;
+    state->B = cpu->B;
+    state->C = cpu->C;
+    state->D = cpu->D;
+    state->status = cpu->status;
+    state->stackSize = cpu->stackSize;
+    state->instructionPointer = cpu->instructionPointer;
+    state->stackHighWater = cpu->stackHighWater;
+    state->result = cpu->result;
+}
+
+
+/*
+ * Restore registers of the cpu, stack is left as it is.
+ */
+static void snapshot_restore(struct cpu *cpu, const struct snapshot *state)
+{
+    cpu->A = state->A;
+    cpu->B = state->B;
+    cpu->C = state->C;
+    cpu->D = state->D;
+    cpu->status = state->status;
+    cpu->stackSize = state->stackSize;
+    cpu->instructionPointer = state->instructionPointer;
+    cpu->result = state->result;
+}
+
+
+/*
+ * Free every other checkpoint (the first one is kept) and double the interval.
+ */
+static void checkpoints_thin(struct history *history)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < history->checkpointCount; i++) {
+        struct checkpoint *checkpoint = &history->checkpoints[i];
+        if (i % 2 == 0) {
+            history->checkpoints[kept++] = *checkpoint;
+        } else {
+            history->memoryUsed -= sizeof(struct checkpoint) + checkpoint->state.stackHighWater * sizeof(int32_t);
+            free(checkpoint->stack);
+        }
+    }
+    history->checkpointCount = kept;
+    history->interval *= 2;
+}
+
+
+/*
+ * Save current state of the cpu as a new checkpoint. Without memory the checkpoint
+ * is just skipped, replays get longer.
+ */
+static void checkpoint_add(struct history *history)
+{
+    struct cpu *cpu = history->cpu;
+    if (history->checkpointCount == history->checkpointCapacity) {
+        size_t capacity = history->checkpointCapacity == 0 ? 64 : 2 * history->checkpointCapacity;
+        struct checkpoint *checkpoints = realloc(history->checkpoints, capacity * sizeof(struct checkpoint));
+        if (checkpoints == NULL) {
+            return;
+        }
+        history->checkpoints = checkpoints;
+        history->checkpointCapacity = capacity;
+    }
+
+    size_t size = cpu->stackHighWater * sizeof(int32_t);
+    int32_t *stack = NULL;
+    if (size > 0) {
+        if ((stack = malloc(size)) == NULL) {
+            return;
+        }
+        memcpy(stack, &cpu->stackBottom[1 - cpu->stackHighWater], size);
+    }
+    struct checkpoint *checkpoint = &history->checkpoints[history->checkpointCount++];
+    checkpoint->step = history->step;
+    checkpoint->stack = stack;
+    snapshot_save(cpu, &checkpoint->state);
+
+    history->memoryUsed += sizeof(struct checkpoint) + size;
+    while (history->memoryUsed > history->memoryLimit && history->checkpointCount > 1) {
+        checkpoints_thin(history);
+    }
+}
+
+
+/*
+ * Move the cpu to the state of checkpoint.
+ */
+static void checkpoint_restore(struct history *history, const struct checkpoint *checkpoint)
+{
+    struct cpu *cpu = history->cpu;
+    int32_t highWater = checkpoint->state.stackHighWater;
+    memset(&cpu->stackBottom[1 - cpu->stackHighWater], 0, cpu->stackHighWater * sizeof(int32_t));
+    if (highWater > 0) {
+        memcpy(&cpu->stackBottom[1 - highWater], checkpoint->stack, highWater * sizeof(int32_t));
+    }
+    cpu->stackHighWater = highWater;
+    snapshot_restore(cpu, &checkpoint->state);
+    history->step = checkpoint->step;
+}
+
+
+/*
+ * Returns:
+ *      the last checkpoint with step <= step
+ */
+static const struct checkpoint *checkpoint_find(struct history *history, size_t step)
+{
+    size_t low = 0;
+    size_t high = history->checkpointCount;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (history->checkpoints[middle].step <= step) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return &history->checkpoints[low];
+}
+
+
+/*
+ * Returns:
+ *      logged in/get executed as step, NULL if there is none
+ */
+static const struct inputRecord *input_find(struct history *history, size_t step)
+{
+    size_t low = 0;
+    size_t high = history->inputCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (history->inputs[middle].step < step) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < history->inputCount && history->inputs[low].step == step) {
+        return &history->inputs[low];
+    }
+    return NULL;
+}
+
+
+/*
+ * Append state after in/get to the input log.
+ */
+static void input_log(struct history *history)
+{
+    if (history->inputCount == history->inputCapacity) {
+        size_t capacity = history->inputCapacity == 0 ? 64 : 2 * history->inputCapacity;
+        struct inputRecord *inputs = realloc(history->inputs, capacity * sizeof(struct inputRecord));
+        if (inputs == NULL) {
+            fprintf(stderr, "Allocation error!");
+            history->failed = 1;
+            return;
+        }
+        history->inputs = inputs;
+        history->inputCapacity = capacity;
+    }
+    struct inputRecord *record = &history->inputs[history->inputCount++];
+    record->step = history->step;
+    snapshot_save(history->cpu, &record->state);
+}
+
+
+/*
+ * Execute one instruction, new one by cpuStep, replayed in/get from the log.
+ */
+static void history_step(struct history *history)
+{
+    struct cpu *cpu = history->cpu;
+    int32_t ip = cpu->instructionPointer;
+    int input = ip >= 0 && ip <= cpu->stackLimit - cpu->memory &&
+                (cpu->memory[ip] == cpuOpIn || cpu->memory[ip] == cpuOpGet);
+
+    if (!input) {
+        cpuStep(cpu);
+    } else if (history->step < history->frontier) {
+        const struct inputRecord *record = input_find(history, history->step);
+        assert(record != NULL);
+        snapshot_restore(cpu, &record->state);
+    } else {
+        cpuStep(cpu);
+        input_log(history);
+    }
+
+    history->step++;
+    if (history->step > history->frontier) {
+        history->frontier = history->step;
+    }
+    const struct checkpoint *last = &history->checkpoints[history->checkpointCount - 1];
+    if (history->step > last->step && history->step - last->step >= history->interval) {
+        checkpoint_add(history);
+    }
+}
+
+
+/*
+ * Returns if the cpu is before an instruction trapped by cpuSetTraps.
+ */
+static int trapped(const struct cpu *cpu)
+{
+    int32_t ip = cpu->instructionPointer;
+    return cpu->traps != NULL && ip >= 0 && ip <= cpu->stackLimit - cpu->memory && cpu->traps[ip];
+}
+
+
+/*
+ * Execute at most steps new instructions by engine, in chunks ending at checkpoints.
+ *
+ * Returns:
+ *      number of executed instructions, 0 if the engine stopped before a trap
+ */
+static size_t engine_run(struct history *history, size_t steps, int (*engine)(struct cpu *, size_t))
+{
+    size_t last = history->checkpoints[history->checkpointCount - 1].step;
+    size_t elapsed = history->step - last;
+    size_t chunk = elapsed < history->interval ? history->interval - elapsed : 1;
+    if (chunk > steps) {
+        chunk = steps;
+    }
+    int done = engine(history->cpu, chunk);
+    size_t count = done < 0 ? (size_t) -done : (size_t) done;
+
+    history->step += count;
+    if (history->step > history->frontier) {
+        history->frontier = history->step;
+    }
+    if (history->step - last >= history->interval) {
+        checkpoint_add(history);
+    }
+    return count;
+}
+
+
+/*
+ * Execute instructions until step (or until the cpu stops). Output of already
+ * executed instructions is not written again. With engine new instructions are
+ * run by it and both new and replayed ones stop before traps.
+ *
+ * Args:
+ *      history - history of the cpu
+ *      step - step to get to
+ *      reg - register to watch (as in cpuPeek), 0 for none
+ *      engine - engine for new instructions, NULL to execute them one by one
+ *
+ * Returns:
+ *      the last step which changed reg, 0 if there was none
+ */
+static size_t history_run(struct history *history, size_t step, char reg, int (*engine)(struct cpu *, size_t))
+{
+    struct cpu *cpu = history->cpu;
+    size_t changed = 0;
+
+    if (history->step < history->frontier && history->step < step) {
+        FILE *stream = cpu->output.stream;
+        cpuSetOutputBuffer(cpu, history->scratch, sizeof(history->scratch));
+        while (history->step < step && history->step < history->frontier && cpu->status == cpuOK &&
+                (engine == NULL || !trapped(cpu))) {
+            int32_t value = cpuPeek(cpu, reg);
+            history_step(history);
+            cpu->output.used = 0;
+            if (cpuPeek(cpu, reg) != value) {
+                changed = history->step;
+            }
+        }
+        cpuSetOutput(cpu, stream);
+    }
+    while (history->step < step && cpu->status == cpuOK) {
+        if (engine != NULL) {
+            if (trapped(cpu) || engine_run(history, step - history->step, engine) == 0) {
+                break;
+            }
+            continue;
+        }
+        int32_t value = cpuPeek(cpu, reg);
+        history_step(history);
+        if (cpuPeek(cpu, reg) != value) {
+            changed = history->step;
+        }
+    }
+    cpuFlush(cpu);
+    return changed;
+}
+
+
+/*
+ * Start recording history of the cpu, its current state is step 0.
+ *
+ * Args:
+ *      cpu - emulated cpu structure, output has to go to a stream
+ *      memoryLimit - limit of memory for checkpoints (log of inputs is not limited)
+ *
+ * Returns:
+ *      new history, NULL on allocation error
+ */
+struct history *historyCreate(struct cpu *cpu, size_t memoryLimit)
+{
+    assert(cpu != NULL);
+    assert(cpu->output.stream != NULL);
+
+    struct history *history = calloc(1, sizeof(struct history));
+    if (history == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return NULL;
+    }
+    history->cpu = cpu;
+    history->interval = HISTORY_INTERVAL;
+    history->memoryLimit = memoryLimit;
+    checkpoint_add(history);
+    if (history->checkpointCount == 0) {
+        fprintf(stderr, "Allocation error!");
+        free(history->checkpoints);
+        free(history);
+        return NULL;
+    }
+    return history;
+}
+
+
+void historyDestroy(struct history *history)
+{
+    if (history == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < history->checkpointCount; i++) {
+        free(history->checkpoints[i].stack);
+    }
+    free(history->checkpoints);
+    free(history->inputs);
+    free(history);
+}
+
+
+size_t historyPosition(struct history *history)
+{
+    assert(history != NULL);
+    return history->step;
+}
+
+
+/*
+ * Execute the next instruction (replayed if the history was moved back).
+ *
+ * Returns:
+ *      0 if the cpu stopped (halt or error), nonzero otherwise
+ */
+int historyStep(struct history *history)
+{
+    assert(history != NULL);
+
+    if (history->cpu->status != cpuOK) {
+        return 0;
+    }
+    history_run(history, history->step + 1, 0, NULL);
+    return history->cpu->status == cpuOK;
+}
+
+
+/*
+ * Execute at most steps instructions, new ones by engine (of decoded program, as
+ * cpuRunThreaded). Stops before instructions trapped by cpuSetTraps, which have to be
+ * executed by historyStep. In and get have to be trapped, so their input is logged.
+ *
+ * Returns:
+ *      number of executed instructions
+ */
+size_t historyRun(struct history *history, size_t steps, int (*engine)(struct cpu *, size_t))
+{
+    assert(history != NULL);
+    assert(engine != NULL);
+
+    size_t start = history->step;
+    if (history->cpu->status == cpuOK) {
+        history_run(history, steps < SIZE_MAX - start ? start + steps : SIZE_MAX, 0, engine);
+    }
+    return history->step - start;
+}
+
+
+/*
+ * Move the cpu to the state after step instructions. Going back restores
+ * the nearest checkpoint and replays instructions from it.
+ *
+ * Returns:
+ *      1 if the cpu got to step, 0 if it stopped earlier (or history was lost)
+ */
+int historyGoto(struct history *history, size_t step)
+{
+    assert(history != NULL);
+
+    if (step < history->step) {
+        if (history->failed) {
+            return 0;
+        }
+        checkpoint_restore(history, checkpoint_find(history, step));
+    }
+    history_run(history, step, 0, NULL);
+    return history->step == step;
+}
+
+
+/*
+ * Find the last step before the current one which changed register reg
+ * ('A', 'B', 'C', 'D', 'S' or 'I' as in cpuPeek). Intervals between checkpoints
+ * are replayed from the current one backwards until the change is found.
+ *
+ * Returns:
+ *      1 if the cpu was moved after the change, 0 if there was none (cpu is moved to step 0)
+ */
+int historyReverseContinue(struct history *history, char reg)
+{
+    assert(history != NULL);
+
+    if (history->failed) {
+        return 0;
+    }
+    size_t end = history->step;
+    while (end > 0) {
+        const struct checkpoint *checkpoint = checkpoint_find(history, end - 1);
+        size_t start = checkpoint->step;
+        checkpoint_restore(history, checkpoint);
+        size_t changed = history_run(history, end, reg, NULL);
+        if (changed != 0) {
+            return historyGoto(history, changed);
+        }
+        end = start;
+    }
+    historyGoto(history, 0);
+    return 0;
+}
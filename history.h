@@ -0,0 +1,50 @@
+#include "cpu.h"
+#include <stdio.h>
+
+
+/* Execution history of a cpu with stepping backwards */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+struct history;
+
+/*
+ * Start recording history of the cpu (output has to go to a stream), checkpoints take
+ * at most about memoryLimit bytes. Returns NULL on allocation error.
+ */
+struct history *historyCreate(struct cpu *cpu, size_t memoryLimit);
+
+/*
+ * Free the history, the cpu stays in its current state.
+ */
+void historyDestroy(struct history *history);
+
+/*
+ * Returns number of instructions executed to get to the current state.
+ */
+size_t historyPosition(struct history *history);
+
+/*
+ * Same as cpuStep, but the step is recorded.
+ */
+int historyStep(struct history *history);
+
+/*
+ * Execute at most steps instructions by engine at its full speed, stops before instructions
+ * trapped by cpuSetTraps (in and get have to be trapped). Returns number of executed instructions.
+ */
+size_t historyRun(struct history *history, size_t steps, int (*engine)(struct cpu *, size_t));
+
+/*
+ * Move cpu to the state after step instructions (backwards or forwards),
+ * returns 1 if it got there, 0 if the program stopped earlier.
+ */
+int historyGoto(struct history *history, size_t step);
+
+/*
+ * Move cpu back to the last step which changed register reg (as in cpuPeek),
+ * returns 0 and moves to the start if there is none.
+ */
+int historyReverseContinue(struct history *history, char reg);
+
+#endif
@@ -0,0 +1,807 @@
+/* MAP_ANONYMOUS is not part of POSIX */
+#define _DEFAULT_SOURCE
+#include "cpu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+/*
+ * Basic block JIT for x86-64. Blocks of pre-decoded instructions (see cpuDecode)
+ * are translated to native code into an executable buffer and chained directly.
+ * Registers A-D live in r8d-r11d, stack size in ebx, remaining steps in rsi.
+ * The buffer is never writable and executable at once, it is switched to
+ * read-write while a block is compiled (and earlier jumps patched to it).
+ *
+ * Native code never changes cpu status. Whenever an instruction would fail, or
+ * it is not supported (I/O, halt, undecodable), the code exits with exact state
+ * stored in the cpu structure and the instruction is executed by cpuStep.
+ */
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+#ifndef JIT_BUFFER_SIZE
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+#endif
+#define JIT_BLOCK_MAX 64
+#define JIT_BLOCK_SPACE (JIT_BLOCK_MAX * 96 + 256)
+
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum
+{
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_LE = 0xe, CC_G = 0xf
+};
+
+/* Host register of emulated register A-D */
+#define HOST_REG(reg) (R8 + (reg))
+
+/*
+ * Block state by instruction pointer.
+ */
+enum
+{
+    blockNone,
+    blockCompiled,
+    blockUncompilable
+};
+
+/*
+ * Jump which should be redirected to block at "target" once it is compiled.
+ */
+struct jitPatch
+{
+    size_t site;
+    int32_t next;
+};
+
+/*
+ * Side exit of currently compiled block.
+ */
+struct jitExit
+{
+    size_t site;
+    int32_t ip;
+    int32_t refund;
+};
+
+/*
+ * Values loaded to host registers when native code is entered. Layout is used by the entry code.
+ */
+struct jitContext
+{
+    int32_t *stackBottom;
+    int64_t capacity;
+    uint8_t **blocks;
+    int64_t size;
+};
+
+struct cpuJit
+{
+    uint8_t *buffer;
+    size_t used;
+    size_t exitCommon;
+    size_t dispatchEcx;
+    size_t firstBlock;
+    struct jitContext context;
+    uint8_t *state;
+    int32_t *pending;
+    struct jitPatch *patches;
+    size_t patchCount;
+    size_t patchCapacity;
+    struct jitExit exits[2 * JIT_BLOCK_MAX + 4];
+    int exitCount;
+    enum cpuProfile profile;
+    int disabled;               // buffer could not be made executable again, code is not run
+};
+
+
+/*
+ *******************
+ * x86-64 ENCODER
+ *******************
+ */
+
+
+static void emit8(struct cpuJit *jit, int byte)
+{
+    jit->buffer[jit->used++] = (uint8_t) byte;
+}
+
+
+static void emit32(struct cpuJit *jit, int32_t value)
+{
+    memcpy(&jit->buffer[jit->used], &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+
+static void emit_rex(struct cpuJit *jit, int w, int reg, int index, int base)
+{
+    int rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+    if (rex != 0x40) {
+        emit8(jit, rex);
+    }
+}
+
+
+static void emit_modrm(struct cpuJit *jit, int mod, int reg, int rm)
+{
+    emit8(jit, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/*
+ * Opcode with register-direct operands, "reg" in ModRM.reg and "rm" in ModRM.rm.
+ */
+static void emit_op_rr(struct cpuJit *jit, int w, int opcode, int reg, int rm)
+{
+    emit_rex(jit, w, reg, 0, rm);
+    if (opcode > 0xff) {
+        emit8(jit, opcode >> 8);
+    }
+    emit8(jit, opcode & 0xff);
+    emit_modrm(jit, 3, reg, rm);
+}
+
+
+/*
+ * Opcode with memory operand [base + index * 4 + disp], index -1 means none.
+ */
+static void emit_op_mem(struct cpuJit *jit, int w, int opcode, int reg, int base, int index, int32_t disp)
+{
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    }
+
+    emit_rex(jit, w, reg, index < 0 ? 0 : index, base);
+    emit8(jit, opcode);
+    if (index < 0 && (base & 7) != RSP) {
+        emit_modrm(jit, mod, reg, base);
+    } else {
+        emit_modrm(jit, mod, reg, RSP);
+        emit8(jit, ((index < 0 ? 0 : 2) << 6) | (((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+    }
+    if (mod == 1) {
+        emit8(jit, disp);
+    } else if (mod == 2) {
+        emit32(jit, disp);
+    }
+}
+
+
+/*
+ * ALU operation with immediate, "ext" selects operation (0 add, 5 sub, 7 cmp).
+ */
+static void emit_alu_ri(struct cpuJit *jit, int w, int ext, int reg, int32_t imm)
+{
+    emit_rex(jit, w, 0, 0, reg);
+    if (imm >= -128 && imm <= 127) {
+        emit8(jit, 0x83);
+        emit_modrm(jit, 3, ext, reg);
+        emit8(jit, imm);
+    } else {
+        emit8(jit, 0x81);
+        emit_modrm(jit, 3, ext, reg);
+        emit32(jit, imm);
+    }
+}
+
+
+static void emit_mov_ri(struct cpuJit *jit, int reg, int32_t imm)
+{
+    emit_rex(jit, 0, 0, 0, reg);
+    emit8(jit, 0xb8 + (reg & 7));
+    emit32(jit, imm);
+}
+
+
+static void emit_push(struct cpuJit *jit, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg);
+    emit8(jit, 0x50 + (reg & 7));
+}
+
+
+static void emit_pop(struct cpuJit *jit, int reg)
+{
+    emit_rex(jit, 0, 0, 0, reg);
+    emit8(jit, 0x58 + (reg & 7));
+}
+
+
+/*
+ * Emit update of cpu->stackHighWater after the stack grew (stack size in ebx).
+ */
+static void emit_high_water(struct cpuJit *jit)
+{
+    emit_op_mem(jit, 0, 0x39, RBX, RDI, -1, offsetof(struct cpu, stackHighWater));    /* cmp [rdi + off], ebx */
+    emit8(jit, 0x7d);                                                                   /* jge skip */
+    emit8(jit, 0);
+    size_t site = jit->used;
+    emit_op_mem(jit, 0, 0x89, RBX, RDI, -1, offsetof(struct cpu, stackHighWater));
+    jit->buffer[site - 1] = (uint8_t) (jit->used - site);
+}
+
+
+/*
+ * Emit jcc rel32 (cc < 0 means jmp rel32) and return offset of rel32 for patching.
+ */
+static size_t emit_jump(struct cpuJit *jit, int cc)
+{
+    if (cc < 0) {
+        emit8(jit, 0xe9);
+    } else {
+        emit8(jit, 0x0f);
+        emit8(jit, 0x80 + cc);
+    }
+    emit32(jit, 0);
+    return jit->used - 4;
+}
+
+
+static void patch_jump(struct cpuJit *jit, size_t site, size_t target)
+{
+    int32_t rel = (int32_t) ((int64_t) target - (int64_t) (site + 4));
+    memcpy(&jit->buffer[site], &rel, sizeof(rel));
+}
+
+
+/*
+ *******************
+ * BLOCK COMPILER
+ *******************
+ */
+
+
+static void add_exit(struct cpuJit *jit, size_t site, int32_t ip, int32_t refund)
+{
+    jit->exits[jit->exitCount].site = site;
+    jit->exits[jit->exitCount].ip = ip;
+    jit->exits[jit->exitCount].refund = refund;
+    jit->exitCount++;
+}
+
+
+/*
+ * Load index of stack slot relative to stack bottom (top of stack + reg D + offset)
+ * to rax, jump to side exit if it is outside of the stack.
+ */
+static void emit_stack_slot(struct cpuJit *jit, int32_t offset, int32_t ip, int32_t refund)
+{
+    emit_op_rr(jit, 1, 0x63, RAX, HOST_REG(3));       /* movsxd rax, r11d */
+    emit_alu_ri(jit, 1, 0, RAX, offset);              /* add rax, offset */
+    emit_alu_ri(jit, 1, 0, RAX, 1);                   /* add rax, 1 */
+    emit_op_rr(jit, 1, 0x85, RAX, RAX);               /* test rax, rax */
+    add_exit(jit, emit_jump(jit, CC_LE), ip, refund);
+    emit_op_rr(jit, 1, 0x39, RBX, RAX);               /* cmp rax, rbx */
+    add_exit(jit, emit_jump(jit, CC_G), ip, refund);
+    emit_op_rr(jit, 1, 0x29, RBX, RAX);               /* sub rax, rbx */
+}
+
+
+/*
+ * Emit jump to block on "target" (or exit to interpreter if it is not compiled).
+ */
+static void emit_jump_to(struct cpuJit *jit, int cc, int32_t target)
+{
+    size_t site = emit_jump(jit, cc);
+    if (target < 0 || target >= jit->context.size || jit->state[target] == blockUncompilable) {
+        add_exit(jit, site, target, 0);
+        return;
+    }
+    if (jit->state[target] == blockCompiled) {
+        patch_jump(jit, site, jit->context.blocks[target] - jit->buffer);
+        return;
+    }
+
+    /* Not compiled yet, exit for now and chain the jump once target gets compiled */
+    add_exit(jit, site, target, 0);
+    if (jit->patchCount == jit->patchCapacity) {
+        size_t capacity = jit->patchCapacity ? 2 * jit->patchCapacity : 1024;
+        struct jitPatch *patches = realloc(jit->patches, capacity * sizeof(struct jitPatch));
+        if (patches == NULL) {
+            return;
+        }
+        jit->patches = patches;
+        jit->patchCapacity = capacity;
+    }
+    jit->patches[jit->patchCount].site = site;
+    jit->patches[jit->patchCount].next = jit->pending[target];
+    jit->pending[target] = jit->patchCount++;
+}
+
+
+/*
+ * Returns if instruction can be part of a native block.
+ */
+static int supported(const struct cpuInstruction *inst)
+{
+    switch (inst->op) {
+    case cpuOpHalt:
+    case cpuOpIn:
+    case cpuOpGet:
+    case cpuOpOut:
+    case cpuOpPut:
+    case cpuOpTrap:
+    case cpuOpSlow:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+
+/*
+ * Returns if instruction ends basic block.
+ */
+static int ends_block(const struct cpuInstruction *inst)
+{
+    switch (inst->op) {
+    case cpuOpLoop:
+    case cpuOpJmp:
+    case cpuOpJz:
+    case cpuOpJnz:
+    case cpuOpJgt:
+    case cpuOpCall:
+    case cpuOpRet:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Translate one instruction, "k" is its position in the block of "n" instructions.
+ */
+static void compile_instruction(struct cpuJit *jit, const struct cpuInstruction *inst, int32_t ip, int k, int n)
+{
+    int reg = HOST_REG(inst->reg);
+    int32_t refund = n - k;
+
+    switch (inst->op) {
+    case cpuOpNop:
+        break;
+    case cpuOpAdd:
+        emit_op_rr(jit, 0, 0x01, reg, R8);
+        break;
+    case cpuOpSub:
+        emit_op_rr(jit, 0, 0x29, reg, R8);
+        break;
+    case cpuOpMul:
+        emit_op_rr(jit, 0, 0x0faf, R8, reg);
+        break;
+    case cpuOpDiv:
+        /* Zero and -1 (overflow trap) divisors are left to the interpreter */
+        emit_op_rr(jit, 0, 0x85, reg, reg);
+        add_exit(jit, emit_jump(jit, CC_E), ip, refund);
+        emit_alu_ri(jit, 0, 7, reg, -1);
+        add_exit(jit, emit_jump(jit, CC_E), ip, refund);
+        emit_op_rr(jit, 0, 0x89, R8, RAX);            /* mov eax, r8d */
+        emit8(jit, 0x99);                             /* cdq */
+        emit_op_rr(jit, 0, 0xf7, 7, reg);             /* idiv reg */
+        emit_op_rr(jit, 0, 0x89, RAX, R8);            /* mov r8d, eax */
+        break;
+    case cpuOpInc:
+        emit_alu_ri(jit, 0, 0, reg, 1);
+        break;
+    case cpuOpDec:
+        emit_alu_ri(jit, 0, 5, reg, 1);
+        break;
+    case cpuOpMovr:
+        emit_mov_ri(jit, reg, inst->arg);
+        break;
+    case cpuOpLoad:
+        emit_stack_slot(jit, inst->arg, ip, refund);
+        emit_op_mem(jit, 0, 0x8b, reg, R13, RAX, 0);
+        break;
+    case cpuOpStore:
+        emit_stack_slot(jit, inst->arg, ip, refund);
+        emit_op_mem(jit, 0, 0x89, reg, R13, RAX, 0);
+        break;
+    case cpuOpSwap:
+        if (inst->reg != inst->arg) {
+            emit_op_rr(jit, 0, 0x87, reg, HOST_REG(inst->arg));
+        }
+        break;
+    case cpuOpPush:
+        emit_op_rr(jit, 1, 0x39, R14, RBX);           /* cmp rbx, r14 */
+        add_exit(jit, emit_jump(jit, CC_AE), ip, refund);
+        emit_op_rr(jit, 1, 0x89, RBX, RAX);           /* mov rax, rbx */
+        emit_op_rr(jit, 1, 0xf7, 3, RAX);             /* neg rax */
+        emit_op_mem(jit, 0, 0x89, reg, R13, RAX, 0);
+        emit_alu_ri(jit, 0, 0, RBX, 1);
+        emit_high_water(jit);
+        break;
+    case cpuOpPop:
+        emit_op_rr(jit, 0, 0x85, RBX, RBX);
+        add_exit(jit, emit_jump(jit, CC_E), ip, refund);
+        emit_op_rr(jit, 1, 0x89, RBX, RAX);
+        emit_op_rr(jit, 1, 0xf7, 3, RAX);
+        emit_op_mem(jit, 0, 0x8b, reg, R13, RAX, 4);
+        emit_alu_ri(jit, 0, 5, RBX, 1);
+        break;
+    case cpuOpCmp:
+        emit_op_rr(jit, 0, 0x89, reg, R12);
+        emit_op_rr(jit, 0, 0x29, HOST_REG(inst->arg), R12);
+        break;
+    case cpuOpJmp:
+        emit_jump_to(jit, -1, inst->arg);
+        return;
+    case cpuOpJz:
+    case cpuOpJnz:
+    case cpuOpJgt:
+        emit_op_rr(jit, 0, 0x85, R12, R12);
+        emit_jump_to(jit, inst->op == cpuOpJz ? CC_E : inst->op == cpuOpJnz ? CC_NE : CC_G, inst->arg);
+        emit_jump_to(jit, -1, ip + 2);
+        return;
+    case cpuOpCall:
+        emit_op_rr(jit, 1, 0x39, R14, RBX);
+        add_exit(jit, emit_jump(jit, CC_AE), ip, refund);
+        emit_op_rr(jit, 1, 0x89, RBX, RAX);
+        emit_op_rr(jit, 1, 0xf7, 3, RAX);
+        emit_op_mem(jit, 0, 0xc7, 0, R13, RAX, 0);    /* mov dword [r13 + rax * 4], ip + 2 */
+        emit32(jit, ip + 2);
+        emit_alu_ri(jit, 0, 0, RBX, 1);
+        emit_high_water(jit);
+        emit_jump_to(jit, -1, inst->arg);
+        return;
+    case cpuOpRet:
+        emit_op_rr(jit, 0, 0x85, RBX, RBX);
+        add_exit(jit, emit_jump(jit, CC_E), ip, refund);
+        emit_op_rr(jit, 1, 0x89, RBX, RAX);
+        emit_op_rr(jit, 1, 0xf7, 3, RAX);
+        emit_op_mem(jit, 0, 0x8b, RCX, R13, RAX, 4);
+        emit_op_mem(jit, 0, 0xc7, 0, R13, RAX, 4);
+        emit32(jit, 0);
+        emit_alu_ri(jit, 0, 5, RBX, 1);
+        patch_jump(jit, emit_jump(jit, -1), jit->dispatchEcx);
+        return;
+    case cpuOpLoop:
+        emit_op_rr(jit, 0, 0x85, R10, R10);
+        emit_jump_to(jit, CC_NE, inst->arg);
+        emit_jump_to(jit, -1, ip + 2);
+        return;
+    default:
+        assert(0);
+    }
+
+    /* Result register is not used without bonus instructions */
+    if (jit->profile < cpuProfileJmp) {
+        return;
+    }
+    switch (inst->op) {
+    case cpuOpAdd:
+    case cpuOpSub:
+    case cpuOpMul:
+    case cpuOpDiv:
+        emit_op_rr(jit, 0, 0x89, R8, R12);
+        break;
+    case cpuOpInc:
+    case cpuOpDec:
+        emit_op_rr(jit, 0, 0x89, reg, R12);
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*
+ * Emit code which enters and leaves native code:
+ *      int64_t enter(struct cpu *cpu, int64_t steps, uint8_t *block, struct jitContext *context)
+ * returns number of steps left.
+ */
+static void compile_entry(struct cpuJit *jit)
+{
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+    static const size_t reg_offsets[] = {
+        offsetof(struct cpu, A), offsetof(struct cpu, B), offsetof(struct cpu, C), offsetof(struct cpu, D)
+    };
+
+    for (int i = 0; i < 6; i++) {
+        emit_push(jit, saved[i]);
+    }
+    emit_op_mem(jit, 1, 0x8b, R13, RCX, -1, offsetof(struct jitContext, stackBottom));
+    emit_op_mem(jit, 1, 0x8b, R14, RCX, -1, offsetof(struct jitContext, capacity));
+    emit_op_mem(jit, 1, 0x8b, R15, RCX, -1, offsetof(struct jitContext, blocks));
+    emit_op_mem(jit, 1, 0x8b, RBP, RCX, -1, offsetof(struct jitContext, size));
+    for (int i = 0; i < 4; i++) {
+        emit_op_mem(jit, 0, 0x8b, HOST_REG(i), RDI, -1, reg_offsets[i]);
+    }
+    emit_op_mem(jit, 0, 0x8b, R12, RDI, -1, offsetof(struct cpu, result));
+    emit_op_mem(jit, 0, 0x8b, RBX, RDI, -1, offsetof(struct cpu, stackSize));
+    emit_op_rr(jit, 0, 0xff, 4, RDX);                 /* jmp rdx */
+
+    /* Common exit, eax holds instruction pointer */
+    jit->exitCommon = jit->used;
+    for (int i = 0; i < 4; i++) {
+        emit_op_mem(jit, 0, 0x89, HOST_REG(i), RDI, -1, reg_offsets[i]);
+    }
+    emit_op_mem(jit, 0, 0x89, R12, RDI, -1, offsetof(struct cpu, result));
+    emit_op_mem(jit, 0, 0x89, RBX, RDI, -1, offsetof(struct cpu, stackSize));
+    emit_op_mem(jit, 0, 0x89, RAX, RDI, -1, offsetof(struct cpu, instructionPointer));
+    emit_op_rr(jit, 1, 0x89, RSI, RAX);               /* mov rax, rsi */
+    for (int i = 5; i >= 0; i--) {
+        emit_pop(jit, saved[i]);
+    }
+    emit8(jit, 0xc3);
+
+    /* Jump to block on instruction pointer in ecx, or exit if it is not compiled */
+    jit->dispatchEcx = jit->used;
+    emit_op_rr(jit, 1, 0x39, RBP, RCX);               /* cmp rcx, rbp */
+    size_t out_of_range = emit_jump(jit, CC_AE);
+    emit_op_mem(jit, 1, 0x8b, RAX, R15, RCX, 0);      /* mov rax, [r15 + rcx * 8] */
+    jit->buffer[jit->used - 1] |= 0x40;               /* scale 4 -> 8 */
+    emit_op_rr(jit, 1, 0x85, RAX, RAX);
+    size_t not_compiled = emit_jump(jit, CC_E);
+    emit_op_rr(jit, 0, 0xff, 4, RAX);                 /* jmp rax */
+    patch_jump(jit, out_of_range, jit->used);
+    patch_jump(jit, not_compiled, jit->used);
+    emit_op_rr(jit, 0, 0x89, RCX, RAX);               /* mov eax, ecx */
+    patch_jump(jit, emit_jump(jit, -1), jit->exitCommon);
+
+    jit->firstBlock = jit->used;
+}
+
+
+/*
+ * Drop all compiled blocks.
+ */
+static void flush(struct cpuJit *jit)
+{
+    int32_t size = jit->context.size;
+    jit->used = jit->firstBlock;
+    jit->patchCount = 0;
+    memset(jit->state, blockNone, size);
+    for (int32_t ip = 0; ip < size; ip++) {
+        jit->context.blocks[ip] = NULL;
+        jit->pending[ip] = -1;
+    }
+}
+
+
+/*
+ * Translate basic block starting on "start".
+ *
+ * Returns:
+ *      native code of the block, NULL if the first instruction is not supported
+ */
+static uint8_t *compile_block(struct cpu *cpu, struct cpuJit *jit, int32_t start)
+{
+    const struct cpuInstruction *decoded = cpu->decoded;
+    int32_t size = jit->context.size;
+
+    if (!supported(&decoded[start])) {
+        jit->state[start] = blockUncompilable;
+        return NULL;
+    }
+    if (JIT_BUFFER_SIZE - jit->used < JIT_BLOCK_SPACE) {
+        flush(jit);
+    }
+
+    int n = 0;
+    int32_t ip = start;
+    while (n < JIT_BLOCK_MAX && ip < size && supported(&decoded[ip])) {
+        n++;
+        if (ends_block(&decoded[ip])) {
+            break;
+        }
+        ip += decoded[ip].length;
+    }
+
+    uint8_t *code = &jit->buffer[jit->used];
+    jit->state[start] = blockCompiled;
+    jit->context.blocks[start] = code;
+    for (int32_t i = jit->pending[start]; i >= 0; i = jit->patches[i].next) {
+        patch_jump(jit, jit->patches[i].site, jit->used);
+    }
+    jit->pending[start] = -1;
+
+    /* Exit at the start of the block if there are not enough steps for whole block */
+    jit->exitCount = 0;
+    emit_alu_ri(jit, 1, 7, RSI, n);
+    add_exit(jit, emit_jump(jit, CC_L), start, 0);
+    emit_alu_ri(jit, 1, 5, RSI, n);
+
+    int32_t last = start;
+    ip = start;
+    for (int k = 0; k < n; k++) {
+        compile_instruction(jit, &decoded[ip], ip, k, n);
+        last = ip;
+        ip += decoded[ip].length;
+    }
+    if (!ends_block(&decoded[last])) {
+        emit_jump_to(jit, -1, ip);
+    }
+
+    for (int i = 0; i < jit->exitCount; i++) {
+        patch_jump(jit, jit->exits[i].site, jit->used);
+        if (jit->exits[i].refund) {
+            emit_alu_ri(jit, 1, 0, RSI, jit->exits[i].refund);
+        }
+        emit_mov_ri(jit, RAX, jit->exits[i].ip);
+        patch_jump(jit, emit_jump(jit, -1), jit->exitCommon);
+    }
+    return code;
+}
+
+
+/*
+ * Translate basic block starting on "start" with the buffer writable for a while.
+ *
+ * Returns:
+ *      native code of the block, NULL if it is not compiled
+ */
+static uint8_t *compile(struct cpu *cpu, struct cpuJit *jit, int32_t start)
+{
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+    uint8_t *code = compile_block(cpu, jit, start);
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        jit->disabled = 1;
+        return NULL;
+    }
+    return code;
+}
+
+
+/*
+ * Prepare JIT for the cpu, cpu instructions have to be decoded by cpuDecode.
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise (including platforms without JIT support)
+ */
+int cpuJitCreate(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+
+    struct cpuJit *jit = calloc(1, sizeof(struct cpuJit));
+    if (jit == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+    int32_t size = cpu->decodedSize;
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->state = malloc(size);
+    jit->pending = malloc(size * sizeof(int32_t));
+    jit->context.blocks = malloc(size * sizeof(uint8_t *));
+    if (jit->buffer == MAP_FAILED || jit->state == NULL || jit->pending == NULL || jit->context.blocks == NULL) {
+        if (jit->buffer != MAP_FAILED) {
+            munmap(jit->buffer, JIT_BUFFER_SIZE);
+        }
+        free(jit->state);
+        free(jit->pending);
+        free(jit->context.blocks);
+        free(jit);
+        return 1;
+    }
+    jit->context.stackBottom = cpu->stackBottom;
+    jit->context.capacity = cpu->stackBottom - cpu->stackLimit;
+    jit->context.size = size;
+    jit->profile = cpu->profile;
+
+    compile_entry(jit);
+    flush(jit);
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit->state);
+        free(jit->pending);
+        free(jit->context.blocks);
+        free(jit);
+        return 1;
+    }
+    cpuJitDestroy(cpu);
+    cpu->jit = jit;
+    return 0;
+}
+
+
+/*
+ * Free JIT of the cpu.
+ */
+void cpuJitDestroy(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    struct cpuJit *jit = cpu->jit;
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit->state);
+    free(jit->pending);
+    free(jit->context.blocks);
+    free(jit->patches);
+    free(jit);
+    cpu->jit = NULL;
+}
+
+
+/*
+ * Same as cpuRun, but executes compiled native code where possible.
+ * Instructions which are not compiled are executed by cpuStep.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions
+ */
+int cpuRunJit(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(cpu->jit != NULL);
+
+    struct cpuJit *jit = cpu->jit;
+    int64_t (*enter)(struct cpu *, int64_t, uint8_t *, struct jitContext *);
+    uint8_t *entry = jit->buffer;
+    memcpy(&enter, &entry, sizeof(enter));
+
+    size_t i = 0;
+    if (steps <= 0) {
+        return 0;
+    }
+    while (i < steps) {
+        int32_t ip = cpu->instructionPointer;
+        if (cpu->status == cpuOK && !jit->disabled && ip >= 0 && ip < jit->context.size &&
+                jit->state[ip] != blockUncompilable) {
+            uint8_t *code = jit->state[ip] == blockCompiled ? jit->context.blocks[ip] : compile(cpu, jit, ip);
+            if (code != NULL) {
+                int64_t budget = steps - i > INT64_MAX ? INT64_MAX : (int64_t) (steps - i);
+                int64_t left = enter(cpu, budget, code, &jit->context);
+                if (left != budget) {
+                    i += budget - left;
+                    continue;
+                }
+            }
+        }
+        cpuStep(cpu);
+        i++;
+        if (cpu->status == cpuHalted) {
+            break;
+        }
+        if (cpu->status != cpuOK) {
+            i = -i;
+            break;
+        }
+    }
+    cpuFlush(cpu);
+    return i;
+}
+
+#else
+
+int cpuJitCreate(struct cpu *cpu)
+{
+    (void) cpu;
+    return 1;
+}
+
+
+void cpuJitDestroy(struct cpu *cpu)
+{
+    (void) cpu;
+}
+
+
+int cpuRunJit(struct cpu *cpu, size_t steps)
+{
+    return cpuRun(cpu, steps);
+}
+
+#endif
@@ -0,0 +1,554 @@
+#include "cpu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+
+/*
+ * Lockstep engine. Runs many cpus (lanes) with the same program at once.
+ * Registers, result, stack size and instruction pointer of all lanes are
+ * held in arrays (structure of arrays). Lanes with the lowest instruction
+ * pointer form a group which executes straight-line code together, masked
+ * arithmetic is done by SSE2 (or AVX2 when the cpu supports it, chosen at run
+ * time unless the build targets AVX2 already). The group is formed again
+ * after every jump (lanes which diverged on loop/jz/... wait for the others)
+ * and after any lane faulted. Stack operations, div and I/O are done lane
+ * by lane, I/O and instructions which could not be decoded by cpuStep.
+ */
+
+/* Branch conditions of branch kernels */
+enum lane_condition
+{
+    laneNonZero,
+    laneZero,
+    lanePositive,
+    laneAlways,
+};
+
+struct lanes
+{
+    size_t count;
+    int32_t *regs[4];
+    int32_t *result;
+    int32_t *stackSize;
+    int32_t *ip;
+    int32_t *status;
+    int32_t *mask;          // -1 if lane is in the running group, 0 otherwise
+    int32_t *scratch;
+    size_t *steps;
+    unsigned char *running;
+    int32_t *block;
+};
+
+
+/*
+ * Allocate arrays for count lanes.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+static int lanes_create(struct lanes *lanes, size_t count)
+{
+    const size_t arrays = 10;
+    lanes->count = count;
+    lanes->block = malloc(count * arrays * sizeof(int32_t));
+    lanes->steps = malloc(count * sizeof(size_t));
+    lanes->running = malloc(count);
+    if (lanes->block == NULL || lanes->steps == NULL || lanes->running == NULL) {
+        free(lanes->block);
+        free(lanes->steps);
+        free(lanes->running);
+        return 1;
+    }
+    int32_t *array = lanes->block;
+    for (int r = 0; r < 4; r++, array += count) {
+        lanes->regs[r] = array;
+    }
+    lanes->result = array;
+    lanes->stackSize = array += count;
+    lanes->ip = array += count;
+    lanes->status = array += count;
+    lanes->mask = array += count;
+    lanes->scratch = array += count;
+    return 0;
+}
+
+
+/*
+ * Release arrays of lanes.
+ */
+static void lanes_destroy(struct lanes *lanes)
+{
+    free(lanes->block);
+    free(lanes->steps);
+    free(lanes->running);
+}
+
+
+/*
+ * Copy state of cpu to lane.
+ */
+static void lane_load(struct lanes *lanes, size_t lane, const struct cpu *cpu)
+{
+    lanes->regs[0][lane] = cpu->A;
+    lanes->regs[1][lane] = cpu->B;
+    lanes->regs[2][lane] = cpu->C;
+    lanes->regs[3][lane] = cpu->D;
+    lanes->result[lane] = cpu->result;
+    lanes->stackSize[lane] = cpu->stackSize;
+    lanes->ip[lane] = cpu->instructionPointer;
+    lanes->status[lane] = cpu->status;
+}
+
+
+/*
+ * Copy state of lane back to cpu.
+ */
+static void lane_store(const struct lanes *lanes, size_t lane, struct cpu *cpu)
+{
+    cpu->A = lanes->regs[0][lane];
+    cpu->B = lanes->regs[1][lane];
+    cpu->C = lanes->regs[2][lane];
+    cpu->D = lanes->regs[3][lane];
+    cpu->result = lanes->result[lane];
+    cpu->stackSize = lanes->stackSize[lane];
+    cpu->instructionPointer = lanes->ip[lane];
+    cpu->status = lanes->status[lane];
+}
+
+
+/*
+ * Masked operations on all lanes, every instruction set has its table.
+ */
+struct lanesKernels
+{
+    void (*add)(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n);
+    void (*sub)(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n);
+    void (*mul)(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n);
+    void (*addImm)(int32_t *dst, int32_t value, const int32_t *mask, size_t n);
+    void (*copy)(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n);
+    void (*set)(int32_t *dst, int32_t value, const int32_t *mask, size_t n);
+    void (*branch)(int32_t *ip, const int32_t *value, enum lane_condition condition,
+                   int32_t target, int32_t next, const int32_t *mask, size_t n);
+};
+
+/*
+ * Builds without -mavx2 get AVX2 kernels too (GCC/Clang on x86), they are chosen
+ * at run time if the cpu supports AVX2.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__AVX2__)
+#define LOCKSTEP_AVX2_DISPATCH
+#endif
+
+/*
+ * Kernels of the instruction set of the build (SSE2 is the baseline of x86-64).
+ */
+#if defined(__SSE2__) && !defined(__AVX2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#define VEC_WIDTH 4
+#define vec_t __m128i
+#define vec_load(p) _mm_loadu_si128((const __m128i *) (p))
+#define vec_store(p, v) _mm_storeu_si128((__m128i *) (p), (v))
+#define vec_set1(x) _mm_set1_epi32(x)
+#define vec_add(a, b) _mm_add_epi32((a), (b))
+#define vec_sub(a, b) _mm_sub_epi32((a), (b))
+#define vec_cmpeq(a, b) _mm_cmpeq_epi32((a), (b))
+#define vec_cmpgt(a, b) _mm_cmpgt_epi32((a), (b))
+#define vec_not(a) _mm_xor_si128((a), _mm_set1_epi32(-1))
+#define vec_select(m, a, b) _mm_or_si128(_mm_and_si128((m), (a)), _mm_andnot_si128((m), (b)))
+#ifdef __SSE4_1__
+#define vec_mul(a, b) _mm_mullo_epi32((a), (b))
+#else
+/* Low 32 bits of products, even and odd lanes are multiplied separately */
+static inline __m128i vec_mul_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#define vec_mul(a, b) vec_mul_sse2((a), (b))
+#endif
+#endif
+
+#ifndef __AVX2__
+#define NAME(function) function##_base
+#define TARGET
+#define KERNELS kernels_base
+#include "lockstep_kernels.h"
+#undef NAME
+#undef TARGET
+#undef KERNELS
+#endif
+
+#ifdef VEC_WIDTH
+#undef VEC_WIDTH
+#undef vec_t
+#undef vec_load
+#undef vec_store
+#undef vec_set1
+#undef vec_add
+#undef vec_sub
+#undef vec_mul
+#undef vec_cmpeq
+#undef vec_cmpgt
+#undef vec_not
+#undef vec_select
+#endif
+
+/*
+ * AVX2 kernels, the default ones of -mavx2 builds.
+ */
+#if defined(__AVX2__) || defined(LOCKSTEP_AVX2_DISPATCH)
+#include <immintrin.h>
+#define VEC_WIDTH 8
+#define vec_t __m256i
+#define vec_load(p) _mm256_loadu_si256((const __m256i *) (p))
+#define vec_store(p, v) _mm256_storeu_si256((__m256i *) (p), (v))
+#define vec_set1(x) _mm256_set1_epi32(x)
+#define vec_add(a, b) _mm256_add_epi32((a), (b))
+#define vec_sub(a, b) _mm256_sub_epi32((a), (b))
+#define vec_mul(a, b) _mm256_mullo_epi32((a), (b))
+#define vec_cmpeq(a, b) _mm256_cmpeq_epi32((a), (b))
+#define vec_cmpgt(a, b) _mm256_cmpgt_epi32((a), (b))
+#define vec_not(a) _mm256_xor_si256((a), _mm256_set1_epi32(-1))
+#define vec_select(m, a, b) _mm256_blendv_epi8((b), (a), (m))
+#ifdef __AVX2__
+#define NAME(function) function##_base
+#define TARGET
+#define KERNELS kernels_base
+#else
+#define NAME(function) function##_avx2
+#define TARGET __attribute__((target("avx2")))
+#define KERNELS kernels_avx2
+#endif
+#include "lockstep_kernels.h"
+#undef NAME
+#undef TARGET
+#undef KERNELS
+#endif
+
+/*
+ * Returns:
+ *      the fastest kernels the cpu supports
+ */
+static const struct lanesKernels *lanes_kernels(void)
+{
+#ifdef LOCKSTEP_AVX2_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &kernels_avx2;
+    }
+#endif
+    return &kernels_base;
+}
+
+
+/*
+ * Finish lane which executed its last instruction and compute its result like cpuRun.
+ */
+static void lane_finish(struct lanes *lanes, size_t lane, int *results)
+{
+    lanes->running[lane] = 0;
+    if (lanes->status[lane] != cpuOK && lanes->status[lane] != cpuHalted) {
+        results[lane] = -(int) lanes->steps[lane];
+    } else {
+        results[lane] = (int) lanes->steps[lane];
+    }
+}
+
+
+/*
+ * Run instruction by cpuStep for each lane of the group.
+ */
+static void lanes_step(struct lanes *lanes, struct cpu **cpus)
+{
+    for (size_t lane = 0; lane < lanes->count; lane++) {
+        if (lanes->mask[lane]) {
+            lane_store(lanes, lane, cpus[lane]);
+            cpuStep(cpus[lane]);
+            lane_load(lanes, lane, cpus[lane]);
+        }
+    }
+}
+
+
+/*
+ * Same as cpuRun called for each of cpus, but all cpus are run at once.
+ * All cpus must have the same program, profile and stack capacity and the first one
+ * must be decoded by cpuDecode.
+ *
+ * Args:
+ *      cpus - emulated cpu structures (lanes)
+ *      count - number of cpus
+ *      steps - number of instructions to do by each cpu
+ *      results - result of cpuRun for each cpu is stored here
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error (no cpu was run)
+ */
+int cpuRunLockstep(struct cpu **cpus, size_t count, size_t steps, int *results)
+{
+    assert(cpus != NULL);
+    assert(results != NULL);
+
+    if (count == 0) {
+        return 0;
+    }
+    assert(cpus[0]->decoded != NULL);
+
+    struct lanes lanes;
+    if (lanes_create(&lanes, count) != 0) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+
+    const struct lanesKernels *kernels = lanes_kernels();
+    const struct cpuInstruction *decoded = cpus[0]->decoded;
+    int32_t size = cpus[0]->decodedSize;
+    int track_result = cpus[0]->profile >= cpuProfileJmp;
+    size_t n = count;
+    size_t active = 0;
+    for (size_t lane = 0; lane < n; lane++) {
+        assert(cpus[lane]->stackLimit - cpus[lane]->memory + 1 == size);
+        assert(cpus[lane]->profile == cpus[0]->profile);
+        lane_load(&lanes, lane, cpus[lane]);
+        lanes.steps[lane] = 0;
+        lanes.running[lane] = steps > 0 && cpus[lane]->status == cpuOK;
+        if (steps <= 0) {
+            results[lane] = 0;
+        } else if (cpus[lane]->status != cpuOK) {
+            results[lane] = cpus[lane]->status == cpuHalted ? 1 : -1;
+        } else {
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        /* Form group of lanes with the lowest instruction pointer */
+        int32_t ip = INT32_MAX;
+        int found = 0;
+        for (size_t lane = 0; lane < n; lane++) {
+            if (lanes.running[lane] && (!found || lanes.ip[lane] < ip)) {
+                ip = lanes.ip[lane];
+                found = 1;
+            }
+        }
+        size_t budget = SIZE_MAX;
+        for (size_t lane = 0; lane < n; lane++) {
+            lanes.mask[lane] = lanes.running[lane] && lanes.ip[lane] == ip ? -1 : 0;
+            if (lanes.mask[lane] && steps - lanes.steps[lane] < budget) {
+                budget = steps - lanes.steps[lane];
+            }
+        }
+
+        /* Run straight-line code until jump, fault or end of budget */
+        size_t executed = 0;
+        int jumped = 0;
+        int fault = 0;
+        while (!jumped && !fault) {
+            if (executed == budget) {
+                kernels->set(lanes.ip, ip, lanes.mask, n);
+                break;
+            }
+            executed++;
+            if ((uint32_t) ip >= (uint32_t) size) {
+                kernels->set(lanes.ip, ip, lanes.mask, n);
+                kernels->set(lanes.status, cpuInvalidAddress, lanes.mask, n);
+                break;
+            }
+            const struct cpuInstruction *inst = &decoded[ip];
+            int32_t *reg = lanes.regs[inst->reg];
+
+            switch (inst->op) {
+            case cpuOpNop:
+                break;
+
+            case cpuOpHalt:
+                kernels->set(lanes.ip, ip + 1, lanes.mask, n);
+                kernels->set(lanes.status, cpuHalted, lanes.mask, n);
+                fault = 1;
+                break;
+
+            case cpuOpAdd:
+                kernels->add(lanes.regs[0], reg, lanes.mask, n);
+                if (track_result) {
+                    kernels->copy(lanes.result, lanes.regs[0], lanes.mask, n);
+                }
+                break;
+
+            case cpuOpSub:
+                kernels->sub(lanes.regs[0], reg, lanes.mask, n);
+                if (track_result) {
+                    kernels->copy(lanes.result, lanes.regs[0], lanes.mask, n);
+                }
+                break;
+
+            case cpuOpMul:
+                kernels->mul(lanes.regs[0], reg, lanes.mask, n);
+                if (track_result) {
+                    kernels->copy(lanes.result, lanes.regs[0], lanes.mask, n);
+                }
+                break;
+
+            case cpuOpInc:
+            case cpuOpDec:
+                kernels->addImm(reg, inst->op == cpuOpInc ? 1 : -1, lanes.mask, n);
+                if (track_result) {
+                    kernels->copy(lanes.result, reg, lanes.mask, n);
+                }
+                break;
+
+            case cpuOpMovr:
+                kernels->set(reg, inst->arg, lanes.mask, n);
+                break;
+
+            case cpuOpSwap:
+                kernels->copy(lanes.scratch, reg, lanes.mask, n);
+                kernels->copy(reg, lanes.regs[inst->arg], lanes.mask, n);
+                kernels->copy(lanes.regs[inst->arg], lanes.scratch, lanes.mask, n);
+                break;
+
+            case cpuOpLoop:
+                kernels->branch(lanes.ip, lanes.regs[2], laneNonZero, inst->arg, ip + 2, lanes.mask, n);
+                jumped = 1;
+                break;
+
+            case cpuOpCmp:
+                kernels->copy(lanes.result, reg, lanes.mask, n);
+                kernels->sub(lanes.result, lanes.regs[inst->arg], lanes.mask, n);
+                break;
+
+            case cpuOpJmp:
+                kernels->branch(lanes.ip, lanes.result, laneAlways, inst->arg, ip + 2, lanes.mask, n);
+                jumped = 1;
+                break;
+
+            case cpuOpJz:
+                kernels->branch(lanes.ip, lanes.result, laneZero, inst->arg, ip + 2, lanes.mask, n);
+                jumped = 1;
+                break;
+
+            case cpuOpJnz:
+                kernels->branch(lanes.ip, lanes.result, laneNonZero, inst->arg, ip + 2, lanes.mask, n);
+                jumped = 1;
+                break;
+
+            case cpuOpJgt:
+                kernels->branch(lanes.ip, lanes.result, lanePositive, inst->arg, ip + 2, lanes.mask, n);
+                jumped = 1;
+                break;
+
+            /* Operations which may fault or touch memory of the lane are done lane by lane */
+            case cpuOpDiv:
+            case cpuOpLoad:
+            case cpuOpStore:
+            case cpuOpPush:
+            case cpuOpPop:
+            case cpuOpCall:
+            case cpuOpRet:
+                for (size_t lane = 0; lane < n; lane++) {
+                    if (!lanes.mask[lane]) {
+                        continue;
+                    }
+                    struct cpu *cpu = cpus[lane];
+                    int32_t *stackSize = &lanes.stackSize[lane];
+                    int32_t *value = &reg[lane];
+                    int32_t next = ip + inst->length;
+                    int status = cpuOK;
+                    int64_t depth = (int64_t) lanes.regs[3][lane] + inst->arg + 1;
+
+                    switch (inst->op) {
+                    case cpuOpDiv:
+                        if (*value == 0) {
+                            status = cpuDivByZero;
+                            break;
+                        }
+                        lanes.regs[0][lane] /= *value;
+                        lanes.result[lane] = lanes.regs[0][lane];
+                        break;
+                    case cpuOpLoad:
+                    case cpuOpStore:
+                        if (depth <= 0 || depth > *stackSize) {
+                            status = cpuInvalidStackOperation;
+                        } else if (inst->op == cpuOpLoad) {
+                            *value = cpu->stackBottom[depth - *stackSize];
+                        } else {
+                            cpu->stackBottom[depth - *stackSize] = *value;
+                        }
+                        break;
+                    case cpuOpPush:
+                    case cpuOpCall:
+                        if (*stackSize >= cpu->stackBottom - cpu->stackLimit) {
+                            status = cpuInvalidStackOperation;
+                            break;
+                        }
+                        cpu->stackBottom[-*stackSize] = inst->op == cpuOpPush ? *value : next;
+                        (*stackSize)++;
+                        if (*stackSize > cpu->stackHighWater) {
+                            cpu->stackHighWater = *stackSize;
+                        }
+                        if (inst->op == cpuOpCall) {
+                            next = inst->arg;
+                        }
+                        break;
+                    case cpuOpPop:
+                    case cpuOpRet:
+                        if (*stackSize <= 0) {
+                            status = cpuInvalidStackOperation;
+                            break;
+                        }
+                        if (inst->op == cpuOpPop) {
+                            *value = cpu->stackBottom[-*stackSize + 1];
+                        } else {
+                            next = cpu->stackBottom[-*stackSize + 1];
+                        }
+                        (*stackSize)--;
+                        if (inst->op == cpuOpRet) {
+                            cpu->stackBottom[-*stackSize] = 0;
+                        }
+                        break;
+                    }
+                    lanes.ip[lane] = status == cpuOK ? next : ip;
+                    lanes.status[lane] = status;
+                }
+                jumped = 1;
+                break;
+
+            /* I/O and instructions which could not be decoded are left to cpuStep */
+            default:
+                kernels->set(lanes.ip, ip, lanes.mask, n);
+                lanes_step(&lanes, cpus);
+                jumped = 1;
+                break;
+            }
+
+            if (!jumped && !fault) {
+                ip += inst->length;
+            }
+        }
+
+        /* Count executed instructions and finish lanes which stopped */
+        for (size_t lane = 0; lane < n; lane++) {
+            if (!lanes.mask[lane]) {
+                continue;
+            }
+            lanes.steps[lane] += executed;
+            if (lanes.status[lane] != cpuOK || lanes.steps[lane] == steps) {
+                lane_finish(&lanes, lane, results);
+                active--;
+            }
+        }
+    }
+
+    for (size_t lane = 0; lane < n; lane++) {
+        lane_store(&lanes, lane, cpus[lane]);
+        cpuFlush(cpus[lane]);
+    }
+    lanes_destroy(&lanes);
+    return 0;
+}
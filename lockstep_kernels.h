@@ -0,0 +1,146 @@
+/*
+ * Masked kernels of the lockstep engine, included by lockstep.c once for every
+ * instruction set. It defines table KERNELS of struct lanesKernels, its functions
+ * are named by NAME(function) and compiled with TARGET attributes. With VEC_WIDTH
+ * defined the vec_* operations process VEC_WIDTH lanes at once, the rest of lanes
+ * (and all lanes without VEC_WIDTH) are done one by one.
+ */
+
+/*
+ * Masked arithmetic on all lanes: dst = mask ? dst OP src : dst.
+ */
+#ifdef VEC_WIDTH
+#define LANES_BINARY(name, vec_op, op)                                                  \
+    TARGET static void name(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n) \
+    {                                                                                   \
+        size_t i = 0;                                                                   \
+        for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {                                    \
+            vec_t a = vec_load(&dst[i]);                                                \
+            vec_t value = vec_op(a, vec_load(&src[i]));                                 \
+            vec_store(&dst[i], vec_select(vec_load(&mask[i]), value, a));               \
+        }                                                                               \
+        for (; i < n; i++) {                                                            \
+            if (mask[i]) {                                                              \
+                dst[i] = (int32_t) ((uint32_t) dst[i] op (uint32_t) src[i]);            \
+            }                                                                           \
+        }                                                                               \
+    }
+#else
+#define LANES_BINARY(name, vec_op, op)                                                  \
+    TARGET static void name(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n) \
+    {                                                                                   \
+        for (size_t i = 0; i < n; i++) {                                                \
+            if (mask[i]) {                                                              \
+                dst[i] = (int32_t) ((uint32_t) dst[i] op (uint32_t) src[i]);            \
+            }                                                                           \
+        }                                                                               \
+    }
+#endif
+
+LANES_BINARY(NAME(lanes_add), vec_add, +)
+LANES_BINARY(NAME(lanes_sub), vec_sub, -)
+LANES_BINARY(NAME(lanes_mul), vec_mul, *)
+
+#undef LANES_BINARY
+
+
+/*
+ * Masked add of constant: dst = mask ? dst + value : dst.
+ */
+TARGET static void NAME(lanes_add_imm)(int32_t *dst, int32_t value, const int32_t *mask, size_t n)
+{
+    size_t i = 0;
+#ifdef VEC_WIDTH
+    vec_t v = vec_set1(value);
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_t a = vec_load(&dst[i]);
+        vec_store(&dst[i], vec_select(vec_load(&mask[i]), vec_add(a, v), a));
+    }
+#endif
+    for (; i < n; i++) {
+        if (mask[i]) {
+            dst[i] = (int32_t) ((uint32_t) dst[i] + (uint32_t) value);
+        }
+    }
+}
+
+
+/*
+ * Masked copy: dst = mask ? src : dst.
+ */
+TARGET static void NAME(lanes_copy)(int32_t *dst, const int32_t *src, const int32_t *mask, size_t n)
+{
+    size_t i = 0;
+#ifdef VEC_WIDTH
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_store(&dst[i], vec_select(vec_load(&mask[i]), vec_load(&src[i]), vec_load(&dst[i])));
+    }
+#endif
+    for (; i < n; i++) {
+        if (mask[i]) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+
+/*
+ * Masked set: dst = mask ? value : dst.
+ */
+TARGET static void NAME(lanes_set)(int32_t *dst, int32_t value, const int32_t *mask, size_t n)
+{
+    size_t i = 0;
+#ifdef VEC_WIDTH
+    vec_t v = vec_set1(value);
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_store(&dst[i], vec_select(vec_load(&mask[i]), v, vec_load(&dst[i])));
+    }
+#endif
+    for (; i < n; i++) {
+        if (mask[i]) {
+            dst[i] = value;
+        }
+    }
+}
+
+
+/*
+ * Masked jump: ip = mask ? (condition(value) ? target : next) : ip.
+ */
+TARGET static void NAME(lanes_branch)(int32_t *ip, const int32_t *value, enum lane_condition condition,
+                                      int32_t target, int32_t next, const int32_t *mask, size_t n)
+{
+    size_t i = 0;
+#ifdef VEC_WIDTH
+    vec_t zero = vec_set1(0);
+    vec_t t = vec_set1(target);
+    vec_t f = vec_set1(next);
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_t taken;
+        if (condition == laneAlways) {
+            taken = vec_set1(-1);
+        } else if (condition == lanePositive) {
+            taken = vec_cmpgt(vec_load(&value[i]), zero);
+        } else {
+            taken = vec_cmpeq(vec_load(&value[i]), zero);
+            if (condition == laneNonZero) {
+                taken = vec_not(taken);
+            }
+        }
+        vec_store(&ip[i], vec_select(vec_load(&mask[i]), vec_select(taken, t, f), vec_load(&ip[i])));
+    }
+#endif
+    for (; i < n; i++) {
+        if (mask[i]) {
+            int taken = condition == laneAlways || (condition == laneNonZero && value[i] != 0) ||
+                        (condition == laneZero && value[i] == 0) || (condition == lanePositive && value[i] > 0);
+            ip[i] = taken ? target : next;
+        }
+    }
+}
+
+
+static const struct lanesKernels KERNELS = {
+    NAME(lanes_add), NAME(lanes_sub), NAME(lanes_mul), NAME(lanes_add_imm),
+    NAME(lanes_copy), NAME(lanes_set), NAME(lanes_branch),
+};
@@ -1,78 +1,648 @@
+#include "batch.h"
 #include "cpu.h"
+#include "history.h"
+#include "pool.h"
+#include "trace.h"
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define invalidArgs "Invalid arguments, run ./cpu (run|trace) [stackCapacity] FILE\n"
+#include <unistd.h>
+#define LOCKSTEP_LANES 256
+#define HISTORY_MEMORY (64 * 1024 * 1024)
+#define invalidArgs "Invalid arguments, run ./cpu [-e step|decoded|threaded|verified|jit|native|compact|counted] [-p base|jmp|call] [-x LIBRARY] [-d CACHE] [-c COUNTERS] [-t TRACE] [-i INPUT] [-b] [-r|-R IOLOG] (run|trace) [stackCapacity] FILE\n" \
+                    "                     or ./cpu dump TRACE\n" \
+                    "                     or ./cpu [-p PROFILE] translate FILE OUTPUT\n" \
+                    "                     or ./cpu (compact|expand) FILE OUTPUT\n" \
+                    "                     or ./cpu [-e ENGINE] [-p PROFILE] [-d CACHE] [-b] [-j THREADS] batch MANIFEST\n" \
+                    "                     or ./cpu [-p PROFILE] [-b] lockstep [stackCapacity] FILE INPUT...\n"
+
+/* Shared library from translate for the native engine, NULL = compile the program when it is run */
+static const char *nativeLibrary = NULL;
+
+/* Directory of decoded programs (see cpuCacheLoad), NULL = decode every time */
+static const char *cacheDirectory = NULL;
+
+/*
+ * Decode program of the cpu, mapped from the cache if it is there (then the cpu has
+ * to be released by cpuCacheClose).
+ */
+static int decode(struct cpu *cpu)
+{
+    if (cacheDirectory == NULL) {
+        return cpuDecode(cpu);
+    }
+    if (cpuCacheLoad(cpu, cacheDirectory) == 0) {
+        return 0;
+    }
+    if (cpuDecode(cpu) != 0) {
+        return 1;
+    }
+    if (cpuCacheStore(cpu, cacheDirectory) != 0) {
+        fprintf(stderr, "Program was not cached\n");
+    }
+    return 0;
+}
+
+
+/*
+ * Run cpu using selected engine.
+ */
+static int run_engine(struct cpu *cpu, const char *engine)
+{
+    if (strcmp(engine, "counted") == 0) {
+        return cpuRunCounted(cpu, UINT_MAX);
+    }
+    if (strcmp(engine, "step") == 0 || decode(cpu) != 0) {
+        return cpuRun(cpu, UINT_MAX);
+    }
+    if (strcmp(engine, "decoded") == 0) {
+        return cpuRunDecoded(cpu, UINT_MAX);
+    }
+    if (strcmp(engine, "verified") == 0) {
+        // unverified programs run checked by the threaded engine
+        cpuVerify(cpu);
+        return cpuRunVerified(cpu, UINT_MAX);
+    }
+    if (strcmp(engine, "jit") == 0) {
+        if (cpuJitCreate(cpu) == 0) {
+            int result = cpuRunJit(cpu, UINT_MAX);
+            cpuJitDestroy(cpu);
+            return result;
+        }
+        fprintf(stderr, "JIT is not available, using threaded engine\n");
+    }
+    if (strcmp(engine, "native") == 0) {
+        if (cpuNativeCreate(cpu, nativeLibrary) == 0) {
+            int result = cpuRunNative(cpu, UINT_MAX);
+            cpuNativeDestroy(cpu);
+            return result;
+        }
+        fprintf(stderr, "Native code is not available, using threaded engine\n");
+    }
+    if (strcmp(engine, "compact") == 0) {
+        if (cpuCompactCreate(cpu) == 0) {
+            int result = cpuRunCompact(cpu, UINT_MAX);
+            cpuCompactDestroy(cpu);
+            return result;
+        }
+        fprintf(stderr, "Compact bytecode is not available, using threaded engine\n");
+    }
+    return cpuRunThreaded(cpu, UINT_MAX);
+}
+
+
+/*
+ * Run cpu using selected engine, the cached program is released after it.
+ */
+static int run(struct cpu *cpu, const char *engine)
+{
+    int result = run_engine(cpu, engine);
+    cpuCacheClose(cpu);
+    return result;
+}
+
+
+/*
+ * Breakpoints and watched registers of the interactive trace.
+ */
+struct debugger
+{
+    struct cpu *cpu;
+    struct history *history;
+    int32_t size;               // words of the code region
+    uint8_t *breakpoints;
+    uint8_t *traps;             // breakpoints, in/get and instructions changing watched registers
+    char watches[8];            // watched registers (A, B, C, D, S)
+};
+
+
+/*
+ * Trap instructions the run has to stop at (see cpuSetTraps), in/get are trapped for the history.
+ */
+static int debug_traps(struct debugger *debugger)
+{
+    struct cpu *cpu = debugger->cpu;
+    for (int32_t ip = 0; ip < debugger->size; ip++) {
+        int trap = debugger->breakpoints[ip] || cpu->memory[ip] == cpuOpIn || cpu->memory[ip] == cpuOpGet;
+        for (const char *reg = debugger->watches; *reg != '\0' && !trap; reg++) {
+            trap = cpuWritesRegister(cpu, ip, *reg);
+        }
+        debugger->traps[ip] = trap;
+    }
+    return cpuSetTraps(cpu, debugger->traps);
+}
+
 
 /*
-#define BONUS_JMP //enable bonus task 1 ! remove before commit ***************
-#define BONUS_CALL //enable bonus task 2 ! remove before commit ***************
-*/
+ * Run at most limit steps by the threaded engine, stop on a breakpoint (except the one
+ * the run starts at) or after an instruction which changed a watched register.
+ */
+static void debug_run(struct debugger *debugger, size_t limit)
+{
+    struct cpu *cpu = debugger->cpu;
+    struct history *history = debugger->history;
+    size_t start = historyPosition(history);
+    while (cpuStatus(cpu) == cpuOK && historyPosition(history) - start < limit) {
+        int32_t ip = cpuPeek(cpu, 'I');
+        if (ip < 0 || ip >= debugger->size || !debugger->traps[ip]) {
+            historyRun(history, limit - (historyPosition(history) - start), cpuRunThreaded);
+            continue;
+        }
+        if (debugger->breakpoints[ip] && historyPosition(history) != start) {
+            printf("Breakpoint %" PRId32 "\n", ip);
+            return;
+        }
+        int32_t values[sizeof(debugger->watches)];
+        for (size_t i = 0; debugger->watches[i] != '\0'; i++) {
+            values[i] = cpuPeek(cpu, debugger->watches[i]);
+        }
+        historyStep(history);
+        for (size_t i = 0; debugger->watches[i] != '\0'; i++) {
+            if (cpuPeek(cpu, debugger->watches[i]) != values[i]) {
+                printf("%c changed from %" PRId32 " to %" PRId32 "\n", debugger->watches[i], values[i],
+                       cpuPeek(cpu, debugger->watches[i]));
+                return;
+            }
+        }
+    }
+}
+
 
 /*
- * Translate cpu->status to string and returns it.
+ * Interactive trace. Besides stepping forward the cpu can go back in its history:
+ * "b" - one step back, "g N" - go to step N, "r REG" - back to the last change of REG
+ * (A, B, C, D, S = stack size, I = IP). Runs are done by the threaded engine with breakpoints
+ * and watched registers trapped in the decoded program, so they cost nothing elsewhere:
+ * "c"/"continue" - continue to a breakpoint, a change of watched register or the end,
+ * "run N" - the same for at most N steps, "break IP" and "watch REG" - add or remove
+ * breakpoint or watched register.
  */
-const char *statusName(enum cpuStatus status)
+static void debug(struct cpu *cpu)
 {
-    switch (status) {
-    case cpuOK:
-        return "cpuOK";
-    case cpuHalted:
-        return "cpuHalted";
-    case cpuIllegalInstruction:
-        return "cpuIllegalInstruction";
-    case cpuIllegalOperand:
-        return "cpuIllegalOperand";
-    case cpuInvalidAddress:
-        return "cpuInvalidAddress";
-    case cpuInvalidStackOperation:
-        return "cpuInvalidStackOperation";
-    case cpuDivByZero:
-        return "cpuDivByZero";
-    case cpuIOError:
-        return "cpuIOError";
-    default:
-        fprintf(stderr, "BUG: Unknown status (%d)\n", status);
-        abort();
-    }
-    printf("\n");
+    struct debugger debugger = { cpu, NULL, cpu->stackLimit - cpu->memory + 1, NULL, NULL, "" };
+    debugger.breakpoints = calloc(debugger.size, sizeof(uint8_t));
+    debugger.traps = malloc(debugger.size);
+    if (debugger.breakpoints == NULL || debugger.traps == NULL || debug_traps(&debugger) != 0) {
+        fprintf(stderr, "Allocation error!");
+        free(debugger.breakpoints);
+        free(debugger.traps);
+        return;
+    }
+    struct history *history = historyCreate(cpu, HISTORY_MEMORY);
+    if (history == NULL) {
+        free(debugger.breakpoints);
+        free(debugger.traps);
+        return;
+    }
+    debugger.history = history;
+    printf("Press Enter to execute the next instruction or type 'q' to quit.\n");
+    printf("Commands: b (back), g STEP (go to), c (continue), r REG (back to the last change of REG),\n");
+    printf("          run STEPS, break IP, watch REG (breakpoints and watches are toggled).\n");
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    while (getline(&line, &lineSize, stdin) != -1) {
+        char command[16];
+        int length = 0;
+        char reg;
+        unsigned long long step;
+        long long ip;
+        if (sscanf(line, "%15s%n", command, &length) != 1) {
+            int ret_code = historyStep(history);
+            cpuPrintState(cpu, stdout);
+            if (ret_code == 0) {
+                printf("finished\n");
+            }
+            continue;
+        }
+        const char *args = &line[length];
+        if (strcmp(command, "q") == 0) {
+            break;
+        }
+        if (strcmp(command, "b") == 0 && historyPosition(history) > 0) {
+            historyGoto(history, historyPosition(history) - 1);
+        } else if (strcmp(command, "g") == 0 && sscanf(args, "%llu", &step) == 1) {
+            historyGoto(history, step);
+        } else if (strcmp(command, "c") == 0 || strcmp(command, "continue") == 0) {
+            debug_run(&debugger, SIZE_MAX);
+        } else if (strcmp(command, "run") == 0 && sscanf(args, "%llu", &step) == 1) {
+            debug_run(&debugger, step);
+        } else if (strcmp(command, "r") == 0 && sscanf(args, " %c", &reg) == 1 && strchr("ABCDSI", reg) != NULL) {
+            if (!historyReverseContinue(history, reg)) {
+                printf("%c was not changed\n", reg);
+            }
+        } else if (strcmp(command, "break") == 0 && sscanf(args, "%lld", &ip) == 1 && ip >= 0 && ip < debugger.size) {
+            debugger.breakpoints[ip] = !debugger.breakpoints[ip];
+            printf("Breakpoint %lld %s\n", ip, debugger.breakpoints[ip] ? "set" : "removed");
+            if (debug_traps(&debugger) != 0) {
+                break;
+            }
+            continue;
+        } else if (strcmp(command, "watch") == 0 && sscanf(args, " %c", &reg) == 1 && strchr("ABCDS", reg) != NULL) {
+            char *watch = strchr(debugger.watches, reg);
+            if (watch != NULL) {
+                memmove(watch, watch + 1, strlen(watch));
+            } else {
+                strncat(debugger.watches, &reg, 1);
+            }
+            printf("Watching: %s\n", debugger.watches[0] != '\0' ? debugger.watches : "nothing");
+            if (debug_traps(&debugger) != 0) {
+                break;
+            }
+            continue;
+        } else {
+            printf("Unknown command\n");
+            continue;
+        }
+        printf("Step: %zu\n", historyPosition(history));
+        cpuPrintState(cpu, stdout);
+        if (cpuStatus(cpu) != cpuOK) {
+            printf("finished\n");
+        }
+    }
+
+    free(line);
+    historyDestroy(history);
+    cpuSetTraps(cpu, NULL);
+    free(debugger.breakpoints);
+    free(debugger.traps);
 }
 
 
 /*
- * Prints cpu registers and stack memory.
+ * Write execution counters of the cpu to path ("-" = stdout) as JSON.
  */
-static void state(struct cpu *cpu)
+static int counters(struct cpu *cpu, const char *path)
 {
-    printf("A: %d, B: %d, C: %d, D: %d\n", cpu->A, cpu->B, cpu->C, cpu->D);
-
-    printf("Stack size: %d\n", cpu->stackSize);
-    printf("Stack:");
-    for (int i = 0; i < cpu->stackSize; i++) {
-        printf(" %d", cpu->stackBottom[-i]);
-    }
-    printf("\n");
-#ifdef BONUS_JMP
-    printf("Result: %d\n", cpu->result);
-#endif
-    printf("Status: %s\n", statusName(cpu->status));
-    printf("Instruction pointer: %d\n", cpu->instructionPointer);
+    const struct cpuCounters *counters = cpuGetCounters(cpu);
+    if (counters == NULL) {
+        return 0;
+    }
+    FILE *stream = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (stream == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    fprintf(stream, "{\n  \"steps\": %" PRIu64 ",\n  \"illegal\": %" PRIu64 ",\n  \"stack_high_water\": %" PRId32 ",\n",
+            counters->steps, counters->illegal, counters->stackHighWater);
+    fprintf(stream, "  \"opcodes\": {");
+    const char *separator = "";
+    for (int op = 0; op < CPU_OPCODES; op++) {
+        if (counters->opcodes[op] != 0) {
+            fprintf(stream, "%s\n    \"%s\": %" PRIu64, separator, cpuOpcodeName(op), counters->opcodes[op]);
+            separator = ",";
+        }
+    }
+    fprintf(stream, "\n  },\n  \"branches\": {");
+    separator = "";
+    for (int op = 0; op < CPU_OPCODES; op++) {
+        if (counters->taken[op] != 0 || counters->notTaken[op] != 0) {
+            fprintf(stream, "%s\n    \"%s\": {\"taken\": %" PRIu64 ", \"not_taken\": %" PRIu64 "}", separator,
+                    cpuOpcodeName(op), counters->taken[op], counters->notTaken[op]);
+            separator = ",";
+        }
+    }
+    // addresses with their hits, hottest code is found by sorting them
+    fprintf(stream, "\n  },\n  \"addresses\": [");
+    separator = "";
+    for (size_t ip = 0; ip < counters->addressCount; ip++) {
+        if (counters->addresses[ip] != 0) {
+            // program may have overwritten the instruction since it was counted
+            const char *name = cpuOpcodeName(cpu->memory[ip]);
+            fprintf(stream, "%s\n    {\"ip\": %zu, \"op\": \"%s\", \"hits\": %" PRIu64 "}", separator, ip,
+                    name != NULL ? name : "?", counters->addresses[ip]);
+            separator = ",";
+        }
+    }
+    fprintf(stream, "\n  ]\n}\n");
+
+    if (stream != stdout) {
+        fclose(stream);
+    }
+    return 0;
 }
 
 
 /*
- * 3-4 argumenty
- * 1 - jmeno souboru
- * 2 - "run"/"trace"
- * 3 - optional - stack cappacity
- * 4 - cesta k binarce
+ * Run program once for each input file in lockstep (LOCKSTEP_LANES runs at once),
+ * prints output and state of every run in order of inputs.
+ */
+static int lockstep(const char *path, size_t stackCapacity, char *inputs[], int count, int inputFlags, enum cpuProfile profile)
+{
+    FILE *fptr;
+    if ((fptr = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    int32_t *stackBottom;
+    int32_t *image = cpuCreateMemory(fptr, stackCapacity, &stackBottom);
+    struct pool *pool = NULL;
+    if (image != NULL) {
+        // lanes of every round are taken from one slab
+        pool = poolCreate(count < LOCKSTEP_LANES ? count : LOCKSTEP_LANES, (stackBottom - image + 1) * sizeof(int32_t), 0);
+        cpuFreeMemory(image, (stackBottom - image + 1) * sizeof(int32_t));
+    }
+    if (pool == NULL) {
+        fclose(fptr);
+        return 1;
+    }
+
+    struct cpu *lanes[LOCKSTEP_LANES];
+    FILE *files[LOCKSTEP_LANES];
+    FILE *outputs[LOCKSTEP_LANES];
+    char *texts[LOCKSTEP_LANES];
+    size_t lengths[LOCKSTEP_LANES];
+    int results[LOCKSTEP_LANES];
+    int ret = 0;
+
+    for (int first = 0; first < count && ret == 0; first += LOCKSTEP_LANES) {
+        int n = count - first < LOCKSTEP_LANES ? count - first : LOCKSTEP_LANES;
+        int created = 0;
+        for (; created < n; created++) {
+            rewind(fptr);
+            struct cpu *cpu = poolAcquire(pool, fptr, stackCapacity);
+            texts[created] = NULL;
+            outputs[created] = open_memstream(&texts[created], &lengths[created]);
+            if ((files[created] = fopen(inputs[first + created], "rb")) == NULL) {
+                perror(inputs[first + created]);
+            }
+            if (cpu == NULL || outputs[created] == NULL || files[created] == NULL) {
+                if (outputs[created] == NULL) {
+                    fprintf(stderr, "Allocation error!");
+                }
+                if (cpu != NULL) {
+                    poolRelease(pool, cpu);
+                }
+                if (outputs[created] != NULL) {
+                    fclose(outputs[created]);
+                    free(texts[created]);
+                }
+                if (files[created] != NULL) {
+                    fclose(files[created]);
+                }
+                ret = 1;
+                break;
+            }
+            cpuSetProfile(cpu, profile);
+            cpuSetOutput(cpu, outputs[created]);
+            cpuSetInput(cpu, files[created], inputFlags);
+            lanes[created] = cpu;
+        }
+
+        if (ret == 0 && (cpuDecode(lanes[0]) != 0 || cpuRunLockstep(lanes, n, UINT_MAX, results) != 0)) {
+            ret = 1;
+        }
+        for (int i = 0; i < created; i++) {
+            if (ret == 0) {
+                cpuPrintState(lanes[i], outputs[i]);
+                fprintf(outputs[i], "'cpuRun' result: %d\n", results[i]);
+            }
+            poolRelease(pool, lanes[i]);
+            fclose(outputs[i]);
+            fclose(files[i]);
+            if (ret == 0) {
+                printf("==> %s <==\n", inputs[first + i]);
+                fwrite(texts[i], 1, lengths[i], stdout);
+            }
+            free(texts[i]);
+        }
+    }
+
+    poolDestroy(pool);
+    fclose(fptr);
+    return ret;
+}
+
+
+/*
+ * Write program translated to C (see cpuTranslate) to output.
+ */
+static int translate(const char *path, const char *output, enum cpuProfile profile)
+{
+    FILE *fptr;
+    if ((fptr = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    int32_t *stackBottom;
+    int32_t *memory = cpuCreateMemory(fptr, 0, &stackBottom);
+    fclose(fptr);
+    if (memory == NULL) {
+        return 1;
+    }
+    struct cpu cpu;
+    cpuCreate(&cpu, memory, stackBottom, 0);
+    cpuSetProfile(&cpu, profile);
+
+    int ret = cpuDecode(&cpu);
+    if (ret == 0) {
+        FILE *out;
+        if ((out = fopen(output, "w")) == NULL) {
+            perror(output);
+            ret = 1;
+        } else {
+            ret = cpuTranslate(&cpu, out);
+            ret |= fclose(out) != 0;
+        }
+    }
+    cpuDestroy(&cpu);
+    return ret;
+}
+
+
+/*
+ * Convert file on path to output by converter (cpuCompactEncode or cpuCompactDecode).
+ */
+static int convert(const char *path, const char *output, int (*converter)(FILE *, FILE *))
+{
+    FILE *in;
+    if ((in = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    FILE *out;
+    if ((out = fopen(output, "wb")) == NULL) {
+        perror(output);
+        fclose(in);
+        return 1;
+    }
+    int ret = converter(in, out);
+    ret |= fclose(out) != 0;
+    fclose(in);
+    return ret;
+}
+
+
+/*
+ * Open I/O log on path and start recording (record != 0) or replaying I/O of the cpu.
+ *
+ * Returns:
+ *      the log, NULL on error
+ */
+static FILE *io_log(struct cpu *cpu, const char *path, int record)
+{
+    FILE *log;
+    if ((log = fopen(path, record ? "wb" : "rb")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if ((record ? cpuRecordIo(cpu, log) : cpuReplayIo(cpu, log)) != 0) {
+        cpuIoLogClose(cpu);
+        fclose(log);
+        return NULL;
+    }
+    return log;
+}
+
+
+/*
+ * 3-4 argumenty (+ volby)
+ * -e - optional - engine (step, decoded, threaded, verified, jit, native, compact, counted), jinak verified
+ * -p - optional - instrukcni sada (base, jmp = + cmp a skoky, call = + call a ret), jinak base
+ * -x - optional - knihovna prelozena z vystupu translate pro engine native (jinak se program prelozi pri spusteni)
+ * -d - optional - adresar pro cache dekodovanych programu (sdilena i mezi procesy)
+ * -c - optional - soubor pro citace instrukci v JSON ("-" = stdout), zapne engine counted
+ * -t - optional - run zapise binarni zaznam vsech kroku do souboru (vypise ho dump)
+ * -i - optional - soubor se vstupem programu (jinak stdin)
+ * -r - optional - run zapise binarni log hodnot z in/get a do out/put
+ * -R - optional - run prehraje log z -r (vstup se necte, vystup se jen porovna s logem)
+ * -b - optional - binarni vstup (in cte int32 little-endian)
+ * -j - optional - pocet vlaken pro batch (jinak pocet procesoru)
+ * dump TRACE - vypise stav po kazdem kroku zaznamu z -t (stejne jako trace)
+ * translate FILE OUTPUT - zapise program jako C pro engine native (cc -O2 -shared -fPIC)
+ * compact FILE OUTPUT - zapise program jako kompaktni bytecode (promenna delka instrukci)
+ * expand FILE OUTPUT - prevede kompaktni bytecode zpet na binarku
+ * batch MANIFEST - spusti vsechny ulohy z manifestu (viz batch.h)
+ * lockstep [stackCapacity] FILE INPUT... - spusti program pro kazdy vstup, vsechny najednou
+ * 1 - "run"/"trace" (trace umi i krokovat zpet, breakpointy a sledovani registru, viz debug)
+ * 2 - optional - stack cappacity
+ * 3 - cesta k binarce
  */
 int main(int argc, char *argv[])
 {
+    const char *engine = "verified";
+    const char *inputPath = NULL;
+    const char *countersPath = NULL;
+    const char *tracePath = NULL;
+    const char *ioLogPath = NULL;
+    int ioRecord = 0;
+    enum cpuProfile profile = cpuProfileBase;
+    int inputFlags = cpuInputText;
+    unsigned threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:p:x:d:c:t:i:r:R:bj:")) != -1) {
+        switch (opt) {
+        case 'j': {
+            char *end;
+            long value = strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > 4096) {
+                printf(invalidArgs);
+                return 1;
+            }
+            threads = value;
+            break;
+        }
+        case 'p':
+            profile = 0;
+            while (profile < CPU_PROFILES && strcmp(optarg, cpuProfileName(profile)) != 0) {
+                profile++;
+            }
+            if (profile == CPU_PROFILES) {
+                printf(invalidArgs);
+                return 1;
+            }
+            break;
+        case 'x':
+            nativeLibrary = optarg;
+            engine = "native";
+            break;
+        case 'd':
+            cacheDirectory = optarg;
+            break;
+        case 'c':
+            countersPath = optarg;
+            engine = "counted";
+            break;
+        case 't':
+            tracePath = optarg;
+            break;
+        case 'i':
+            inputPath = optarg;
+            break;
+        case 'r':
+        case 'R':
+            ioLogPath = optarg;
+            ioRecord = opt == 'r';
+            break;
+        case 'b':
+            inputFlags |= cpuInputBinary;
+            break;
+        case 'e':
+            engine = optarg;
+            if (strcmp(engine, "step") != 0 && strcmp(engine, "decoded") != 0 &&
+                    strcmp(engine, "threaded") != 0 && strcmp(engine, "verified") != 0 && strcmp(engine, "jit") != 0 &&
+                    strcmp(engine, "native") != 0 && strcmp(engine, "compact") != 0 && strcmp(engine, "counted") != 0) {
+                printf(invalidArgs);
+                return 1;
+            }
+            break;
+        default:
+            printf(invalidArgs);
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+        FILE *trace;
+        if ((trace = fopen(argv[2], "rb")) == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        int ret = traceDecode(trace, stdout);
+        fclose(trace);
+        return ret;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "translate") == 0) {
+        return translate(argv[2], argv[3], profile);
+    }
+
+    if (argc == 4 && strcmp(argv[1], "compact") == 0) {
+        return convert(argv[2], argv[3], cpuCompactEncode);
+    }
+
+    if (argc == 4 && strcmp(argv[1], "expand") == 0) {
+        return convert(argv[2], argv[3], cpuCompactDecode);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "batch") == 0) {
+        FILE *manifest;
+        if ((manifest = fopen(argv[2], "r")) == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        int ret = batchRun(manifest, threads, inputFlags, profile, run, engine);
+        fclose(manifest);
+        return ret;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "lockstep") == 0) {
+        char *end;
+        long value = strtol(argv[2], &end, 10);
+        if (*end == '\0' && value >= 0 && argc >= 5) {
+            return lockstep(argv[3], value, &argv[4], argc - 4, inputFlags, profile);
+        }
+        return lockstep(argv[2], 256, &argv[3], argc - 3, inputFlags, profile);
+    }
+
     if (argc > 4 || argc < 3) {
         printf(invalidArgs);
         return 1;
@@ -97,35 +667,67 @@ int main(int argc, char *argv[])
         perror(argv[argc - 1]);
         return 1;
     }
+    FILE *input = stdin;
+    if (inputPath != NULL && (input = fopen(inputPath, "rb")) == NULL) {
+        perror(inputPath);
+        fclose(fptr);
+        return 1;
+    }
     int32_t *stackPtr;
     int32_t *memory = cpuCreateMemory(fptr, stackCapacity, &stackPtr);
     struct cpu cp;
     cpuCreate(&cp, memory, stackPtr, stackCapacity);
+    cpuSetProfile(&cp, profile);
+    if (inputPath == NULL && strcmp(argv[1], "trace") == 0) {
+        // stdin is shared with trace commands
+        inputFlags |= cpuInputShared;
+    }
+    cpuSetInput(&cp, input, inputFlags);
+
+    FILE *trace = NULL;
+    if (tracePath != NULL && strcmp(argv[1], "run") == 0 && (trace = fopen(tracePath, "wb")) == NULL) {
+        perror(tracePath);
+    }
 
-    if (strcmp(argv[1], "run") == 0) {
-        int result = cpuRun(&cp, UINT_MAX);
-        state(&cp);
+    FILE *ioLog = NULL;
+    int ret = 0;
+    if (ioLogPath != NULL && strcmp(argv[1], "run") == 0 && (ioLog = io_log(&cp, ioLogPath, ioRecord)) == NULL) {
+        ret = 1;
+    } else if (strcmp(argv[1], "run") == 0 && tracePath != NULL) {
+        int result = trace != NULL ? traceRun(&cp, UINT_MAX, trace) : 0;
+        cpuPrintState(&cp, stdout);
         printf("'cpuRun' result: %d\n", result);
-    } else if (strcmp(argv[1], "trace") == 0) {
-        printf("Press Enter to execute the next instruction or type 'q' to quit.\n");
-        while (true) {
-            int c;
-            if ((c = getchar()) == '\n') {
-                if (cpuStep(&cp) == 0) {
-                    state(&cp);
-                    printf("finished\n");
-                    break;
-                }
-                state(&cp);
-            } else if (c == 'q') {
-                break;
-            }
+    } else if (strcmp(argv[1], "run") == 0) {
+        int result = run(&cp, engine);
+        cpuPrintState(&cp, stdout);
+        printf("'cpuRun' result: %d\n", result);
+        if (countersPath != NULL) {
+            counters(&cp, countersPath);
         }
+    } else if (strcmp(argv[1], "trace") == 0) {
+        debug(&cp);
     } else {
         printf(invalidArgs);
     }
 
+    if (ioLog != NULL) {
+        if (cpuIoLogClose(&cp) != 0) {
+            printf(ioRecord ? "I/O log was not written\n" : "Replay: mismatch\n");
+            ret = 1;
+        } else if (!ioRecord) {
+            printf("Replay: ok\n");
+        }
+        if (fclose(ioLog) != 0) {
+            ret = 1;
+        }
+    }
     fclose(fptr);
+    if (trace != NULL) {
+        fclose(trace);
+    }
     cpuDestroy(&cp);
-    return 0;
+    if (input != stdin) {
+        fclose(input);
+    }
+    return ret;
 }
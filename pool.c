@@ -0,0 +1,218 @@
+/* MAP_ANONYMOUS and huge pages are not part of POSIX */
+#define _DEFAULT_SOURCE
+#include "pool.h"
+#include "cpu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HAVE_MMAP
+#endif
+
+/*
+ * Pool of cpus in one slab. The slab starts with cpu structures (every one on
+ * its own cache lines) followed by memory of the cpus (4KiB aligned). Cpus are
+ * taken from and returned to a free list in O(1) without touching the heap,
+ * programs are loaded by cpuReadMemory. Pages of the slab are allocated by the
+ * system on first touch, so only memory which the programs use is resident.
+ *
+ * A pool is not locked, every thread should have a pool of its own.
+ */
+
+#define POOL_CACHE_LINE 64
+#define POOL_PAGE 4096
+#define POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+struct pool
+{
+    void *block;            // allocated block holding the slab
+    size_t blockSize;       // size of mapping, 0 if the block is allocated by malloc
+    char *slab;
+    char *memories;         // memory of the first cpu
+    size_t count;
+    size_t cpuStride;
+    size_t memorySize;
+    size_t *free;           // indexes of free cpus
+    size_t freeCount;
+    uint8_t *taken;
+    size_t *used;           // bytes of memory of every cpu which may be nonzero besides the stack
+};
+
+
+static size_t align_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+
+/*
+ * Allocate zeroed slab of size bytes (page aligned), by huge pages if asked and possible.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+static int slab_allocate(struct pool *pool, size_t size, int flags)
+{
+#ifdef HAVE_MMAP
+    void *block = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (flags & poolHugePages) {
+        pool->blockSize = align_up(size, POOL_HUGE_PAGE);
+        block = mmap(NULL, pool->blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (block == MAP_FAILED) {
+        // without reserved huge pages transparent ones are asked for
+        pool->blockSize = size;
+        block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            return 1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (flags & poolHugePages) {
+            madvise(block, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    pool->block = block;
+    pool->slab = block;
+    return 0;
+#else
+    (void) flags;
+    pool->block = calloc(size + POOL_PAGE, 1);
+    if (pool->block == NULL) {
+        return 1;
+    }
+    pool->blockSize = 0;
+    pool->slab = (char *) align_up((uintptr_t) pool->block, POOL_PAGE);
+    return 0;
+#endif
+}
+
+
+/*
+ * Allocate pool of count cpus with memory of memorySize bytes each in one slab.
+ *
+ * Args:
+ *      count - number of cpus
+ *      memorySize - size of memory of every cpu in bytes (program and stack, see cpuReadMemory)
+ *      flags - poolHugePages to back the slab by huge pages
+ *
+ * Returns:
+ *      new pool, NULL on allocation error
+ */
+struct pool *poolCreate(size_t count, size_t memorySize, int flags)
+{
+    assert(count > 0);
+
+    struct pool *pool = calloc(1, sizeof(struct pool));
+    if (pool == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return NULL;
+    }
+    pool->count = count;
+    pool->cpuStride = align_up(sizeof(struct cpu), POOL_CACHE_LINE);
+    pool->memorySize = align_up(memorySize, POOL_PAGE);
+    size_t cpusSize = align_up(count * pool->cpuStride, POOL_PAGE);
+    pool->free = malloc(count * sizeof(size_t));
+    pool->taken = calloc(count, sizeof(uint8_t));
+    pool->used = calloc(count, sizeof(size_t));
+    if (pool->free == NULL || pool->taken == NULL || pool->used == NULL ||
+            slab_allocate(pool, cpusSize + count * pool->memorySize, flags) != 0) {
+        fprintf(stderr, "Allocation error!");
+        free(pool->free);
+        free(pool->taken);
+        free(pool->used);
+        free(pool);
+        return NULL;
+    }
+    pool->memories = &pool->slab[cpusSize];
+
+    // the first cpus are taken first
+    for (size_t i = 0; i < count; i++) {
+        pool->free[i] = count - 1 - i;
+    }
+    pool->freeCount = count;
+    return pool;
+}
+
+
+void poolDestroy(struct pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pool->taken[i]) {
+            poolRelease(pool, (struct cpu *) &pool->slab[i * pool->cpuStride]);
+        }
+    }
+#ifdef HAVE_MMAP
+    munmap(pool->block, pool->blockSize);
+#else
+    free(pool->block);
+#endif
+    free(pool->free);
+    free(pool->taken);
+    free(pool->used);
+    free(pool);
+}
+
+
+/*
+ * Take a free cpu of the pool and load program into its memory. The cpu is created
+ * as by cpuCreate (default input, output and profile).
+ *
+ * Args:
+ *      pool - pool of cpus
+ *      program - handle of file where are stored instructions
+ *      stackCapacity - size of stack
+ *
+ * Returns:
+ *      the cpu, NULL if there is no free cpu or the program does not fit
+ */
+struct cpu *poolAcquire(struct pool *pool, FILE *program, size_t stackCapacity)
+{
+    assert(pool != NULL);
+    assert(program != NULL);
+
+    if (pool->freeCount == 0) {
+        return NULL;
+    }
+    size_t index = pool->free[pool->freeCount - 1];
+    struct cpu *cpu = (struct cpu *) &pool->slab[index * pool->cpuStride];
+    int32_t *memory = (int32_t *) &pool->memories[index * pool->memorySize];
+    int32_t *stackBottom;
+    if (cpuReadMemory(program, stackCapacity, memory, pool->memorySize, &pool->used[index], &stackBottom) == NULL) {
+        return NULL;
+    }
+    pool->freeCount--;
+    pool->taken[index] = 1;
+    cpuCreate(cpu, memory, stackBottom, stackCapacity);
+    return cpu;
+}
+
+
+/*
+ * Return the cpu to the pool. Its buffers and decoded program are freed as by cpuDestroy,
+ * memory stays in the slab with the stack cleared up to its high water mark.
+ */
+void poolRelease(struct pool *pool, struct cpu *cpu)
+{
+    assert(pool != NULL);
+    assert(cpu != NULL);
+
+    size_t index = ((char *) cpu - pool->slab) / pool->cpuStride;
+    assert(index < pool->count && pool->taken[index]);
+    assert((char *) cpu == &pool->slab[index * pool->cpuStride]);
+
+    cpuReset(cpu);
+    cpu->memory = NULL;
+    cpuDestroy(cpu);
+    pool->taken[index] = 0;
+    pool->free[pool->freeCount++] = index;
+}
@@ -0,0 +1,38 @@
+#include "cpu.h"
+#include <stdio.h>
+
+
+/* Preallocated slab of cpus with their memory */
+#ifndef POOL_H
+#define POOL_H
+
+struct pool;
+
+enum poolFlags
+{
+    poolHugePages = 1,      // back the slab by huge pages if the system has them
+};
+
+/*
+ * Allocate one slab for count cpus with memory of memorySize bytes each
+ * (see cpuReadMemory), returns NULL on allocation error.
+ */
+struct pool *poolCreate(size_t count, size_t memorySize, int flags);
+
+/*
+ * Release all cpus of the pool (including their decoded programs and buffers) and the slab.
+ */
+void poolDestroy(struct pool *pool);
+
+/*
+ * Take a free cpu of the pool and load program into its memory (as cpuCreateMemory and cpuCreate),
+ * returns NULL if all cpus are taken or the program does not fit.
+ */
+struct cpu *poolAcquire(struct pool *pool, FILE *program, size_t stackCapacity);
+
+/*
+ * Return the cpu to the pool, it is used instead of cpuDestroy.
+ */
+void poolRelease(struct pool *pool, struct cpu *cpu);
+
+#endif
@@ -0,0 +1,164 @@
+#include "cpu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+
+/*
+ * Threaded-code execution engine. Dispatches pre-decoded instructions
+ * (see cpuDecode) from a single loop, with registers held in locals.
+ * Uses labels as values with GCC/Clang, plain switch otherwise. The loop
+ * itself is in threaded_loop.h, it is specialized for every instruction set
+ * profile (the base profile does not track result register) and verified
+ * programs get a copy without checks of instruction pointer.
+ */
+
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+/* Labels as values are an extension, pedantic warnings are off only around them */
+#define EXTENSION_BEGIN _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wpedantic\"")
+#define EXTENSION_END _Pragma("GCC diagnostic pop")
+#endif
+
+#ifdef COMPUTED_GOTO
+#define TARGET(op) case op: label_##op
+#define NEXT()                                                  \
+    do {                                                        \
+        if (i == steps) {                                       \
+            goto finished;                                      \
+        }                                                       \
+        i++;                                                    \
+        if (!VERIFIED && (uint32_t) ip >= (uint32_t) size) {    \
+            goto invalid_address;                               \
+        }                                                       \
+        inst = &decoded[ip];                                    \
+        EXTENSION_BEGIN                                         \
+        goto *labels[inst->op];                                 \
+        EXTENSION_END                                           \
+    } while (0)
+#else
+#define TARGET(op) case op
+#define NEXT() continue
+#endif
+
+/*
+ * Profiles as numbers for the preprocessor (same as enum cpuProfile).
+ */
+#define PROFILE_BASE 0
+#define PROFILE_JMP 1
+#define PROFILE_CALL 2
+
+/*
+ * Copy state held in locals back to the cpu structure.
+ */
+#define SAVE()                              \
+    do {                                    \
+        cpu->A = regs[0];                   \
+        cpu->B = regs[1];                   \
+        cpu->C = regs[2];                   \
+        cpu->D = regs[3];                   \
+        SAVE_RESULT();                      \
+        cpu->stackSize = stackSize;         \
+        cpu->stackHighWater = highWater;    \
+        cpu->instructionPointer = ip;       \
+    } while (0)
+
+#define LOAD()                              \
+    do {                                    \
+        regs[0] = cpu->A;                   \
+        regs[1] = cpu->B;                   \
+        regs[2] = cpu->C;                   \
+        regs[3] = cpu->D;                   \
+        LOAD_RESULT();                      \
+        stackSize = cpu->stackSize;         \
+        highWater = cpu->stackHighWater;    \
+        ip = cpu->instructionPointer;       \
+    } while (0)
+
+
+/*
+ * Dispatch loops by profile, checked and verified.
+ */
+#define NAME threaded_base
+#define PROFILE PROFILE_BASE
+#define VERIFIED 0
+#include "threaded_loop.h"
+
+#define NAME threaded_jmp
+#define PROFILE PROFILE_JMP
+#define VERIFIED 0
+#include "threaded_loop.h"
+
+#define NAME threaded_call
+#define PROFILE PROFILE_CALL
+#define VERIFIED 0
+#include "threaded_loop.h"
+
+#define NAME verified_base
+#define PROFILE PROFILE_BASE
+#define VERIFIED 1
+#include "threaded_loop.h"
+
+#define NAME verified_jmp
+#define PROFILE PROFILE_JMP
+#define VERIFIED 1
+#include "threaded_loop.h"
+
+#define NAME verified_call
+#define PROFILE PROFILE_CALL
+#define VERIFIED 1
+#include "threaded_loop.h"
+
+static int (*const threaded_loops[CPU_PROFILES])(struct cpu*, size_t) = {
+    threaded_base, threaded_jmp, threaded_call
+};
+
+static int (*const verified_loops[CPU_PROFILES])(struct cpu*, size_t) = {
+    verified_base, verified_jmp, verified_call
+};
+
+
+/*
+ * Same as cpuRun, but executes instructions decoded by cpuDecode
+ * in one threaded dispatch loop. The loop is selected by profile of the cpu.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions
+ */
+int cpuRunThreaded(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+
+    return threaded_loops[cpu->profile](cpu, steps);
+}
+
+
+/*
+ * Same as cpuRunThreaded, but instruction pointer is not checked on every
+ * step. It is used only if the program was verified by cpuVerify and the cpu
+ * is on a verified instruction, otherwise cpuRunThreaded is called.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions
+ */
+int cpuRunVerified(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+
+    int32_t start = cpu->instructionPointer;
+    if (cpu->verified == NULL || (uint32_t) start >= (uint32_t) cpu->decodedSize || !cpu->verified[start]) {
+        return cpuRunThreaded(cpu, steps);
+    }
+    return verified_loops[cpu->profile](cpu, steps);
+}
@@ -0,0 +1,319 @@
+/*
+ * Dispatch loop of the threaded engine, included by threaded.c once for every
+ * profile and engine. It defines function NAME running instructions of PROFILE,
+ * with VERIFIED set to 1 the program was proven by cpuVerify, so instruction
+ * pointer is checked only after ret.
+ */
+
+#if PROFILE >= PROFILE_JMP
+#define SAVE_RESULT() cpu->result = result
+#define LOAD_RESULT() result = cpu->result
+#else
+#define SAVE_RESULT() ((void) 0)
+#define LOAD_RESULT() ((void) 0)
+#endif
+
+static int NAME(struct cpu *cpu, size_t steps)
+{
+    size_t i = 0;
+    if (steps <= 0) {
+        return 0;
+    }
+    if (cpu->status != cpuOK) {
+        return cpu->status == cpuHalted ? 1 : -1;
+    }
+
+#ifdef COMPUTED_GOTO
+    EXTENSION_BEGIN
+    static const void *const labels[256] = {
+        [cpuOpNop] = &&label_cpuOpNop,
+        [cpuOpHalt] = &&label_cpuOpHalt,
+        [cpuOpAdd] = &&label_cpuOpAdd,
+        [cpuOpSub] = &&label_cpuOpSub,
+        [cpuOpMul] = &&label_cpuOpMul,
+        [cpuOpDiv] = &&label_cpuOpDiv,
+        [cpuOpInc] = &&label_cpuOpInc,
+        [cpuOpDec] = &&label_cpuOpDec,
+        [cpuOpLoop] = &&label_cpuOpLoop,
+        [cpuOpMovr] = &&label_cpuOpMovr,
+        [cpuOpLoad] = &&label_cpuOpLoad,
+        [cpuOpStore] = &&label_cpuOpStore,
+        [cpuOpIn] = &&label_cpuOpSlow,
+        [cpuOpGet] = &&label_cpuOpSlow,
+        [cpuOpOut] = &&label_cpuOpSlow,
+        [cpuOpPut] = &&label_cpuOpSlow,
+        [cpuOpSwap] = &&label_cpuOpSwap,
+        [cpuOpPush] = &&label_cpuOpPush,
+        [cpuOpPop] = &&label_cpuOpPop,
+#if PROFILE >= PROFILE_JMP
+        [cpuOpCmp] = &&label_cpuOpCmp,
+        [cpuOpJmp] = &&label_cpuOpJmp,
+        [cpuOpJz] = &&label_cpuOpJz,
+        [cpuOpJnz] = &&label_cpuOpJnz,
+        [cpuOpJgt] = &&label_cpuOpJgt,
+#endif
+#if PROFILE >= PROFILE_CALL
+        [cpuOpCall] = &&label_cpuOpCall,
+        [cpuOpRet] = &&label_cpuOpRet,
+#endif
+        [cpuOpTrap] = &&label_cpuOpTrap,
+        [cpuOpSlow] = &&label_cpuOpSlow,
+    };
+    EXTENSION_END
+#endif
+
+    const struct cpuInstruction *decoded = cpu->decoded;
+    const struct cpuInstruction *inst;
+    int32_t size = cpu->decodedSize;
+    int32_t *stackBottom = cpu->stackBottom;
+    int32_t capacity = cpu->stackBottom - cpu->stackLimit;
+    int32_t regs[4];
+    int32_t stackSize;
+    int32_t highWater;
+    int32_t ip;
+#if PROFILE >= PROFILE_JMP
+    int32_t result;
+#endif
+    int32_t val;
+#if VERIFIED && PROFILE >= PROFILE_CALL
+    const uint8_t *verified = cpu->verified;
+#endif
+    LOAD();
+
+    for (;;) {
+        if (i == steps) {
+            goto finished;
+        }
+        i++;
+        if (!VERIFIED && (uint32_t) ip >= (uint32_t) size) {
+            goto invalid_address;
+        }
+        inst = &decoded[ip];
+
+        switch (inst->op) {
+        TARGET(cpuOpNop):
+            ip += 1;
+            NEXT();
+
+        TARGET(cpuOpHalt):
+            ip += 1;
+            cpu->status = cpuHalted;
+            goto finished;
+
+        TARGET(cpuOpAdd):
+            regs[0] += regs[inst->reg];
+#if PROFILE >= PROFILE_JMP
+            result = regs[0];
+#endif
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpSub):
+            regs[0] -= regs[inst->reg];
+#if PROFILE >= PROFILE_JMP
+            result = regs[0];
+#endif
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpMul):
+            regs[0] *= regs[inst->reg];
+#if PROFILE >= PROFILE_JMP
+            result = regs[0];
+#endif
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpDiv):
+            val = regs[inst->reg];
+            if (val == 0) {
+                cpu->status = cpuDivByZero;
+                goto finished;
+            }
+            regs[0] /= val;
+#if PROFILE >= PROFILE_JMP
+            result = regs[0];
+#endif
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpInc):
+            regs[inst->reg] += 1;
+#if PROFILE >= PROFILE_JMP
+            result = regs[inst->reg];
+#endif
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpDec):
+            regs[inst->reg] -= 1;
+#if PROFILE >= PROFILE_JMP
+            result = regs[inst->reg];
+#endif
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpLoop):
+            ip = regs[2] != 0 ? inst->arg : ip + 2;
+            /* The rest of counted loop is run at once */
+            if ((inst->flags & cpuCountedLoop) && (uint32_t) regs[2] >= CPU_LOOP_MIN_ITERATIONS) {
+                SAVE();
+                i += cpuRunLoop(cpu, steps - i);
+                LOAD();
+            }
+            NEXT();
+
+        TARGET(cpuOpMovr):
+            regs[inst->reg] = inst->arg;
+            ip += 3;
+            NEXT();
+
+        TARGET(cpuOpLoad): {
+            int64_t depth = (int64_t) regs[3] + inst->arg + 1;
+            if (depth <= 0 || depth > stackSize) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            regs[inst->reg] = stackBottom[depth - stackSize];
+            ip += 3;
+            NEXT();
+        }
+
+        TARGET(cpuOpStore): {
+            int64_t depth = (int64_t) regs[3] + inst->arg + 1;
+            if (depth <= 0 || depth > stackSize) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            stackBottom[depth - stackSize] = regs[inst->reg];
+            ip += 3;
+            NEXT();
+        }
+
+        TARGET(cpuOpSwap):
+            val = regs[inst->reg];
+            regs[inst->reg] = regs[inst->arg];
+            regs[inst->arg] = val;
+            ip += 3;
+            NEXT();
+
+        TARGET(cpuOpPush):
+            if (stackSize >= capacity) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            stackBottom[-stackSize] = regs[inst->reg];
+            stackSize++;
+            if (stackSize > highWater) {
+                highWater = stackSize;
+            }
+            ip += 2;
+            NEXT();
+
+        TARGET(cpuOpPop):
+            if (stackSize <= 0) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            regs[inst->reg] = stackBottom[-stackSize + 1];
+            stackSize--;
+            ip += 2;
+            NEXT();
+
+#if PROFILE >= PROFILE_JMP
+        TARGET(cpuOpCmp):
+            result = regs[inst->reg] - regs[inst->arg];
+            ip += 3;
+            NEXT();
+
+        TARGET(cpuOpJmp):
+            ip = inst->arg;
+            NEXT();
+
+        TARGET(cpuOpJz):
+            ip = result == 0 ? inst->arg : ip + 2;
+            NEXT();
+
+        TARGET(cpuOpJnz):
+            ip = result != 0 ? inst->arg : ip + 2;
+            NEXT();
+
+        TARGET(cpuOpJgt):
+            ip = result > 0 ? inst->arg : ip + 2;
+            NEXT();
+#endif
+
+#if PROFILE >= PROFILE_CALL
+        TARGET(cpuOpCall):
+            if (stackSize >= capacity) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            stackBottom[-stackSize] = ip + 2;
+            stackSize++;
+            if (stackSize > highWater) {
+                highWater = stackSize;
+            }
+            ip = inst->arg;
+            NEXT();
+
+        TARGET(cpuOpRet):
+            if (stackSize == 0) {
+                cpu->status = cpuInvalidStackOperation;
+                goto finished;
+            }
+            ip = stackBottom[-stackSize + 1];
+            stackSize--;
+            stackBottom[-stackSize] = 0;
+#if VERIFIED
+            /* Return address is not static, the rest runs checked if it is not a verified instruction */
+            if ((uint32_t) ip >= (uint32_t) size || !verified[ip]) {
+                goto unverified;
+            }
+#endif
+            NEXT();
+#endif
+
+        /* Breakpoint, the trapped instruction is not executed */
+        TARGET(cpuOpTrap):
+            i--;
+            goto finished;
+
+        /* I/O and instructions which could not be decoded are left to cpuStep */
+        TARGET(cpuOpSlow):
+        default:
+            SAVE();
+            cpuStep(cpu);
+            LOAD();
+            if (cpu->status != cpuOK) {
+                goto finished;
+            }
+            NEXT();
+        }
+    }
+
+#if VERIFIED && PROFILE >= PROFILE_CALL
+unverified:
+    SAVE();
+    {
+        int rest = cpuRunThreaded(cpu, steps - i);
+        return rest < 0 ? rest - (int) i : rest + (int) i;
+    }
+#endif
+
+invalid_address:
+    cpu->status = cpuInvalidAddress;
+finished:
+    SAVE();
+    if (cpu->status != cpuOK && cpu->status != cpuHalted) {
+        i = -i;
+    }
+    cpuFlush(cpu);
+    return i;
+}
+
+#undef SAVE_RESULT
+#undef LOAD_RESULT
+#undef NAME
+#undef PROFILE
+#undef VERIFIED
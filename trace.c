@@ -0,0 +1,441 @@
+#include "trace.h"
+#include "cpu.h"
+#include "varint.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Binary trace. Header holds magic, version, instruction set profile and initial
+ * state of the cpu (registers, instruction pointer, status and stack). Every
+ * executed instruction has one record with only the changed parts of the state:
+ *      flags       - which parts follow (TRACE_A ... TRACE_STATUS)
+ *      opcode      - opcode at instruction pointer (0xff if it is not valid)
+ *      ip          - change of instruction pointer
+ *      registers   - change of A, B, C, D (and result if the profile has it)
+ *      stack size  - change of stack size (push/pop/call/ret)
+ *      slot, value - stack slot written by push/call/store (counted from bottom) and its value
+ *      status      - new status
+ * Numbers are LEB128 varints, signed ones zigzag encoded. Changes are wrapping
+ * differences, so the common record takes 3-4 bytes.
+ */
+
+#define TRACE_MAGIC "CPUTRACE"
+#define TRACE_VERSION 2
+#define TRACE_BUFFER_SIZE (64 * 1024)
+#define TRACE_MAX_RECORD 64
+
+#define TRACE_REGISTERS 5
+
+enum traceFlags
+{
+    TRACE_A = 1,
+    TRACE_B = 2,
+    TRACE_C = 4,
+    TRACE_D = 8,
+    TRACE_RESULT = 16,
+    TRACE_STACK = 32,
+    TRACE_SLOT = 64,
+    TRACE_STATUS = 128
+};
+
+struct writer
+{
+    FILE *stream;
+    size_t used;
+    int failed;
+    unsigned char buffer[TRACE_BUFFER_SIZE];
+};
+
+
+/*
+ * Number of traced registers, result only with bonus instructions.
+ */
+static int trace_registers(enum cpuProfile profile)
+{
+    return profile >= cpuProfileJmp ? TRACE_REGISTERS : TRACE_REGISTERS - 1;
+}
+
+
+/*
+ * Registers of the cpu (A, B, C, D and result) as unsigned values.
+ */
+static void get_registers(struct cpu *cpu, uint32_t regs[TRACE_REGISTERS])
+{
+    regs[0] = cpu->A;
+    regs[1] = cpu->B;
+    regs[2] = cpu->C;
+    regs[3] = cpu->D;
+    regs[4] = cpu->result;
+}
+
+
+static void set_registers(struct cpu *cpu, const uint32_t regs[TRACE_REGISTERS])
+{
+    cpu->A = regs[0];
+    cpu->B = regs[1];
+    cpu->C = regs[2];
+    cpu->D = regs[3];
+    cpu->result = regs[4];
+}
+
+
+/*
+ * Write buffered records to the trace stream.
+ */
+static void writer_flush(struct writer *writer)
+{
+    if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->stream) != writer->used) {
+        writer->failed = 1;
+    }
+    writer->used = 0;
+}
+
+
+static inline void put_byte(struct writer *writer, unsigned char byte)
+{
+    writer->buffer[writer->used++] = byte;
+}
+
+
+static inline void put_uint(struct writer *writer, uint32_t value)
+{
+    writer->used += varint_put(&writer->buffer[writer->used], value);
+}
+
+
+/*
+ * Write int32 (given as its two's complement) zigzag encoded, small negative values stay short.
+ */
+static inline void put_int(struct writer *writer, uint32_t value)
+{
+    put_uint(writer, zigzag_encode(value));
+}
+
+
+/*
+ * Write magic and initial state of the cpu.
+ */
+static void write_header(struct cpu *cpu, struct writer *writer)
+{
+    uint32_t regs[TRACE_REGISTERS];
+    get_registers(cpu, regs);
+
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), writer->stream);
+    put_byte(writer, TRACE_VERSION);
+    put_byte(writer, cpu->profile);
+    for (int i = 0; i < trace_registers(cpu->profile); i++) {
+        put_int(writer, regs[i]);
+    }
+    put_int(writer, cpu->instructionPointer);
+    put_byte(writer, cpu->status);
+    put_uint(writer, cpu->stackSize);
+    for (int32_t i = 0; i < cpu->stackSize; i++) {
+        if (writer->used > TRACE_BUFFER_SIZE - TRACE_MAX_RECORD) {
+            writer_flush(writer);
+        }
+        put_int(writer, cpu->stackBottom[-i]);
+    }
+}
+
+
+/*
+ * Execute one instruction by cpuStep and write its record.
+ */
+static void trace_step(struct cpu *cpu, struct writer *writer)
+{
+    uint32_t before[TRACE_REGISTERS];
+    uint32_t after[TRACE_REGISTERS];
+    int registers = trace_registers(cpu->profile);
+    get_registers(cpu, before);
+    int32_t ip = cpu->instructionPointer;
+    int32_t stackSize = cpu->stackSize;
+    enum cpuStatus status = cpu->status;
+
+    // stack slot the instruction may write (if it succeeds)
+    int32_t opcode = -1;
+    int64_t slot = -1;
+    if (ip >= 0 && ip <= cpu->stackLimit - cpu->memory) {
+        opcode = cpu->memory[ip];
+        if (opcode == cpuOpPush || opcode == cpuOpCall) {
+            slot = stackSize;
+        } else if (opcode == cpuOpStore && ip + 2 <= cpu->stackLimit - cpu->memory) {
+            slot = stackSize - ((int64_t) cpu->D + cpu->memory[ip + 2] + 1);
+        }
+    }
+
+    if (cpuStep(cpu) == 0 || slot < 0 || slot >= cpu->stackSize) {
+        slot = -1;
+    }
+    get_registers(cpu, after);
+
+    unsigned flags = 0;
+    for (int i = 0; i < registers; i++) {
+        if (after[i] != before[i]) {
+            flags |= TRACE_A << i;
+        }
+    }
+    if (cpu->stackSize != stackSize) {
+        flags |= TRACE_STACK;
+    }
+    if (slot >= 0) {
+        flags |= TRACE_SLOT;
+    }
+    if (cpu->status != status) {
+        flags |= TRACE_STATUS;
+    }
+
+    if (writer->used > TRACE_BUFFER_SIZE - TRACE_MAX_RECORD) {
+        writer_flush(writer);
+    }
+    put_byte(writer, flags);
+    put_byte(writer, opcode >= 0 && opcode < 0xff ? opcode : 0xff);
+    put_int(writer, (uint32_t) cpu->instructionPointer - (uint32_t) ip);
+    for (int i = 0; i < registers; i++) {
+        if (flags & (TRACE_A << i)) {
+            put_int(writer, after[i] - before[i]);
+        }
+    }
+    if (flags & TRACE_STACK) {
+        put_int(writer, (uint32_t) cpu->stackSize - (uint32_t) stackSize);
+    }
+    if (flags & TRACE_SLOT) {
+        put_uint(writer, slot);
+        put_int(writer, cpu->stackBottom[-slot]);
+    }
+    if (flags & TRACE_STATUS) {
+        put_byte(writer, cpu->status);
+    }
+}
+
+
+/*
+ * Same as cpuRun, but every instruction is executed by cpuStep and its record
+ * is written to trace (one run per trace file). Records are collected in buffer,
+ * so tracing costs a few comparisons and bytes per instruction.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *      trace - stream for the trace
+ *
+ * Returns:
+ *      number of successfully completed instructions (same as cpuRun)
+ */
+int traceRun(struct cpu *cpu, size_t steps, FILE *trace)
+{
+    assert(cpu != NULL);
+    assert(trace != NULL);
+
+    struct writer *writer = malloc(sizeof(struct writer));
+    if (writer == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return cpuRun(cpu, steps);
+    }
+    writer->stream = trace;
+    writer->used = 0;
+    writer->failed = 0;
+    write_header(cpu, writer);
+
+    size_t i = 0;
+    while (i < steps) {
+        trace_step(cpu, writer);
+        i++;
+        if (cpu->status == cpuHalted) {
+            break;
+        }
+        if (cpu->status != cpuOK) {
+            i = -i;
+            break;
+        }
+    }
+    cpuFlush(cpu);
+
+    writer_flush(writer);
+    if (writer->failed || fflush(trace) != 0) {
+        fprintf(stderr, "Cannot write trace\n");
+    }
+    free(writer);
+    return i;
+}
+
+
+static uint32_t get_uint(FILE *trace, int *failed)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    for (int n = 0; n < VARINT_MAX_32; n++) {
+        int c = getc(trace);
+        if (c == EOF) {
+            break;
+        }
+        if (varint_push(&value, &shift, c)) {
+            return value;
+        }
+    }
+    *failed = 1;
+    return 0;
+}
+
+
+/*
+ * Read zigzag encoded int32, returns its two's complement.
+ */
+static uint32_t get_int(FILE *trace, int *failed)
+{
+    return zigzag_decode(get_uint(trace, failed));
+}
+
+
+static int get_status(FILE *trace, int *failed)
+{
+    int c = getc(trace);
+    if (c == EOF || c > cpuIOError) {
+        *failed = 1;
+        return cpuOK;
+    }
+    return c;
+}
+
+
+/*
+ * Stack of decoded cpu, it grows towards lower addresses as the real one.
+ */
+struct stack
+{
+    int32_t *values;
+    size_t capacity;
+};
+
+
+/*
+ * Make room for size values, cpu->stackBottom is moved to the new stack.
+ *
+ * Returns:
+ *      0 if ok, 1 on allocation error
+ */
+static int stack_reserve(struct stack *stack, struct cpu *cpu, size_t size)
+{
+    if (size <= stack->capacity) {
+        return 0;
+    }
+    size_t capacity = stack->capacity < 64 ? 64 : stack->capacity;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    int32_t *values = calloc(capacity, sizeof(int32_t));
+    if (values == NULL) {
+        fprintf(stderr, "Allocation error!");
+        return 1;
+    }
+    if (stack->capacity > 0) {
+        memcpy(&values[capacity - stack->capacity], stack->values, stack->capacity * sizeof(int32_t));
+    }
+    free(stack->values);
+    stack->values = values;
+    stack->capacity = capacity;
+    cpu->stackBottom = &values[capacity - 1];
+    return 0;
+}
+
+
+/*
+ * Decode trace written by traceRun. State of the cpu after every instruction is
+ * printed by cpuPrintState, as by interactive trace.
+ *
+ * Args:
+ *      trace - stream with the trace
+ *      out - stream for states
+ *
+ * Returns:
+ *      0 if ok, 1 if the trace is not valid
+ */
+int traceDecode(FILE *trace, FILE *out)
+{
+    assert(trace != NULL);
+    assert(out != NULL);
+
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    int profile = EOF;
+    if (fread(magic, 1, sizeof(magic), trace) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+            || getc(trace) != TRACE_VERSION || (profile = getc(trace)) == EOF || profile >= CPU_PROFILES) {
+        fprintf(stderr, "Not a trace of this cpu\n");
+        return 1;
+    }
+
+    struct cpu cpu;
+    struct stack stack = { NULL, 0 };
+    uint32_t regs[TRACE_REGISTERS] = { 0 };
+    int registers = trace_registers(profile);
+    int failed = 0;
+    memset(&cpu, 0, sizeof(cpu));
+    cpu.profile = profile;
+
+    for (int i = 0; i < registers; i++) {
+        regs[i] = get_int(trace, &failed);
+    }
+    set_registers(&cpu, regs);
+    cpu.instructionPointer = get_int(trace, &failed);
+    cpu.status = get_status(trace, &failed);
+    uint32_t stackSize = get_uint(trace, &failed);
+    if (failed || stackSize > INT32_MAX || stack_reserve(&stack, &cpu, stackSize) != 0) {
+        failed = 1;
+        stackSize = 0;
+    }
+    cpu.stackSize = stackSize;
+    for (int32_t i = 0; i < cpu.stackSize; i++) {
+        cpu.stackBottom[-i] = get_int(trace, &failed);
+    }
+
+    int flags;
+    while (!failed && (flags = getc(trace)) != EOF) {
+        // opcode is only informative, the state is given by changes
+        if (getc(trace) == EOF) {
+            failed = 1;
+            break;
+        }
+        cpu.instructionPointer += get_int(trace, &failed);
+        for (int i = 0; i < registers; i++) {
+            if (flags & (TRACE_A << i)) {
+                regs[i] += get_int(trace, &failed);
+            }
+        }
+        set_registers(&cpu, regs);
+        if (flags & TRACE_STACK) {
+            stackSize += get_int(trace, &failed);
+            if (stackSize > INT32_MAX || stack_reserve(&stack, &cpu, stackSize) != 0) {
+                failed = 1;
+                break;
+            }
+            cpu.stackSize = stackSize;
+        }
+        if (flags & TRACE_SLOT) {
+            uint32_t slot = get_uint(trace, &failed);
+            int32_t value = get_int(trace, &failed);
+            if (slot >= stackSize) {
+                failed = 1;
+                break;
+            }
+            cpu.stackBottom[-(int32_t) slot] = value;
+        }
+        if (flags & TRACE_STATUS) {
+            cpu.status = get_status(trace, &failed);
+        }
+        if (failed) {
+            break;
+        }
+
+        cpuPrintState(&cpu, out);
+        if (cpu.status != cpuOK) {
+            fprintf(out, "finished\n");
+        }
+    }
+
+    free(stack.values);
+    if (failed) {
+        fprintf(stderr, "Trace is corrupted\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include "cpu.h"
+#include <stdio.h>
+
+
+/* Binary trace of executed instructions */
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Same as cpuRun, but writes compact record of every executed instruction to trace.
+ */
+int traceRun(struct cpu *cpu, size_t steps, FILE *trace);
+
+/*
+ * Print state of the cpu after every instruction of trace to out (same format as cpuPrintState),
+ * returns 0 if ok, 1 if the trace is not valid.
+ */
+int traceDecode(FILE *trace, FILE *out);
+
+#endif
@@ -0,0 +1,537 @@
+#include "cpu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Ahead-of-time translation of a program to C. Every word of the program gets
+ * a label with the code of the instruction decoded at it (see cpuDecode),
+ * registers are locals of one function and jumps to constant addresses are gotos.
+ * The unit is compiled by the system C compiler to a shared library which
+ * cpuNativeCreate loads in place of the interpreter.
+ *
+ * Translated code sets the same status as cpuStep with instruction pointer
+ * at the faulting instruction. I/O and instructions which could not be decoded
+ * are executed by cpuStep through a callback of the host, so are addresses
+ * outside of the translated part of memory.
+ */
+
+/*
+ * State shared with the translated code, the same declaration is written
+ * to every translation unit.
+ */
+#define NATIVE_STATE                                                    \
+    struct nativeState                                                  \
+    {                                                                   \
+        int32_t regs[5];                                                \
+        int32_t stackSize;                                              \
+        int32_t stackHighWater;                                         \
+        int32_t instructionPointer;                                     \
+        int32_t status;                                                 \
+        int32_t capacity;                                               \
+        int32_t *stackBottom;                                           \
+        void *cpu;                                                      \
+        void (*step)(struct nativeState *state);                        \
+        int64_t (*loop)(struct nativeState *state, int64_t steps);      \
+    }
+
+#define STRING(x) #x
+#define EXPAND(x) STRING(x)
+
+NATIVE_STATE;
+
+/* Words after the last nonzero one which are translated too (operands of the last instruction) */
+#define NATIVE_TAIL 2
+
+
+/*
+ * Returns:
+ *      number of translated words of the program (memory has to be decoded)
+ */
+static int32_t native_words(const struct cpu *cpu)
+{
+    int32_t words = cpu->decodedSize;
+    while (words > 0 && cpu->memory[words - 1] == 0) {
+        words--;
+    }
+    words += NATIVE_TAIL;
+    return words < cpu->decodedSize ? words : cpu->decodedSize;
+}
+
+
+/*
+ * FNV-1a of the translated words and the profile, translated code is used only
+ * for the same program.
+ */
+static uint32_t native_hash(const struct cpu *cpu, int32_t words)
+{
+    uint32_t hash = 2166136261u;
+    for (int32_t i = 0; i < words; i++) {
+        uint32_t word = (uint32_t) cpu->memory[i];
+        for (int byte = 0; byte < 4; byte++) {
+            hash = (hash ^ ((word >> (8 * byte)) & 0xff)) * 16777619u;
+        }
+    }
+    return (hash ^ (uint32_t) cpu->profile) * 16777619u;
+}
+
+
+/*
+ * Write jump to target, addresses outside of the translated words go through dispatch.
+ */
+static void emit_jump(FILE *out, int32_t target, int32_t words)
+{
+    if (target >= 0 && target < words) {
+        fprintf(out, "goto L%" PRId32 ";", target);
+    } else {
+        fprintf(out, "{ ip = %" PRId32 "; goto dispatch; }", target);
+    }
+}
+
+
+/*
+ * Write code of one decoded instruction at ip (the label is already written).
+ */
+static void emit_instruction(FILE *out, const struct cpu *cpu, const struct cpuInstruction *inst,
+                             int32_t ip, int32_t words)
+{
+    static const char names[] = "ABCD";
+    char reg = names[inst->reg & 3];
+    char second = names[inst->arg & 3];
+    int result = cpu->profile >= cpuProfileJmp;
+    int32_t next = ip + inst->length;
+
+    if (inst->op == cpuOpSlow || inst->op == cpuOpTrap || inst->op == cpuOpIn ||
+            inst->op == cpuOpGet || inst->op == cpuOpOut || inst->op == cpuOpPut) {
+        fprintf(out, "    ip = %" PRId32 "; goto slow;\n", ip);
+        return;
+    }
+
+    fprintf(out, "    STEP(%" PRId32 ");\n", ip);
+    switch (inst->op) {
+    case cpuOpNop:
+        break;
+    case cpuOpHalt:
+        fprintf(out, "    s->status = %d; ip = %" PRId32 "; goto finished;\n", cpuHalted, next);
+        return;
+    case cpuOpAdd:
+    case cpuOpSub:
+    case cpuOpMul:
+        fprintf(out, "    A = %s(A, %c);\n", inst->op == cpuOpAdd ? "ADD" : inst->op == cpuOpSub ? "SUB" : "MUL", reg);
+        if (result) {
+            fprintf(out, "    R = A;\n");
+        }
+        break;
+    case cpuOpDiv:
+        fprintf(out, "    if (%c == 0) FAULT(%d, %" PRId32 ");\n", reg, cpuDivByZero, ip);
+        fprintf(out, "    A /= %c;\n", reg);
+        if (result) {
+            fprintf(out, "    R = A;\n");
+        }
+        break;
+    case cpuOpInc:
+    case cpuOpDec:
+        fprintf(out, "    %c = %s(%c, 1);\n", reg, inst->op == cpuOpInc ? "ADD" : "SUB", reg);
+        if (result) {
+            fprintf(out, "    R = %c;\n", reg);
+        }
+        break;
+    case cpuOpLoop:
+        fprintf(out, "    if (C != 0) {\n");
+        if (inst->flags & cpuCountedLoop) {
+            /* Counted loop (see cpuRunLoop) is run at once by the host */
+            fprintf(out, "        if ((uint32_t) C >= %d) { ip = %" PRId32 "; SAVE(); left -= s->loop(s, left); LOAD(); goto dispatch; }\n",
+                    CPU_LOOP_MIN_ITERATIONS, inst->arg);
+        }
+        fprintf(out, "        ");
+        emit_jump(out, inst->arg, words);
+        fprintf(out, "\n    }\n");
+        break;
+    case cpuOpMovr:
+        fprintf(out, "    %c = %" PRId32 ";\n", reg, inst->arg);
+        break;
+    case cpuOpLoad:
+    case cpuOpStore:
+        fprintf(out, "    depth = (int64_t) D + %" PRId32 " + 1;\n", inst->arg);
+        fprintf(out, "    if (depth <= 0 || depth > stackSize) FAULT(%d, %" PRId32 ");\n", cpuInvalidStackOperation, ip);
+        if (inst->op == cpuOpLoad) {
+            fprintf(out, "    %c = stack[depth - stackSize];\n", reg);
+        } else {
+            fprintf(out, "    stack[depth - stackSize] = %c;\n", reg);
+        }
+        break;
+    case cpuOpSwap:
+        fprintf(out, "    val = %c; %c = %c; %c = val;\n", reg, reg, second, second);
+        break;
+    case cpuOpPush:
+        fprintf(out, "    if (stackSize >= capacity) FAULT(%d, %" PRId32 ");\n", cpuInvalidStackOperation, ip);
+        fprintf(out, "    stack[-stackSize] = %c; PUSHED();\n", reg);
+        break;
+    case cpuOpPop:
+        fprintf(out, "    if (stackSize <= 0) FAULT(%d, %" PRId32 ");\n", cpuInvalidStackOperation, ip);
+        fprintf(out, "    %c = stack[-stackSize + 1]; stackSize--;\n", reg);
+        break;
+    case cpuOpCmp:
+        fprintf(out, "    R = SUB(%c, %c);\n", reg, second);
+        break;
+    case cpuOpJmp:
+        fprintf(out, "    ");
+        emit_jump(out, inst->arg, words);
+        fprintf(out, "\n");
+        return;
+    case cpuOpJz:
+    case cpuOpJnz:
+    case cpuOpJgt:
+        fprintf(out, "    if (R %s 0) ", inst->op == cpuOpJz ? "==" : inst->op == cpuOpJnz ? "!=" : ">");
+        emit_jump(out, inst->arg, words);
+        fprintf(out, "\n");
+        break;
+    case cpuOpCall:
+        fprintf(out, "    if (stackSize >= capacity) FAULT(%d, %" PRId32 ");\n", cpuInvalidStackOperation, ip);
+        fprintf(out, "    stack[-stackSize] = %" PRId32 "; PUSHED();\n    ", next);
+        emit_jump(out, inst->arg, words);
+        fprintf(out, "\n");
+        return;
+    case cpuOpRet:
+        fprintf(out, "    if (stackSize == 0) FAULT(%d, %" PRId32 ");\n", cpuInvalidStackOperation, ip);
+        fprintf(out, "    ip = stack[-stackSize + 1]; stackSize--; stack[-stackSize] = 0; goto dispatch;\n");
+        return;
+    }
+    if (next != ip + 1 || next >= words) {
+        fprintf(out, "    ");
+        emit_jump(out, next, words);
+        fprintf(out, "\n");
+    }
+}
+
+
+/*
+ * Write C translation of the program in memory of the cpu. The cpu has to be decoded
+ * by cpuDecode and its stack has to be empty, the translation is valid only for the same
+ * program and profile. Compiled translation exports:
+ *      int64_t native_run(struct nativeState *state, int64_t steps) - run steps, returns steps done
+ *      native_words, native_hash, native_profile - translated program
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      out - stream for the translation unit
+ *
+ * Returns:
+ *      0 if ok, 1 on write error
+ */
+int cpuTranslate(struct cpu *cpu, FILE *out)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+    assert(out != NULL);
+
+    int32_t words = native_words(cpu);
+
+    fprintf(out, "/* Translated by ./cpu translate, %" PRId32 " words, profile %s */\n", words, cpuProfileName(cpu->profile));
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "%s;\n\n", EXPAND(NATIVE_STATE));
+    fprintf(out, "#define ADD(x, y) ((int32_t) ((uint32_t) (x) + (uint32_t) (y)))\n");
+    fprintf(out, "#define SUB(x, y) ((int32_t) ((uint32_t) (x) - (uint32_t) (y)))\n");
+    fprintf(out, "#define MUL(x, y) ((int32_t) ((uint32_t) (x) * (uint32_t) (y)))\n");
+    fprintf(out, "#define STEP(at) do { if (left == 0) { ip = (at); goto finished; } left--; } while (0)\n");
+    fprintf(out, "#define FAULT(code, at) do { s->status = (code); ip = (at); goto finished; } while (0)\n");
+    fprintf(out, "#define PUSHED() do { stackSize++; if (stackSize > highWater) highWater = stackSize; } while (0)\n");
+    fprintf(out, "#define SAVE() do { s->regs[0] = A; s->regs[1] = B; s->regs[2] = C; s->regs[3] = D; s->regs[4] = R; "
+                 "s->stackSize = stackSize; s->stackHighWater = highWater; s->instructionPointer = ip; } while (0)\n");
+    fprintf(out, "#define LOAD() do { A = s->regs[0]; B = s->regs[1]; C = s->regs[2]; D = s->regs[3]; R = s->regs[4]; "
+                 "stackSize = s->stackSize; highWater = s->stackHighWater; ip = s->instructionPointer; } while (0)\n\n");
+    fprintf(out, "const int32_t native_words = %" PRId32 ";\n", words);
+    fprintf(out, "const uint32_t native_hash = %" PRIu32 "u;\n", native_hash(cpu, words));
+    fprintf(out, "const int32_t native_profile = %d;\n\n", (int) cpu->profile);
+
+    fprintf(out, "int64_t native_run(struct nativeState *s, int64_t steps)\n{\n");
+    fprintf(out, "    int32_t A, B, C, D, R, stackSize, highWater, ip, val;\n");
+    fprintf(out, "    int32_t *stack = s->stackBottom;\n");
+    fprintf(out, "    int32_t capacity = s->capacity;\n");
+    fprintf(out, "    int64_t left = steps;\n");
+    fprintf(out, "    int64_t depth;\n");
+    fprintf(out, "    (void) val;\n    (void) depth;\n");
+    fprintf(out, "    LOAD();\n\n");
+
+    fprintf(out, "dispatch:\n    switch (ip) {\n");
+    for (int32_t ip = 0; ip < words; ip++) {
+        fprintf(out, "    case %" PRId32 ": goto L%" PRId32 ";\n", ip, ip);
+    }
+    fprintf(out, "    }\n\n");
+
+    fprintf(out, "    /* I/O, instructions which could not be decoded and addresses out of the translation */\n");
+    fprintf(out, "slow:\n");
+    fprintf(out, "    STEP(ip);\n");
+    fprintf(out, "    SAVE();\n    s->step(s);\n    LOAD();\n");
+    fprintf(out, "    if (s->status != %d) goto finished;\n", cpuOK);
+    fprintf(out, "    goto dispatch;\n\n");
+
+    for (int32_t ip = 0; ip < words; ip++) {
+        fprintf(out, "L%" PRId32 ":\n", ip);
+        emit_instruction(out, cpu, &cpu->decoded[ip], ip, words);
+    }
+
+    fprintf(out, "\nfinished:\n    SAVE();\n    return steps - left;\n}\n");
+    fflush(out);
+    return ferror(out) ? 1 : 0;
+}
+
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#ifndef NATIVE_COMPILER
+#define NATIVE_COMPILER "cc"
+#endif
+
+struct cpuNative
+{
+    void *library;
+    int64_t (*run)(struct nativeState *state, int64_t steps);
+};
+
+
+static void state_load(struct nativeState *state, struct cpu *cpu)
+{
+    state->regs[0] = cpu->A;
+    state->regs[1] = cpu->B;
+    state->regs[2] = cpu->C;
+    state->regs[3] = cpu->D;
+    state->regs[4] = cpu->result;
+    state->stackSize = cpu->stackSize;
+    state->stackHighWater = cpu->stackHighWater;
+    state->instructionPointer = cpu->instructionPointer;
+    state->status = cpu->status;
+}
+
+
+static void state_store(const struct nativeState *state, struct cpu *cpu)
+{
+    cpu->A = state->regs[0];
+    cpu->B = state->regs[1];
+    cpu->C = state->regs[2];
+    cpu->D = state->regs[3];
+    cpu->result = state->regs[4];
+    cpu->stackSize = state->stackSize;
+    cpu->stackHighWater = state->stackHighWater;
+    cpu->instructionPointer = state->instructionPointer;
+    cpu->status = state->status;
+}
+
+
+/*
+ * Callback of translated code, executes the instruction at the instruction pointer by cpuStep.
+ */
+static void native_step(struct nativeState *state)
+{
+    struct cpu *cpu = state->cpu;
+    state_store(state, cpu);
+    cpuStep(cpu);
+    state_load(state, cpu);
+}
+
+
+/*
+ * Callback of translated code, runs the counted loop at the instruction pointer by cpuRunLoop.
+ */
+static int64_t native_loop(struct nativeState *state, int64_t steps)
+{
+    struct cpu *cpu = state->cpu;
+    state_store(state, cpu);
+    size_t done = cpuRunLoop(cpu, steps);
+    state_load(state, cpu);
+    return done;
+}
+
+
+/*
+ * Translate the program to directory/program.c and compile it to directory/program.so
+ * by $CC (NATIVE_COMPILER by default).
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise
+ */
+static int native_compile(struct cpu *cpu, const char *directory, char *library, size_t size)
+{
+    char source[64];
+    snprintf(source, sizeof(source), "%s/program.c", directory);
+    snprintf(library, size, "%s/program.so", directory);
+
+    FILE *out = fopen(source, "w");
+    if (out == NULL) {
+        perror(source);
+        return 1;
+    }
+    int ret = cpuTranslate(cpu, out);
+    if (fclose(out) != 0 || ret != 0) {
+        unlink(source);
+        return 1;
+    }
+
+    const char *compiler = getenv("CC");
+    if (compiler == NULL || compiler[0] == '\0') {
+        compiler = NATIVE_COMPILER;
+    }
+    size_t length = strlen(compiler) + 2 * strlen(directory) + 64;
+    char *command = malloc(length);
+    if (command == NULL) {
+        fprintf(stderr, "Allocation error!");
+        unlink(source);
+        return 1;
+    }
+    snprintf(command, length, "%s -O2 -shared -fPIC -o %s/program.so %s/program.c", compiler, directory, directory);
+    ret = system(command) != 0;
+    free(command);
+    unlink(source);
+    return ret;
+}
+
+
+/*
+ * Load translation of the program of the cpu, instructions have to be decoded by cpuDecode.
+ * Without library the program is translated by cpuTranslate and compiled by the system
+ * C compiler ($CC or cc) in a temporary directory.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      library - shared library compiled from cpuTranslate output, NULL to compile it now
+ *
+ * Returns:
+ *      0 if ok, 1 otherwise (no compiler, library of other program, unsupported platform)
+ */
+int cpuNativeCreate(struct cpu *cpu, const char *library)
+{
+    assert(cpu != NULL);
+    assert(cpu->decoded != NULL);
+
+    char directory[] = "/tmp/cpu-native-XXXXXX";
+    char compiled[64];
+    if (library == NULL) {
+        if (mkdtemp(directory) == NULL) {
+            perror(directory);
+            return 1;
+        }
+        if (native_compile(cpu, directory, compiled, sizeof(compiled)) != 0) {
+            unlink(compiled);
+            rmdir(directory);
+            return 1;
+        }
+    }
+
+    void *handle = dlopen(library != NULL ? library : compiled, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        unlink(compiled);
+        rmdir(directory);
+    }
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 1;
+    }
+
+    const int32_t *words = dlsym(handle, "native_words");
+    const uint32_t *hash = dlsym(handle, "native_hash");
+    const int32_t *profile = dlsym(handle, "native_profile");
+    void *run = dlsym(handle, "native_run");
+    if (words == NULL || hash == NULL || profile == NULL || run == NULL || *words > cpu->decodedSize ||
+            *profile != (int32_t) cpu->profile || *hash != native_hash(cpu, *words)) {
+        fprintf(stderr, "Native code does not match the program\n");
+        dlclose(handle);
+        return 1;
+    }
+
+    struct cpuNative *native = malloc(sizeof(struct cpuNative));
+    if (native == NULL) {
+        fprintf(stderr, "Allocation error!");
+        dlclose(handle);
+        return 1;
+    }
+    native->library = handle;
+    memcpy(&native->run, &run, sizeof(native->run));
+    cpuNativeDestroy(cpu);
+    cpu->native = native;
+    return 0;
+}
+
+
+/*
+ * Unload translated program of the cpu.
+ */
+void cpuNativeDestroy(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->native == NULL) {
+        return;
+    }
+    dlclose(cpu->native->library);
+    free(cpu->native);
+    cpu->native = NULL;
+}
+
+
+/*
+ * Same as cpuRun, but executes the translated program loaded by cpuNativeCreate.
+ *
+ * Args:
+ *      cpu - emulated cpu structure
+ *      steps - number of instructions to do
+ *
+ * Returns:
+ *      number of successfully completed instructions
+ */
+int cpuRunNative(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+    assert(cpu->native != NULL);
+
+    if (steps <= 0) {
+        return 0;
+    }
+    if (cpu->status != cpuOK) {
+        return cpu->status == cpuHalted ? 1 : -1;
+    }
+
+    struct nativeState state;
+    state_load(&state, cpu);
+    state.capacity = cpu->stackBottom - cpu->stackLimit;
+    state.stackBottom = cpu->stackBottom;
+    state.cpu = cpu;
+    state.step = native_step;
+    state.loop = native_loop;
+
+    int64_t budget = steps > INT64_MAX ? INT64_MAX : (int64_t) steps;
+    size_t i = cpu->native->run(&state, budget);
+    state_store(&state, cpu);
+    if (cpu->status != cpuOK && cpu->status != cpuHalted) {
+        i = -i;
+    }
+    cpuFlush(cpu);
+    return i;
+}
+
+#else
+
+int cpuNativeCreate(struct cpu *cpu, const char *library)
+{
+    (void) cpu;
+    (void) library;
+    return 1;
+}
+
+
+void cpuNativeDestroy(struct cpu *cpu)
+{
+    (void) cpu;
+}
+
+
+int cpuRunNative(struct cpu *cpu, size_t steps)
+{
+    return cpuRun(cpu, steps);
+}
+
+#endif
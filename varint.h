@@ -0,0 +1,102 @@
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* LEB128 varints and zigzag encoding of binary formats (trace, compact bytecode and I/O log) */
+#ifndef VARINT_H
+#define VARINT_H
+
+/* Maximal number of bytes of varint of 32 and 64 bit value */
+#define VARINT_MAX_32 5
+#define VARINT_MAX_64 10
+
+/*
+ * Map int32 (given as its two's complement) to uint32, small negative values stay small.
+ */
+static inline uint32_t zigzag_encode(uint32_t value)
+{
+    return (value << 1) ^ (0u - (value >> 31));
+}
+
+
+/*
+ * Inverse of zigzag_encode, returns two's complement of the int32.
+ */
+static inline uint32_t zigzag_decode(uint32_t value)
+{
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+
+/*
+ * Write varint of value to out, which has room for it (VARINT_MAX_32 bytes for values
+ * which fit to 32 bits).
+ *
+ * Returns:
+ *      number of written bytes
+ */
+static inline size_t varint_put(uint8_t *out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
+    return n;
+}
+
+
+/*
+ * Add the next byte of varint to value, shift is the number of bits added so far
+ * (both start at 0). Callers read at most VARINT_MAX_64 bytes.
+ *
+ * Returns:
+ *      1 if it was the last byte of the varint, 0 otherwise
+ */
+static inline int varint_push(uint64_t *value, int *shift, uint8_t byte)
+{
+    *value |= (uint64_t) (byte & 0x7f) << *shift;
+    *shift += 7;
+    return !(byte & 0x80);
+}
+
+
+/*
+ * Read varint of at most maxBytes bytes from *pc up to end.
+ *
+ * Returns:
+ *      0 if ok, 1 if the varint is invalid
+ */
+static inline int varint_read(const uint8_t **pc, const uint8_t *end, int maxBytes, uint64_t *value)
+{
+    uint64_t result = 0;
+    int shift = 0;
+    for (int n = 0; n < maxBytes && *pc < end; n++) {
+        if (varint_push(&result, &shift, *(*pc)++)) {
+            *value = result;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Read varint of 32 bit value which is known to be valid (encoded by this process).
+ */
+static inline uint32_t varint_get(const uint8_t **pc)
+{
+    const uint8_t *p = *pc;
+    uint32_t value = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        value |= (uint32_t) (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint32_t) *p++ << shift;
+    *pc = p;
+    return value;
+}
+
+#endif